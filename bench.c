@@ -0,0 +1,734 @@
+#include "helpers.h"
+#include "virtual_alloc.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// benchmarks for the virtual heap. these aren't tests, so nothing is checked,
+// only measured. build with `make bench`
+
+#define HEAP_SIZE 24
+#define MIN_SIZE 4
+
+#define CACHE_THREADS 1000
+#define CACHE_ITERATIONS 2000
+#define CACHE_LIVE 4
+
+#define LATENCY_THREADS 4
+#define LATENCY_ITERATIONS 20000
+#define LATENCY_LIVE 64
+#define LATENCY_BURST 32
+#define LATENCY_ROUNDS 5
+
+#define BUMP_ROUNDS 100
+#define BUMP_SLICES 10000
+
+#define FIFO_MESSAGES 200000
+#define FIFO_WINDOW 256
+
+#define APPEND_VECTORS 16
+#define APPEND_STEP 16
+#define APPEND_LENGTH (1 << 16)
+#define APPEND_OTHER 32
+
+#define CHASE_FILLER (1 << 16)
+#define CHASE_LISTS 256
+#define CHASE_NODES (1 << 14)
+#define CHASE_ROUNDS 20
+
+#define MIXED_ROUNDS 2000
+#define MIXED_TRANSIENT 64
+#define MIXED_SAMPLES 5
+#define MIXED_HEAP 20
+#define MIXED_PAGE 12
+
+#define PLACEMENT_HEAP 22
+#define PLACEMENT_SLOTS 1024
+#define PLACEMENT_OPS 200000
+
+#define REQUEST_THREADS 4
+#define REQUEST_COUNT 2000
+#define REQUEST_OBJECTS 64
+#define REQUEST_HEAP 15
+
+// the heap lives in a region of its own rather than at the real program break,
+// since libc's malloc moves that as well
+#define REGION_SIZE ((size_t) 2 << HEAP_SIZE)
+
+void* virtual_heap;
+size_t region_break;
+
+// holds every thread at the end of its work until the main thread has measured
+// the heap, so that idle threads still have their caches
+pthread_barrier_t idle_barrier;
+
+void* virtual_sbrk(int32_t increment) {
+    if (region_break + increment > REGION_SIZE)
+        return (void*) -1;
+
+    void* old_break = (uint8_t*) virtual_heap + region_break;
+    region_break += increment;
+
+    return old_break;
+}
+
+/**
+ * Returns the current time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the number of bytes shown as allocated by virtual_info.
+ */
+static uint64_t allocated_bytes(void) {
+    FILE* out = tmpfile();
+    int old_stdout = dup(fileno(stdout));
+
+    fflush(stdout);
+    dup2(fileno(out), fileno(stdout));
+    virtual_info(virtual_heap);
+    fflush(stdout);
+    dup2(old_stdout, fileno(stdout));
+    close(old_stdout);
+
+    uint64_t total = 0;
+    char state[16];
+    unsigned int size;
+
+    rewind(out);
+    while (fscanf(out, "%15s %u", state, &size) == 2) {
+        if (strcmp(state, "allocated") == 0)
+            total += size;
+    }
+
+    fclose(out);
+    return total;
+}
+
+static int compare_latency(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Starts `count` threads running `work` with a small stack each, and waits for
+ * them to finish.
+ */
+static void run_threads(int count, void* (*work)(void*)) {
+    pthread_t* threads = malloc(count * sizeof(pthread_t));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 1 << 16);
+
+    for (uintptr_t i = 0; i < count; i++)
+        pthread_create(&threads[i], &attr, work, (void*) i);
+
+    for (int i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_attr_destroy(&attr);
+    free(threads);
+}
+
+static void* cache_thread(void* arg) {
+    unsigned int seed = (uintptr_t) arg;
+    void* live[CACHE_LIVE] = {NULL};
+
+    for (int i = 0; i < CACHE_ITERATIONS; i++) {
+        int slot = rand_r(&seed) % CACHE_LIVE;
+
+        if (live[slot] != NULL) {
+            virtual_free(virtual_heap, live[slot]);
+            live[slot] = NULL;
+        } else {
+            live[slot] = virtual_malloc(virtual_heap, 16 + rand_r(&seed) % 496);
+        }
+    }
+
+    for (int i = 0; i < CACHE_LIVE; i++)
+        virtual_free(virtual_heap, live[i]);
+
+    pthread_barrier_wait(&idle_barrier);
+    pthread_barrier_wait(&idle_barrier);
+
+    return NULL;
+}
+
+static void* cache_main(void* arg) {
+    // wait for every thread to go idle, then measure what they are holding
+    double start = now();
+    pthread_barrier_wait(&idle_barrier);
+    double elapsed = now() - start;
+
+    uint64_t ops = (uint64_t) CACHE_THREADS * CACHE_ITERATIONS;
+    printf("%-10s %12.0f ops/s %10lu bytes held by idle threads\n",
+           (char*) arg, ops / elapsed, allocated_bytes());
+
+    pthread_barrier_wait(&idle_barrier);
+    return NULL;
+}
+
+/**
+ * Compares throughput, and the memory held in caches by threads that have gone
+ * idle, between per-thread and per-CPU caches with many threads.
+ */
+static void bench_caches(void) {
+    printf("caches: %d threads, %d mallocs and frees each\n", CACHE_THREADS,
+           CACHE_ITERATIONS);
+
+    const char* names[] = {"tcache", "pcpu"};
+    for (int mode = 0; mode < 2; mode++) {
+        init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+        if (mode == 0)
+            virtual_tcache_enable(virtual_heap, 16, 1 << 14);
+        else
+            virtual_pcpu_enable(virtual_heap, 16, 1 << 14);
+
+        pthread_barrier_init(&idle_barrier, NULL, CACHE_THREADS + 1);
+
+        pthread_t main_thread;
+        pthread_create(&main_thread, NULL, cache_main, (void*) names[mode]);
+        run_threads(CACHE_THREADS, cache_thread);
+        pthread_join(main_thread, NULL);
+
+        pthread_barrier_destroy(&idle_barrier);
+    }
+}
+
+static void* latency_thread(void* arg) {
+    double* latencies = arg;
+    unsigned int seed = (uintptr_t) arg;
+    void* live[LATENCY_LIVE] = {NULL};
+
+    for (int i = 0; i < LATENCY_ITERATIONS; i++) {
+        int slot = rand_r(&seed) % LATENCY_LIVE;
+        double start = now();
+
+        if (live[slot] != NULL) {
+            virtual_free(virtual_heap, live[slot]);
+            live[slot] = NULL;
+        } else {
+            live[slot] = virtual_malloc(virtual_heap,
+                                        rand_r(&seed) % 2 ? 1 << 6 : 1 << 8);
+        }
+
+        latencies[i] = now() - start;
+
+        // latency sensitive threads spend most of their time waiting for
+        // requests, which gives the worker time to catch up
+        if (i % LATENCY_BURST == 0)
+            nanosleep(&(struct timespec) {0, 100000}, NULL);
+    }
+
+    for (int i = 0; i < LATENCY_LIVE; i++)
+        virtual_free(virtual_heap, live[i]);
+
+    return NULL;
+}
+
+/**
+ * Compares the latency of mallocs and frees of a couple of hot sizes with and
+ * without the background worker merging and splitting for them. The tail
+ * depends a lot on scheduling, so each is measured over several rounds.
+ */
+static void bench_worker(void) {
+    printf("worker: %d threads, %d mallocs and frees each, %d rounds\n",
+           LATENCY_THREADS, LATENCY_ITERATIONS, LATENCY_ROUNDS);
+
+    size_t samples = (size_t) LATENCY_THREADS * LATENCY_ITERATIONS;
+    double* latencies = malloc(samples * sizeof(double));
+
+    const char* names[] = {"inline", "worker"};
+    for (int round = 0; round < LATENCY_ROUNDS * 2; round++) {
+        int mode = round % 2;
+        init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+
+        // fragment the heap a little, so that merges and splits cascade
+        for (int i = 0; i < 256; i++)
+            virtual_malloc(virtual_heap, 1 << (4 + i % 8));
+
+        if (mode == 1) {
+            virtual_worker_start(virtual_heap);
+            virtual_worker_reserve(virtual_heap, 1 << 6, 128);
+            virtual_worker_reserve(virtual_heap, 1 << 8, 128);
+        }
+
+        pthread_t threads[LATENCY_THREADS];
+        for (int i = 0; i < LATENCY_THREADS; i++)
+            pthread_create(&threads[i], NULL, latency_thread,
+                           latencies + (size_t) i * LATENCY_ITERATIONS);
+        for (int i = 0; i < LATENCY_THREADS; i++)
+            pthread_join(threads[i], NULL);
+
+        virtual_worker_stop(virtual_heap);
+
+        qsort(latencies, samples, sizeof(double), compare_latency);
+        printf("%-10s p50 %8.0f ns  p99 %8.0f ns  p99.9 %8.0f ns\n",
+               names[mode], latencies[samples / 2] * 1e9,
+               latencies[samples * 99 / 100] * 1e9,
+               latencies[samples * 999 / 1000] * 1e9);
+    }
+
+    free(latencies);
+}
+
+/**
+ * Compares allocating lots of small objects that all die together with
+ * virtual_malloc and freeing them one by one, against slicing them from a bump
+ * allocator and resetting it.
+ */
+static void bench_bump(void) {
+    printf("bump: %d rounds of %d small allocations\n", BUMP_ROUNDS,
+           BUMP_SLICES);
+
+    static void* blocks[BUMP_SLICES];
+    init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+
+    double start = now();
+    for (int round = 0; round < BUMP_ROUNDS; round++) {
+        for (int i = 0; i < BUMP_SLICES; i++)
+            blocks[i] = virtual_malloc(virtual_heap, 16 + i % 48);
+        for (int i = 0; i < BUMP_SLICES; i++)
+            virtual_free(virtual_heap, blocks[i]);
+    }
+    double elapsed = now() - start;
+    printf("%-10s %8.1f ns per allocation and free\n", "malloc",
+           elapsed * 1e9 / BUMP_ROUNDS / BUMP_SLICES);
+
+    bump_t bump;
+    virtual_bump_init(virtual_heap, &bump, 1 << 16);
+
+    start = now();
+    for (int round = 0; round < BUMP_ROUNDS; round++) {
+        for (int i = 0; i < BUMP_SLICES; i++)
+            blocks[i] = virtual_bump_alloc(&bump, 16 + i % 48);
+        virtual_bump_reset(&bump);
+    }
+    elapsed = now() - start;
+    printf("%-10s %8.1f ns per allocation, with resets\n", "bump",
+           elapsed * 1e9 / BUMP_ROUNDS / BUMP_SLICES);
+}
+
+/**
+ * Returns the size of the message sent at step i of the FIFO trace.
+ */
+static uint32_t fifo_size(uint32_t i) {
+    return 64 + (i * 2654435761u >> 16) % 1984;
+}
+
+/**
+ * Compares sending messages through a window that moves forward in FIFO order,
+ * with the oldest message mostly freed first, using virtual_malloc and
+ * virtual_free against a ring.
+ */
+static void bench_ring(void) {
+    printf("ring: %d messages through a window of %d\n", FIFO_MESSAGES,
+           FIFO_WINDOW);
+
+    static void* window[FIFO_WINDOW];
+
+    for (int mode = 0; mode < 2; mode++) {
+        init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+        memset(window, 0, sizeof(window));
+
+        ring_t ring;
+        if (mode == 1)
+            virtual_ring_init(virtual_heap, &ring, 1 << 20);
+
+        double start = now();
+        for (uint32_t i = 0; i < FIFO_MESSAGES; i++) {
+            // every so often two messages finish in the wrong order
+            uint32_t slot = i % FIFO_WINDOW;
+            if (i % 7 == 0) {
+                void* tmp = window[slot];
+                window[slot] = window[(slot + 1) % FIFO_WINDOW];
+                window[(slot + 1) % FIFO_WINDOW] = tmp;
+            }
+
+            if (window[slot] != NULL) {
+                if (mode == 0)
+                    virtual_free(virtual_heap, window[slot]);
+                else
+                    virtual_ring_release(&ring, window[slot]);
+            }
+
+            window[slot] = mode == 0
+                           ? virtual_malloc(virtual_heap, fifo_size(i))
+                           : virtual_ring_alloc(&ring, fifo_size(i));
+        }
+        double elapsed = now() - start;
+
+        heap_stats_t stats;
+        virtual_stats(virtual_heap, &stats);
+        uint32_t free_blocks = 0;
+        for (int order = 0; order < STATS_ORDERS; order++)
+            free_blocks += stats.free_blocks[order];
+
+        printf("%-10s %8.1f ns per message, %u free blocks in the heap\n",
+               mode == 0 ? "malloc" : "ring",
+               elapsed * 1e9 / FIFO_MESSAGES, free_blocks);
+    }
+}
+
+// grows vectors by a few bytes at a time, as a vector that reallocates on every
+// append would, with other objects allocated in between. each append either
+// reallocates, or copies into a new block as realloc used to on every call
+/**
+ * Reallocates a block the way virtual_realloc used to: the heap information is
+ * backed up past the break, the block is freed and a new one allocated, which
+ * may be the same block or one merged with it, and the data is moved across.
+ */
+static void* copy_realloc(void* ptr, uint32_t old_size, uint32_t size) {
+    if (ptr == NULL)
+        return virtual_malloc(virtual_heap, size);
+
+    uint8_t* info = (uint8_t*) get_info(virtual_heap);
+    uint8_t* old_break = virtual_sbrk(0);
+    size_t info_size = old_break - info;
+
+    if (virtual_sbrk(info_size) == (void*) -1)
+        return NULL;
+    memmove(old_break, info, info_size);
+
+    virtual_free(virtual_heap, ptr);
+    void* block = virtual_malloc(virtual_heap, size);
+
+    // free and malloc can move the break, and the backup with it
+    uint8_t* new_break = virtual_sbrk(0);
+    if (block == NULL) {
+        memmove(info, new_break - info_size, info_size);
+        virtual_sbrk(old_break - new_break);
+        return NULL;
+    }
+
+    memmove(block, ptr, MIN(old_size, size));
+    virtual_sbrk(-info_size);
+
+    return block;
+}
+
+static void bench_append(void) {
+    printf("append: %d vectors grown by %d bytes up to %d\n", APPEND_VECTORS,
+           APPEND_STEP, APPEND_LENGTH);
+
+    static uint8_t* vectors[APPEND_VECTORS];
+
+    for (int mode = 0; mode < 2; mode++) {
+        init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+        memset(vectors, 0, sizeof(vectors));
+
+        uint32_t appends = 0;
+        uint32_t moves = 0;
+        double start = now();
+        for (uint32_t length = APPEND_STEP; length <= APPEND_LENGTH;
+                length += APPEND_STEP) {
+            for (int i = 0; i < APPEND_VECTORS; i++) {
+                uint8_t* old = vectors[i];
+                if (mode == 0) {
+                    vectors[i] = copy_realloc(old, length - APPEND_STEP,
+                                              length);
+                } else {
+                    vectors[i] = virtual_realloc(virtual_heap, old, length);
+                }
+
+                moves += vectors[i] != old;
+                memset(vectors[i] + length - APPEND_STEP, i, APPEND_STEP);
+
+                if (++appends % APPEND_OTHER == 0)
+                    virtual_malloc(virtual_heap, 3 * APPEND_STEP);
+            }
+        }
+        double elapsed = now() - start;
+
+        printf("%-10s %8.1f ns per append, %u moves\n",
+               mode == 0 ? "copy" : "realloc", elapsed * 1e9 / appends,
+               moves);
+    }
+}
+
+// a node of a linked list, a quarter of a cache line
+typedef struct node {
+    struct node* next;
+    uint64_t value;
+} node_t;
+
+// builds many linked lists a node at a time in turn, in a heap riddled with
+// holes, then walks each list from end to end. each node is either allocated
+// with virtual_malloc, or with virtual_malloc_near the node before it. each
+// list's first node is hinted at a different part of the heap, as if the lists
+// had been started at different times
+static void bench_chase(void) {
+    printf("chase: %d lists of %d nodes in a heap with holes\n", CHASE_LISTS,
+           CHASE_NODES / CHASE_LISTS);
+
+    static void* filler[CHASE_FILLER];
+    static node_t* heads[CHASE_LISTS];
+    static node_t* tails[CHASE_LISTS];
+
+    for (int mode = 0; mode < 2; mode++) {
+        init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+        memset(heads, 0, sizeof(heads));
+
+        // free a pseudo-random half of the heap's blocks to leave holes
+        uint32_t filled = virtual_malloc_batch(virtual_heap, sizeof(node_t),
+                                               CHASE_FILLER, filler);
+        static void* holes[CHASE_FILLER];
+        uint32_t freed = 0;
+        uint32_t seed = 1;
+        for (uint32_t i = 0; i < filled; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (seed >> 31)
+                holes[freed++] = filler[i];
+        }
+        virtual_free_batch(virtual_heap, holes, freed);
+
+        double start = now();
+        for (uint32_t i = 0; i < CHASE_NODES; i++) {
+            uint32_t list = i % CHASE_LISTS;
+            void* hint = i < CHASE_LISTS
+                         ? filler[list * (CHASE_FILLER / CHASE_LISTS)]
+                         : tails[list];
+            node_t* node = mode == 0
+                           ? virtual_malloc(virtual_heap, sizeof(node_t))
+                           : virtual_malloc_near(virtual_heap, sizeof(node_t),
+                                                 hint);
+            node->next = NULL;
+            node->value = i;
+
+            if (heads[list] == NULL)
+                heads[list] = node;
+            else
+                tails[list]->next = node;
+            tails[list] = node;
+        }
+        double built = now() - start;
+
+        uint64_t sum = 0;
+        start = now();
+        for (int round = 0; round < CHASE_ROUNDS; round++) {
+            for (int list = 0; list < CHASE_LISTS; list++) {
+                for (node_t* node = heads[list]; node != NULL;
+                        node = node->next)
+                    sum += node->value;
+            }
+        }
+        double walked = now() - start;
+
+        printf("%-10s %8.1f ns per node to build, %6.2f ns per node to walk "
+               "(sum %lu)\n", mode == 0 ? "malloc" : "near",
+               built * 1e9 / CHASE_NODES,
+               walked * 1e9 / CHASE_NODES / CHASE_ROUNDS, sum);
+
+        if (mode == 1) {
+            near_stats_t stats;
+            virtual_near_stats(virtual_heap, &stats);
+            printf("%-10s %8.1f bytes from the hint on average, %lu at most\n",
+                   "", (double) stats.total_distance / stats.placed,
+                   stats.max_distance);
+        }
+    }
+}
+
+// the share of the free bytes on the heap that are in blocks too small for a
+// page, and so can't be used for anything big
+static double fragmentation(void) {
+    heap_stats_t stats;
+    virtual_stats(virtual_heap, &stats);
+
+    uint64_t free_bytes = 0;
+    uint64_t small_bytes = 0;
+    for (int order = 0; order < STATS_ORDERS; order++) {
+        free_bytes += stats.free_bytes[order];
+        if (order < MIXED_PAGE)
+            small_bytes += stats.free_bytes[order];
+    }
+
+    return free_bytes == 0 ? 0 : (double) small_bytes / free_bytes;
+}
+
+// each round allocates a burst of transient blocks and a single block that is
+// kept, then frees the burst. the blocks are either allocated with
+// virtual_malloc, or with virtual_malloc_lifetime hinting how long they live.
+// fragmentation is sampled as the kept blocks build up
+static void bench_mixed(void) {
+    printf("mixed: %d rounds of %d transient blocks and 1 kept block, with the "
+           "share of free bytes in blocks under %d bytes\n", MIXED_ROUNDS,
+           MIXED_TRANSIENT, 1 << MIXED_PAGE);
+
+    static void* transient[MIXED_TRANSIENT];
+
+    for (int mode = 0; mode < 2; mode++) {
+        init_allocator(virtual_heap, MIXED_HEAP, MIN_SIZE);
+
+        printf("%-10s", mode == 0 ? "malloc" : "lifetime");
+
+        uint32_t seed = 1;
+        double start = now();
+        for (uint32_t round = 1; round <= MIXED_ROUNDS; round++) {
+            for (int i = 0; i < MIXED_TRANSIENT; i++) {
+                seed = seed * 1103515245 + 12345;
+                uint32_t size = 16 << (seed >> 29);
+                transient[i] = mode == 0
+                               ? virtual_malloc(virtual_heap, size)
+                               : virtual_malloc_lifetime(virtual_heap, size,
+                                                         LIFETIME_SHORT);
+            }
+
+            seed = seed * 1103515245 + 12345;
+            uint32_t size = 64 << (seed >> 30);
+            if (mode == 0)
+                virtual_malloc(virtual_heap, size);
+            else
+                virtual_malloc_lifetime(virtual_heap, size, LIFETIME_LONG);
+
+            virtual_free_batch(virtual_heap, transient, MIXED_TRANSIENT);
+
+            if (round % (MIXED_ROUNDS / MIXED_SAMPLES) == 0)
+                printf(" %5.1f%%", fragmentation() * 100);
+        }
+        double elapsed = now() - start;
+
+        printf(", %.1f ns per block\n",
+               elapsed * 1e9 / MIXED_ROUNDS / (MIXED_TRANSIENT + 1));
+    }
+}
+
+// frees and allocates blocks of random sizes in random slots, writing to each
+// block allocated, under each of the placement policies
+static void bench_placement(void) {
+    printf("placement: %d random mallocs and frees over %d slots, with the "
+           "share of free bytes in blocks under %d bytes\n", PLACEMENT_OPS,
+           PLACEMENT_SLOTS, 1 << MIXED_PAGE);
+
+    const char* names[] = {"leftmost", "buddy", "lifo"};
+    placement_t policies[] = {
+        PLACEMENT_LEFTMOST, PLACEMENT_BUDDY, PLACEMENT_LIFO
+    };
+    static void* slots[PLACEMENT_SLOTS];
+
+    for (int i = 0; i < 3; i++) {
+        init_allocator_placement(virtual_heap, PLACEMENT_HEAP, MIN_SIZE,
+                                 policies[i]);
+        memset(slots, 0, sizeof(slots));
+
+        uint32_t seed = 1;
+        uint32_t failed = 0;
+        double start = now();
+        for (uint32_t op = 0; op < PLACEMENT_OPS; op++) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t slot = (seed >> 16) % PLACEMENT_SLOTS;
+
+            if (slots[slot] != NULL) {
+                virtual_free(virtual_heap, slots[slot]);
+                slots[slot] = NULL;
+                continue;
+            }
+
+            seed = seed * 1103515245 + 12345;
+            uint32_t size = 16 + (seed >> 16) % 1024;
+            slots[slot] = virtual_malloc(virtual_heap, size);
+            if (slots[slot] != NULL)
+                memset(slots[slot], op, size);
+            else
+                failed++;
+        }
+        double elapsed = now() - start;
+
+        heap_stats_t stats;
+        virtual_stats(virtual_heap, &stats);
+        uint32_t free_blocks = 0;
+        for (int order = 0; order < STATS_ORDERS; order++)
+            free_blocks += stats.free_blocks[order];
+
+        printf("%-10s %8.1f ns per op, %5.1f%% fragmented, %u free blocks, "
+               "%u failed\n", names[i], elapsed * 1e9 / PLACEMENT_OPS,
+               fragmentation() * 100, free_blocks, failed);
+    }
+}
+
+// whether each request in bench_requests shares the heap, gets a mapping of its
+// own, or gets a block of the shared heap with a heap of its own inside
+int request_mode;
+
+static void* request_thread(void* arg) {
+    uint32_t seed = (uintptr_t) arg + 1;
+    void* objects[REQUEST_OBJECTS];
+
+    for (int request = 0; request < REQUEST_COUNT; request++) {
+        heap_t* heap = NULL;
+        if (request_mode == 1)
+            heap = virtual_heap_create(REQUEST_HEAP, MIN_SIZE);
+        else if (request_mode == 2)
+            heap = virtual_subheap_create_at(virtual_heap, REQUEST_HEAP,
+                                             MIN_SIZE);
+
+        for (int i = 0; i < REQUEST_OBJECTS; i++) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t size = 16 + (seed >> 16) % 256;
+            objects[i] = heap != NULL ? virtual_heap_malloc(heap, size)
+                                      : virtual_malloc(virtual_heap, size);
+            if (objects[i] != NULL)
+                memset(objects[i], request, size);
+        }
+
+        // a request's heap goes in one go, whatever is still allocated in it
+        if (heap != NULL) {
+            virtual_heap_destroy(heap);
+            continue;
+        }
+
+        for (int i = 0; i < REQUEST_OBJECTS; i++)
+            virtual_free(virtual_heap, objects[i]);
+    }
+
+    return NULL;
+}
+
+// serves requests on a few threads, each allocating a handful of objects that
+// are all dropped when the request finishes, either from the shared heap or
+// from a heap made for the request, mapped or inside a block of the shared heap
+static void bench_requests(void) {
+    printf("requests: %d threads serving %d requests of %d objects each\n",
+           REQUEST_THREADS, REQUEST_COUNT, REQUEST_OBJECTS);
+
+    const char* names[] = {"shared", "mapped", "nested"};
+
+    for (int mode = 0; mode < 3; mode++) {
+        init_allocator(virtual_heap, HEAP_SIZE, MIN_SIZE);
+        request_mode = mode;
+
+        double start = now();
+        run_threads(REQUEST_THREADS, request_thread);
+        double elapsed = now() - start;
+
+        printf("%-10s %8.1f us per request\n", names[mode],
+               elapsed * 1e6 / REQUEST_COUNT / REQUEST_THREADS);
+    }
+}
+
+int main() {
+    virtual_heap = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (virtual_heap == MAP_FAILED)
+        return 1;
+
+    bench_caches();
+    bench_worker();
+    bench_bump();
+    bench_ring();
+    bench_append();
+    bench_chase();
+    bench_mixed();
+    bench_placement();
+    bench_requests();
+
+    return 0;
+}
\ No newline at end of file
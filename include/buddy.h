@@ -0,0 +1,127 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Initialises a virtual heap managed by the buddy engine, which stores a byte of
+ * information for every block in the heap after the heap itself, ordered by
+ * address.
+ */
+void buddy_init(void* heapstart, uint8_t initial_size, uint8_t min_size);
+
+/**
+ * Emulates malloc on a buddy heap. Allocates the block in the leftmost
+ * unallocated position that is sufficiently large by splitting until reaching
+ * the desired size. Allocates blocks in sizes of powers of 2. If allocation is
+ * not possible, returns NULL.
+ */
+void* buddy_malloc(void* heapstart, uint32_t size);
+
+/**
+ * Allocates up to count blocks of the same size on a buddy heap, writing them to
+ * out. Rather than searching and splitting for every block, the smallest free
+ * block that can hold all of them is carved up in one go, into the blocks from
+ * its left and the largest free blocks that fit in what is left over. If no free
+ * block is big enough, the biggest ones are used until enough blocks have been
+ * found. Returns how many blocks were allocated.
+ */
+uint32_t buddy_malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                            void** out);
+
+/**
+ * Allocates a block on a buddy heap like buddy_malloc, also reporting whether
+ * the block is known to hold nothing but zeroes, so that it needn't be cleared.
+ */
+void* buddy_malloc_zeroed(void* heapstart, uint32_t size, bool* zeroed);
+
+/**
+ * Allocates a block on a buddy heap as close as possible to one end of the heap,
+ * splitting the first free block big enough down to its first position, or if
+ * high is set, the last free block big enough down to its last position.
+ * Returns NULL if allocation is not possible.
+ */
+void* buddy_malloc_end(void* heapstart, uint32_t size, bool high);
+
+/**
+ * Allocates a block on a buddy heap whose address is a multiple of alignment,
+ * which must be a power of two. Of the free blocks with an aligned position for
+ * a block of the order needed, the smallest is split down to that position, so
+ * the block is no bigger than for buddy_malloc. If there is no such position,
+ * returns NULL.
+ */
+void* buddy_aligned_alloc(void* heapstart, uint32_t alignment, uint32_t size);
+
+/**
+ * Allocates a block on a buddy heap as close as possible to hint, a pointer into
+ * the heap. The free blocks are searched for a position in the smallest subtree
+ * that also holds the hint, i.e. the smallest aligned block containing both,
+ * taking the smallest free block among those in the same subtree. Inside the
+ * free block, the block goes at the end nearest the hint. A hint outside the
+ * heap falls back to the placement of buddy_malloc. Returns NULL if allocation
+ * is not possible.
+ */
+void* buddy_malloc_near(void* heapstart, uint32_t size, void* hint);
+
+/**
+ * Emulates free on a buddy heap. Unallocates a block pointed to by ptr and
+ * merges it with its buddy if the buddy is also unallocated. Repeats the
+ * process until no longer possible. Returns 0 if successful, 1 if not.
+ */
+int buddy_free(void* heapstart, void* ptr);
+
+/**
+ * Frees a block on a buddy heap like buddy_free, where the caller has cleared
+ * the block, so that it can be handed out again without being cleared.
+ */
+int buddy_free_zeroed(void* heapstart, void* ptr);
+
+/**
+ * Frees a block on a buddy heap like buddy_free, given a size that was allocated
+ * there. The block's order follows from the size, so a pointer that isn't
+ * aligned to it is refused without searching, and the block found must be of
+ * that order. Returns 0 if successful, 1 if not.
+ */
+int buddy_free_sized(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Frees many blocks on a buddy heap at once. The pointers are sorted by address
+ * (in place), then every block is freed and merged with its buddies in a single
+ * pass over the heap information, which is only shrunk once at the end. If any
+ * pointer isn't an allocated block, or appears twice, nothing is freed. Returns
+ * 0 if successful, 1 if not.
+ */
+int buddy_free_batch(void* heapstart, void** ptrs, uint32_t count);
+
+/**
+ * Frees those of many pointers that are still allocated blocks on a buddy heap,
+ * like buddy_free_batch, but skipping pointers to blocks that have already been
+ * freed, pointers into the middle of blocks, and repeated pointers instead of
+ * refusing them. Returns 0 if successful, 1 if not.
+ */
+int buddy_free_live(void* heapstart, void** ptrs, uint32_t count);
+
+/**
+ * Emulates realloc on a buddy heap. Attempts to resize a block to a specified
+ * size, moving it if necessary. A growing block takes in its free buddies
+ * rather than move if it can, and its next buddy is then kept free for as long
+ * as possible, so that it can grow in place again. Until it is freed, such a
+ * block also stays where it is while it keeps the same size. If the block is
+ * unable to be reallocated, the heap is left unchanged and NULL is returned.
+ * Otherwise, a pointer to the new block is returned.
+ */
+void* buddy_realloc(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Returns the size of the allocated block starting at ptr on a buddy heap, or 0
+ * if there is no such block.
+ */
+uint32_t buddy_usable_size(void* heapstart, void* ptr);
+
+/**
+ * Prints information about each block in a buddy heap, from left (smallest
+ * address) to right.
+ */
+void buddy_info(void* heapstart);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef BUMP_H
+#define BUMP_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Allocates a new block for a bump allocator whose current block has run out,
+ * and takes a slice of size bytes from it. A slice too big for a block of the
+ * usual size gets a block of its own, and the current block carries on. Returns
+ * NULL if the heap has run out.
+ */
+void* bump_refill(bump_t* bump, uint32_t size);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Returns whether frees on a heap are being queued, in which case every malloc
+ * and free on it has to go through the queue.
+ */
+bool deferred_active(void* heapstart);
+
+/**
+ * Forgets the queue of deferred frees without freeing anything, after the heap
+ * it was queueing for has been reinitialised.
+ */
+void deferred_reset(void);
+
+/**
+ * Allocates a block from the heap. If the heap has run out, the queued frees
+ * are done first and the allocation is tried again.
+ */
+void* deferred_malloc(void* heapstart, uint32_t size);
+
+/**
+ * Allocates a batch of blocks from the heap. If the heap runs out part way, the
+ * queued frees are done first and the rest of the batch is tried again.
+ */
+uint32_t deferred_malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                               void** out);
+
+/**
+ * Adds a block to the queue of deferred frees, freeing the whole queue in one
+ * batch once it is full. Before it is queued, the block is only checked to be in
+ * the heap, aligned to the smallest block size and not queued already, so any
+ * other bad pointer isn't reported as an error. Returns 0 if successful, 1 if
+ * not.
+ */
+int deferred_free(void* heapstart, void* ptr);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Returns the heap made by virtual_heap_create that the calling thread is
+ * working on, or NULL if it is working on the heap at the program break.
+ */
+heap_t* heap_handle(void);
+
+/**
+ * Moves the break of the heap the calling thread is working on, like
+ * virtual_sbrk. For a heap made by virtual_heap_create, the break moves within
+ * the heap's own memory, and can't go below the heap's header or past the
+ * furthest its information can reach. Returns the old break, or (void*) -1 if
+ * it can't move that far.
+ */
+void* heap_sbrk(int32_t increment);
+
+#endif
@@ -9,11 +9,89 @@
  */
 uint8_t log_2(uint32_t x);
 
+/**
+ * Returns the first block of a heap, which is aligned to the heap's size or to
+ * HEAP_ALIGN, whichever is smaller. The heap's header is at heapstart, followed
+ * by padding up to the first block, unless the heap is in a block of a parent
+ * heap, whose handle says where its blocks are.
+ */
+uint8_t* get_blocks(void* heapstart);
+
+/**
+ * Returns the information about the first block of a buddy heap, which is
+ * stored straight after the last block, or straight after the header for a heap
+ * whose blocks are apart from it.
+ */
+block_t* get_info(void* heapstart);
+
+/**
+ * Returns whether the memory from start onwards has never been part of a heap,
+ * and so still holds the zeroes virtual_sbrk handed it out with. Like sbrk,
+ * virtual_sbrk is assumed to give zeroed memory the first time it grows past
+ * the furthest it has been, and prog_break is where the break was before the
+ * new heap reset it. Everything up to limit, the furthest the new heap can
+ * reach, is counted as used from now on.
+ */
+bool fresh_memory(uint8_t* prog_break, uint8_t* start, uint8_t* limit);
+
+/**
+ * Clears the first size bytes of a block. Large blocks are cleared with
+ * non-temporal stores, so that clearing them doesn't evict everything else from
+ * the cache only to fill it with zeroes.
+ */
+void zero_block(void* block, uint32_t size);
+
+/**
+ * Keeps the buddy to the right of a block that realloc has grown free for as
+ * long as there are other blocks to allocate from, so that the block can grow
+ * into it without moving. Replaces any reservation the block already had, and
+ * once there are GROWTHS reservations, the oldest is dropped.
+ */
+void reserve_growth(void* heapstart, uint8_t* ptr, uint8_t order);
+
+/**
+ * Returns whether a block has been grown by realloc and not freed or moved
+ * since, even if it had no buddy to keep free.
+ */
+bool growing(uint8_t* ptr);
+
+/**
+ * Drops the reservation of a block that is being freed or moved, if it has one.
+ */
+void drop_growth(uint8_t* ptr);
+
+/**
+ * Drops every reservation, for when a new heap is initialised.
+ */
+void reset_growth(void);
+
+/**
+ * Sets how free blocks are picked to allocate from on the buddy heap, and
+ * forgets every block freed so far.
+ */
+void set_placement(placement_t policy);
+
+/**
+ * Remembers a block that has just been freed, which PLACEMENT_LIFO hands out
+ * again first.
+ */
+void note_free(uint8_t* ptr);
+
+/**
+ * Returns where in the free block at ptr a block of an order should be split
+ * off, as an offset from ptr. This is the start of the block, unless the heap
+ * hands out recently freed blocks first, in which case it is the position of
+ * the most recently freed block inside it.
+ */
+uint32_t placement_offset(uint8_t* ptr, uint8_t size, uint8_t order);
+
 /**
  * Finds the smallest unallocated block in the virtual heap that is not smaller
  * than 2^min_size bytes. Modifies a pointer passed as a parameter to point to
  * the block in the heap and returns a pointer to the section of the heap
- * storing its information.
+ * storing its information. Of the blocks of the same size, the leftmost is
+ * found, unless the heap was given a different placement policy. Blocks kept
+ * free for realloc to grow into are only returned if there is no other.
  */
 block_t* smallest_block(void* heapstart, uint8_t min_size, uint8_t** ptr);
 
@@ -33,7 +111,7 @@ bool should_merge_left(block_t* block, uint8_t heap_size);
  * Returns whether a block is able to be merged to the right with its buddy, if
  * one exists. Assumes that the block in question is a left child.
  */
-bool should_merge_right(block_t* block);
+bool should_merge_right(block_t* block, uint8_t heap_size);
 
 /**
  * Moves everything in the heap from a starting position by an offset in bytes.
@@ -46,4 +124,34 @@ void shift(block_t* block, uint8_t* prog_break, int16_t offset);
  */
 block_t* get_block_info(void* heapstart, void* ptr);
 
+/**
+ * Sorts an array of pointers into increasing order of address, in place and
+ * without allocating any memory.
+ */
+void sort_pointers(void** ptrs, uint32_t count);
+
+/**
+ * Moves a list of count pointers into a new mapping outside the virtual heap
+ * with room for twice its capacity, or for LIST_SIZE pointers if it has none
+ * yet, unmapping the old one. Returns the new list, or NULL if it couldn't be
+ * mapped, in which case the old list is left as it was.
+ */
+void** grow_list(void** list, uint32_t count, uint32_t* capacity);
+
+/**
+ * Returns the engine managing the heap, as recorded in its header.
+ */
+engine_t heap_engine(void* heapstart);
+
+/**
+ * Acquires the lock protecting the information of a buddy heap from being
+ * modified by multiple threads at once.
+ */
+void lock_heap(void* heapstart);
+
+/**
+ * Releases the lock acquired with lock_heap.
+ */
+void unlock_heap(void* heapstart);
+
 #endif
\ No newline at end of file
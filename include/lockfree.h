@@ -0,0 +1,53 @@
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Initialises a virtual heap of size 2^initial_size bytes managed by the
+ * lock-free engine. Instead of a list of blocks, the heap information is a
+ * complete binary tree of atomic nodes, one per potential block, stored after
+ * the heap, followed by a hint for every node of the largest free block below
+ * it. The tree is allocated once and never resized.
+ */
+void lockfree_init(void* heapstart, uint8_t initial_size, uint8_t min_size);
+
+/**
+ * Allocates a block on a lock-free heap. The hints lead from the root straight
+ * down to a free node of the required order, which is claimed with
+ * compare-and-swap, and the occupancy change is then propagated up to the
+ * root. Halves that are already split are tried before whole free halves, and
+ * otherwise the left half, so that blocks are placed as in the buddy engine.
+ * If the claim fails, or an ancestor turns out to be allocated as a whole, the
+ * claim is rolled back and the walk starts again from the root. Returns NULL if
+ * no block could be claimed.
+ */
+void* lockfree_malloc(void* heapstart, uint32_t size);
+
+/**
+ * Frees a block on a lock-free heap by clearing its node and removing it from
+ * the occupancy counts of its ancestors, which implicitly merges it with any
+ * free buddies. Returns 0 if successful, 1 if not.
+ */
+int lockfree_free(void* heapstart, void* ptr);
+
+/**
+ * Frees a block on a lock-free heap like lockfree_free, given a size that was
+ * allocated there, which finds its node without searching the tree. Returns 0
+ * if successful, 1 if not.
+ */
+int lockfree_free_sized(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Reallocates a block on a lock-free heap. Since other threads may claim the
+ * space at any time, the new block is allocated before the old one is freed.
+ */
+void* lockfree_realloc(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Prints the blocks of a lock-free heap in the same format as virtual_info.
+ * The output is only consistent if no other thread is modifying the heap.
+ */
+void lockfree_info(void* heapstart);
+
+#endif
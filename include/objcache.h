@@ -0,0 +1,19 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Forgets every object cache without freeing anything, after the heap they were
+ * on has been reinitialised.
+ */
+void objcache_reset(void);
+
+/**
+ * Hands the empty slabs of every object cache on a heap back to it, skipping
+ * caches that are busy, since the heap running out may be what has kept them
+ * busy. Returns how many slabs were handed back.
+ */
+uint32_t objcache_reap_heap(void* heapstart);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PCPU_H
+#define PCPU_H
+
+#include "virtual_alloc.h"
+
+#define PCPU_ORDERS 32
+
+/**
+ * Returns whether the calling thread can use the per-CPU caches, i.e. whether
+ * it has registered a restartable sequence area with the kernel.
+ */
+bool pcpu_supported(void);
+
+/**
+ * Maps a cache for every CPU with room for up to max_count blocks of each
+ * order, and at most max_bytes bytes of each order. Returns 0 if successful, 1
+ * if not, in which case the per-CPU caches can't be used.
+ */
+int pcpu_init(uint32_t max_count, uint32_t max_bytes);
+
+/**
+ * Unmaps the per-CPU caches, forgetting any blocks in them.
+ */
+void pcpu_reset(void);
+
+/**
+ * Returns the number of CPUs that have a cache.
+ */
+uint32_t pcpu_cpus(void);
+
+/**
+ * Returns how many blocks of an order each CPU's cache can hold.
+ */
+uint32_t pcpu_capacity(uint8_t order);
+
+/**
+ * Removes the most recently added block of an order from the cache of the CPU
+ * the calling thread is running on. Returns NULL if that cache has none.
+ */
+void* pcpu_pop(uint8_t order);
+
+/**
+ * Adds a block of an order to the cache of the CPU the calling thread is
+ * running on. Returns whether there was room for it.
+ */
+bool pcpu_push(void* block, uint8_t order);
+
+/**
+ * Removes a block of an order from the cache of a given CPU without a
+ * restartable sequence. Only safe while no other thread uses the caches.
+ * Returns NULL if that cache has none.
+ */
+void* pcpu_take(uint32_t cpu, uint8_t order);
+
+#endif
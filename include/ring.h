@@ -0,0 +1,16 @@
+#ifndef RING_H
+#define RING_H
+
+#include "virtual_alloc.h"
+
+// the header before every record in a ring, padded so that the record after it
+// is aligned. records that have been released stay in the ring until every
+// record before them has been released too. the space left at the end of the
+// ring when a record doesn't fit there is taken up by a released record
+typedef struct {
+    uint32_t size;
+    uint32_t released;
+    uint8_t padding[RING_ALIGN - 2 * sizeof(uint32_t)];
+} record_t;
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef SCOPE_H
+#define SCOPE_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Returns whether a heap has open scopes, in which case every block allocated on
+ * it has to be recorded.
+ */
+bool scope_active(void* heapstart);
+
+/**
+ * Forgets every open scope without freeing anything, after the heap they were
+ * open on has been reinitialised.
+ */
+void scope_reset(void);
+
+/**
+ * Records a block allocated on a heap, so that releasing the innermost open
+ * scope frees it. If the block can't be recorded, it is freed again rather than
+ * escape the scope, and NULL is returned. Otherwise returns the block. Expects
+ * the heap's lock to be held.
+ */
+void* scope_record(void* heapstart, void* block);
+
+/**
+ * Follows a block that realloc moved from old to new, so that the new block
+ * belongs to whichever scope the old one did, if any. Expects the heap's lock
+ * to be held.
+ */
+void scope_moved(void* heapstart, void* old, void* new);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Counts the blocks of a buddy heap that has just been initialised or changed
+ * wholesale, starting the statistics afresh.
+ */
+void stats_init(void* heapstart);
+
+/**
+ * Starts a change to the statistics, after which readers retry until the
+ * matching stats_end. Changes may be nested, e.g. a realloc made of a free and a
+ * malloc, and only the outermost one is seen by readers. Expects the heap's lock
+ * to be held.
+ */
+void stats_begin(void);
+
+/**
+ * Finishes a change to the statistics started with stats_begin.
+ */
+void stats_end(void);
+
+/**
+ * Adds delta to the number of free or allocated blocks of an order. Should only
+ * be called between stats_begin and stats_end.
+ */
+void stats_add(uint8_t order, bool allocated, int32_t delta);
+
+/**
+ * Counts a block allocated by buddy_malloc_near, either at distance bytes from
+ * its hint or, for a hint outside the heap, wherever buddy_malloc put it.
+ * Expects the heap's lock to be held.
+ */
+void stats_near(uint32_t distance, bool fallback);
+
+/**
+ * Recounts every block in a buddy heap, after an error has left the heap in a
+ * state that is easier to count than to work out. Should only be called between
+ * stats_begin and stats_end.
+ */
+void stats_recount(void* heapstart);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SUBTREE_H
+#define SUBTREE_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Initialises a virtual heap of size 2^initial_size bytes managed by the
+ * subtree engine. The heap information is the same tree of nodes as the
+ * lock-free engine, but the top levels of the tree are cut into subtrees which
+ * each have their own lock, plus a parent lock over the levels above them. The
+ * locks are stored after the tree.
+ */
+void subtree_init(void* heapstart, uint8_t initial_size, uint8_t min_size);
+
+/**
+ * Allocates a block on a subtree heap. Each thread has a home subtree, and
+ * tries the other subtrees in turn if its home subtree has no room. Blocks
+ * larger than a subtree are allocated under the parent lock. Returns NULL if
+ * no subtree has room.
+ */
+void* subtree_malloc(void* heapstart, uint32_t size);
+
+/**
+ * Frees a block on a subtree heap under the lock of the subtree it is in. The
+ * parent lock is only taken if the subtree becomes empty, since that is the
+ * only time the block merges past the subtree's root. Returns 0 if successful,
+ * 1 if not.
+ */
+int subtree_free(void* heapstart, void* ptr);
+
+/**
+ * Frees a block on a subtree heap like subtree_free, given a size that was
+ * allocated there, which finds its node without searching the tree. Returns 0
+ * if successful, 1 if not.
+ */
+int subtree_free_sized(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Reallocates a block on a subtree heap. The new block is allocated before the
+ * old one is freed, as the old block's subtree may be locked by other threads
+ * in between.
+ */
+void* subtree_realloc(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Prints the blocks of a subtree heap in the same format as virtual_info.
+ * The output is only consistent if no other thread is modifying the heap.
+ */
+void subtree_info(void* heapstart);
+
+#endif
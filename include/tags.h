@@ -0,0 +1,31 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Returns whether blocks on a heap have been tagged, in which case frees on it
+ * have to untag them.
+ */
+bool tags_active(void* heapstart);
+
+/**
+ * Forgets every tag without freeing anything, after the heap they were on has
+ * been reinitialised.
+ */
+void tags_reset(void);
+
+/**
+ * Untags the block starting at ptr, if it is tagged, because it has been or is
+ * about to be freed. Expects the heap's lock to be held.
+ */
+void tag_forget(void* heapstart, void* ptr);
+
+/**
+ * Follows a block that realloc moved from old to new and resized to size bytes,
+ * so that the new block has the old one's tag, if any. Expects the heap's lock
+ * to be held.
+ */
+void tag_moved(void* heapstart, void* old, void* new, uint32_t size);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TCACHE_H
+#define TCACHE_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Returns whether the thread caches have been set up for a heap, in which case
+ * every malloc, free and realloc on it has to go through them.
+ */
+bool tcache_active(void* heapstart);
+
+/**
+ * Forgets any thread caches and the order map, after the heap they were caching
+ * has been reinitialised.
+ */
+void tcache_reset(void);
+
+/**
+ * Allocates a block through the calling thread's cache. A block of the right
+ * order is taken from the cache if there is one, and otherwise the cache is
+ * refilled with a batch of blocks from the shared heap under a single lock.
+ * Blocks other threads have freed back to this thread are collected first.
+ */
+void* tcache_malloc(void* heapstart, uint32_t size);
+
+/**
+ * Frees a block into the calling thread's cache, without touching the shared
+ * heap. If the block came from another thread's cache, it is pushed onto that
+ * thread's list of remote frees with a single atomic operation instead. If the
+ * cache is over its limits, part of it is flushed back to the shared heap under
+ * a single lock first. Returns 0 if successful, 1 if not.
+ */
+int tcache_free(void* heapstart, void* ptr);
+
+/**
+ * Reallocates a block on the shared heap, keeping the order map up to date.
+ */
+void* tcache_realloc(void* heapstart, void* ptr, uint32_t size);
+
+#endif
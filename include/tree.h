@@ -0,0 +1,71 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdatomic.h>
+
+#include "virtual_alloc.h"
+
+// a node whose whole block has been allocated. any other value of a node is
+// non-zero if and only if something below it has been allocated
+#define NODE_FULL ((uint32_t) 1 << 31)
+
+typedef _Atomic uint32_t node_t;
+
+/**
+ * Initialises a virtual heap whose information is a complete binary tree of
+ * nodes, one per potential block, stored after the heap and followed by
+ * `extra` bytes for the engine's own use. The nodes are indexed from 1 (the
+ * root), so that the children of node i are at 2i and 2i + 1. Returns the tree,
+ * or NULL if the heap could not be allocated.
+ */
+node_t* tree_init(void* heapstart, uint8_t initial_size, uint8_t min_size,
+                  engine_t engine, size_t extra);
+
+/**
+ * Returns the number of levels in the tree below the root.
+ */
+uint8_t tree_depth(void* heapstart);
+
+/**
+ * Returns the tree of nodes stored after the heap.
+ */
+node_t* get_tree(void* heapstart);
+
+/**
+ * Returns the extra bytes stored after the tree, as requested in tree_init.
+ */
+void* tree_extra(void* heapstart);
+
+/**
+ * Returns the depth of a node in the tree, i.e. floor(log2(node)).
+ */
+uint8_t node_depth(uint32_t node);
+
+/**
+ * Finds the node of the allocated block starting at ptr. Returns 0 if there is
+ * no such block.
+ */
+uint32_t find_node(void* heapstart, void* ptr);
+
+/**
+ * Finds the node of the allocated block starting at ptr, given a size that was
+ * allocated there. The node follows straight from the block's order and offset,
+ * so no other nodes are looked at. Returns 0 if there is no such block of that
+ * order.
+ */
+uint32_t sized_node(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Returns the size of the allocated block starting at ptr on a tree heap, or 0
+ * if there is no such block.
+ */
+uint32_t tree_usable_size(void* heapstart, void* ptr);
+
+/**
+ * Prints the blocks of a tree heap in the same format as virtual_info. A node
+ * with nothing allocated below it is printed as a single free block. The
+ * output is only consistent if no other thread is modifying the heap.
+ */
+void tree_info(void* heapstart);
+
+#endif
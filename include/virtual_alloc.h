@@ -1,6 +1,7 @@
 #ifndef VIRTUAL_ALLOC_H
 #define VIRTUAL_ALLOC_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,12 +11,182 @@
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
 // A struct to hold information about a block using bitfields. Should be a
-// single byte.
+// single byte. A free block may also be known to hold nothing but zeroes
 typedef struct {
     bool allocated : 1;
-    uint8_t size: 7;
+    uint8_t size: 6;
+    bool zeroed : 1;
 } block_t;
 
+// The second byte of the heap stores the minimum block size in its low bits and
+// the engine managing the heap in its top bits
+#define MIN_SIZE_MASK 0x3f
+#define ENGINE_MASK 0xc0
+
+// The blocks of a heap start after its header at the next multiple of the
+// heap's size, or of this many bytes for bigger heaps, so that every block up to
+// a page is aligned to its own size
+#define HEAP_ALIGN 4096
+
+// The engines that can manage a virtual heap. The buddy engine keeps a list of
+// the blocks in the heap behind a single lock, whereas the lock-free engine
+// keeps a tree of atomic nodes which any number of threads can use at once. The
+// subtree engine keeps the same tree, with a lock for each subtree near the top
+typedef enum {
+    ENGINE_BUDDY = 0x00,
+    ENGINE_LOCKFREE = 0x40,
+    ENGINE_SUBTREE = 0x80,
+} engine_t;
+
+// How a heap managed by the buddy engine picks the free block to allocate from.
+// Leftmost takes the leftmost of the smallest free blocks big enough. Buddy
+// takes the smallest too, but prefers one whose buddy is allocated, so that
+// free subtrees are left whole. LIFO takes the free block holding the most
+// recently freed block it can, at that block's position, so that the memory is
+// likely still in the cache, and otherwise places blocks like leftmost
+typedef enum {
+    PLACEMENT_LEFTMOST,
+    PLACEMENT_BUDDY,
+    PLACEMENT_LIFO,
+} placement_t;
+
+// How long a block is expected to live, for virtual_malloc_lifetime. Short-lived
+// blocks fill the heap from its low end, and long-lived ones from its high end
+typedef enum {
+    LIFETIME_SHORT,
+    LIFETIME_LONG,
+} lifetime_t;
+
+// Statistics about blocks moving between threads' caches: blocks freed by a
+// different thread to the one whose cache they came from, which are handed back
+// to that thread in batches, and blocks taken from another thread's cache by a
+// thread that ran out
+typedef struct {
+    uint64_t remote_frees;
+    uint64_t drains;
+    uint64_t max_batch;
+    uint64_t steals;
+} remote_stats_t;
+
+// The orders of blocks counted in a heap's statistics, which covers every heap
+// the block sizes can describe
+#define STATS_ORDERS 32
+
+// A snapshot of the blocks in a heap, counted by order, i.e. 2^order bytes
+typedef struct {
+    uint32_t free_blocks[STATS_ORDERS];
+    uint32_t allocated_blocks[STATS_ORDERS];
+    uint64_t free_bytes[STATS_ORDERS];
+    int8_t largest_free_order;
+} heap_stats_t;
+
+// Counters for virtual_malloc_near, with distances in bytes from the hints
+typedef struct {
+    uint64_t placed;
+    uint64_t fallbacks;
+    uint64_t total_distance;
+    uint64_t max_distance;
+} near_stats_t;
+
+// A bump allocator, which hands out slices of blocks allocated from a heap by
+// moving a pointer along them. The blocks are linked through their first bytes,
+// so that they can all be freed at once
+typedef struct {
+    void* heapstart;
+    uint8_t* next;
+    uint8_t* end;
+    void* chunks;
+    uint32_t chunk_size;
+} bump_t;
+
+// Slices from a bump allocator are aligned to this many bytes, which is enough
+// for any type
+#define BUMP_ALIGN 16
+
+// A ring of records allocated one after the other from a single block of a heap,
+// wrapping around at the end. Records are added at the head and their space is
+// freed up from the tail, the oldest record that hasn't been released. Offsets
+// are from the start of the block
+typedef struct {
+    void* heapstart;
+    uint8_t* base;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t used;
+} ring_t;
+
+// Records in a ring are aligned to this many bytes
+#define RING_ALIGN 16
+
+// Statistics about an object cache: objects allocated from and freed to it,
+// objects constructed and destroyed as their slabs come and go, objects in use,
+// and slabs, of which some may be empty
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t constructed;
+    uint64_t destroyed;
+    uint32_t objects_in_use;
+    uint32_t objects_per_slab;
+    uint32_t slabs;
+    uint32_t empty_slabs;
+} cache_stats_t;
+
+// A cache of constructed objects of one size, carved from slabs allocated from a
+// heap. The slabs are kept in lists of those with some, none or every object in
+// use
+typedef struct object_cache {
+    void* heapstart;
+    uint32_t size;
+    uint32_t stride;
+    uint32_t offset;
+    uint32_t slab_size;
+    uint32_t per_slab;
+    void (*ctor)(void*);
+    void (*dtor)(void*);
+    pthread_mutex_t lock;
+    struct slab* partial;
+    struct slab* full;
+    struct slab* empty;
+    cache_stats_t stats;
+    struct object_cache* next;
+} object_cache_t;
+
+// Where the memory of a heap made by virtual_heap_create comes from: a mapping
+// of its own, memory handed over by the caller, or a block of a parent heap,
+// which is either another heap with a handle or the heap at the program break
+typedef enum {
+    BACKEND_MMAP,
+    BACKEND_MEMORY,
+    BACKEND_HEAP,
+    BACKEND_BREAK,
+} backend_t;
+
+// A heap that lives in memory of its own instead of at the program break, so
+// that any number can exist at once. The handle sits at the start of the
+// memory, followed by the heap's header, its blocks and its information, which
+// grows and shrinks by moving brk, up to limit, instead of the program break.
+// A heap in a block of a parent heap has the whole block for its blocks, with
+// the handle, header and information beside it in an allocation of their own,
+// and keeps the parent's handle, or its heapstart if the parent is the heap at
+// the program break. blocks is NULL unless the blocks are apart like this
+typedef struct {
+    void* heapstart;
+    uint8_t* blocks;
+    uint8_t* brk;
+    uint8_t* limit;
+    void* memory;
+    size_t size;
+    backend_t backend;
+    void* parent;
+    bool fresh;
+    pthread_mutex_t lock;
+} heap_t;
+
+// Returned by virtual_mark when no scope could be opened
+#define VIRTUAL_NO_MARK UINT32_MAX
+
 #include "helpers.h"
 
 /**
@@ -32,6 +203,23 @@ extern void* virtual_sbrk(int32_t increment);
  */
 void init_allocator(void* heapstart, uint8_t initial_size, uint8_t min_size);
 
+/**
+ * Initialises the virtual heap like init_allocator, but with the heap managed
+ * by the given engine. The other functions work on the heap regardless of which
+ * engine manages it.
+ */
+void init_allocator_engine(void* heapstart, uint8_t initial_size,
+                           uint8_t min_size, engine_t engine);
+
+/**
+ * Initialises the virtual heap like init_allocator, managed by the buddy engine
+ * and picking the free blocks to allocate from with the given placement policy
+ * rather than always the leftmost. The policy lasts until the heap is next
+ * initialised.
+ */
+void init_allocator_placement(void* heapstart, uint8_t initial_size,
+                              uint8_t min_size, placement_t placement);
+
 /**
  * Emulates malloc on the virtual heap. Follows the buddy allocation algorithm.
  * Allocates the block in the leftmost unallocated position that is sufficiently
@@ -40,14 +228,111 @@ void init_allocator(void* heapstart, uint8_t initial_size, uint8_t min_size);
  */
 void* virtual_malloc(void* heapstart, uint32_t size);
 
+/**
+ * Allocates a block like virtual_malloc, with a hint of how long it will live.
+ * On a heap managed by the buddy engine, short-lived blocks are taken from the
+ * first free block big enough, at its start, and long-lived ones from the last,
+ * at its end, whatever the sizes of the free blocks. The long-lived blocks then
+ * gather at the high end of the heap instead of pinning buddies among the
+ * short-lived ones, which leaves the churn at the low end free to merge back
+ * into large blocks. Like virtual_aligned_alloc, this always takes the heap's
+ * lock. A heap managed by a tree engine places blocks as virtual_malloc does.
+ * Returns NULL if allocation is not possible.
+ */
+void* virtual_malloc_lifetime(void* heapstart, uint32_t size,
+                              lifetime_t lifetime);
+
+/**
+ * Allocates up to count blocks of size bytes each, writing pointers to them to
+ * out. On a heap managed by the buddy engine without the thread caches or the
+ * background worker in front of it, the heap is searched once and a single free
+ * block is split into all of the blocks at once, so that they are next to each
+ * other in the heap where possible. Otherwise each block is allocated as by
+ * virtual_malloc. Returns how many blocks were allocated, which is less than
+ * count if the heap ran out.
+ */
+uint32_t virtual_malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                              void** out);
+
+/**
+ * Emulates calloc on the virtual heap, allocating a block for count elements of
+ * size bytes each that holds nothing but zeroes. On a heap managed by the buddy
+ * engine, the heap keeps track of free blocks known to be clear, either because
+ * virtual_sbrk has only just handed them out or because they were cleared ahead
+ * of time by the background worker, and such blocks aren't cleared again. Large
+ * blocks are cleared with non-temporal stores. Returns NULL if count * size
+ * overflows or if allocation is not possible.
+ */
+void* virtual_calloc(void* heapstart, uint32_t count, uint32_t size);
+
+/**
+ * Allocates a block of at least size bytes whose address is a multiple of
+ * alignment, which must be a power of two. Blocks are already aligned to their
+ * own size from the start of the heap's blocks, so on a heap managed by the
+ * buddy engine the block is taken from an aligned position inside the smallest
+ * free block that has one, and is only as big as for virtual_malloc. This costs
+ * the same single search of the heap as virtual_malloc, but always takes the
+ * heap's lock, bypassing the thread caches and the background worker's
+ * reserves. The tree engines instead allocate a block of at least the
+ * alignment, which is aligned if the start of the heap's blocks is. Returns NULL
+ * if no aligned block could be allocated.
+ */
+void* virtual_aligned_alloc(void* heapstart, uint32_t alignment,
+                            uint32_t size);
+
+/**
+ * Allocates a block of at least size bytes as close as possible to hint, such as
+ * a block that will point to the new one, so that traversals touch fewer cache
+ * lines and pages. On a heap managed by the buddy engine, the block goes in the
+ * smallest subtree of the heap containing the hint that has a free block big
+ * enough, as near the hint as that free block allows, and only as big as for
+ * virtual_malloc. Like virtual_aligned_alloc, this always takes the heap's
+ * lock. A hint outside the heap, or a heap managed by a tree engine, gets the
+ * placement of virtual_malloc. Returns NULL if allocation is not possible.
+ */
+void* virtual_malloc_near(void* heapstart, uint32_t size, void* hint);
+
+/**
+ * Like virtual_aligned_alloc, but in the style of posix_memalign: the block is
+ * written to memptr, and the return value is 0 if successful, EINVAL if the
+ * alignment isn't a power of two multiple of sizeof(void*), or ENOMEM if there
+ * is no aligned block available. A size of 0 gives a NULL block.
+ */
+int virtual_posix_memalign(void* heapstart, void** memptr,
+                           uint32_t alignment, uint32_t size);
+
 /**
  * Emulates free on the virtual heap according to the buddy algorithm.
  * Unallocates a block pointed to by ptr and merges it with its buddy if the
  * buddy is also unallocated. Repeats the process until no longer possible.
- * Returns 0 if successful, 1 if not.
+ * Returns 0 if successful, 1 if not. While frees are deferred by
+ * virtual_defer_frees, only a pointer outside the heap, not aligned to the
+ * smallest block size or already queued is reported as an error.
  */
 int virtual_free(void* heapstart, void* ptr);
 
+/**
+ * Frees a block like virtual_free, given the size that was asked for when it was
+ * allocated, or any other size that would give a block of the same size. The
+ * size gives the block's order, so a tree heap goes straight to the block's
+ * node, and a pointer that isn't aligned to the order is refused without
+ * searching. The size must match the block unless the block is only cached or
+ * queued by the thread caches, the background worker or virtual_defer_frees, in
+ * which case it isn't checked. Returns 0 if successful, 1 if not.
+ */
+int virtual_free_sized(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Frees count blocks at once. On a heap managed by the buddy engine without the
+ * thread caches or the background worker in front of it, the pointers are
+ * sorted by address (in place) and the blocks are freed and merged in a single
+ * pass over the heap information, so that the heap is only searched and shrunk
+ * once. In that case nothing is freed if any pointer isn't an allocated block or
+ * appears twice. Otherwise each block is freed as by virtual_free. Returns 0 if
+ * successful, 1 if not.
+ */
+int virtual_free_batch(void* heapstart, void** ptrs, uint32_t count);
+
 /**
  * Emulates realloc on the virtual heap using the buddy allocation algorithm.
  * Attempts to resize a block to a specified size, moving it if necessary.
@@ -58,6 +343,379 @@ int virtual_free(void* heapstart, void* ptr);
  */
 void* virtual_realloc(void* heapstart, void* ptr, uint32_t size);
 
+/**
+ * Puts a cache of recently freed blocks of each size in front of the heap for
+ * every thread, so that most mallocs and frees by the same thread don't take
+ * the heap's lock or search its information. Each thread's cache holds at most
+ * max_count blocks of each size and max_bytes bytes in total, and is flushed
+ * back to the heap when the thread exits. A thread whose cache is empty when
+ * the heap has run out takes a block from the cache of whichever thread has the
+ * most to spare. Cached blocks still show as allocated in virtual_info. Should
+ * be called before other threads use the heap. Passing 0 for max_count turns
+ * the caches off again, with each thread flushing its cache on its next call.
+ * Returns 0 if successful, 1 if not.
+ */
+int virtual_tcache_enable(void* heapstart, uint32_t max_count,
+                          uint32_t max_bytes);
+
+/**
+ * Like virtual_tcache_enable, but with a cache for every CPU instead of every
+ * thread, so that threads which sit idle don't hold on to any blocks. Each
+ * CPU's cache holds at most max_count blocks of each size, and at most max_bytes
+ * bytes of each size. The caches are updated inside restartable sequences,
+ * which the kernel restarts if the thread is preempted or moved to another CPU
+ * part way through, so they need no atomic operations. Threads that can't use
+ * restartable sequences get their own cache as with virtual_tcache_enable.
+ * Turning the caches off or back to per-thread caches returns the blocks in
+ * every CPU's cache to the heap at once, so no other thread may be using the
+ * heap at the time. Returns 0 if successful, 1 if not.
+ */
+int virtual_pcpu_enable(void* heapstart, uint32_t max_count,
+                        uint32_t max_bytes);
+
+/**
+ * Returns every block in the calling thread's cache to the heap, including
+ * blocks other threads have freed back to it, as well as every block in the
+ * cache of the CPU it is running on.
+ */
+void virtual_tcache_flush(void* heapstart);
+
+/**
+ * Fills in statistics about blocks freed by a thread other than the one whose
+ * cache they came from, which are counted as their owner collects them, and
+ * about blocks stolen from another thread's cache.
+ */
+void virtual_remote_stats(void* heapstart, remote_stats_t* stats);
+
+/**
+ * Starts a background thread which takes merging and splitting off the threads
+ * using the heap. Frees are queued for the worker to do, and the worker keeps a
+ * reserve of blocks split off ahead of time for each size given to
+ * virtual_worker_reserve, so that most mallocs and frees only touch a list.
+ * Blocks waiting to be freed and blocks in a reserve show as allocated in
+ * virtual_info. Can't be used together with the thread caches, or on a heap with
+ * blocks smaller than a pointer. Should be called before other threads use the
+ * heap. Returns 0 if successful, 1 if not.
+ */
+int virtual_worker_start(void* heapstart);
+
+/**
+ * Sets how many blocks big enough for `size` bytes the background worker keeps
+ * split off ahead of time, and fills the reserve straight away. Passing 0 for
+ * count stops keeping any. Returns 0 if successful, 1 if not.
+ */
+int virtual_worker_reserve(void* heapstart, uint32_t size, uint32_t count);
+
+/**
+ * Sets how many blocks big enough for `size` bytes the background worker keeps
+ * split off and cleared ahead of time for virtual_calloc, and fills the reserve
+ * straight away. The blocks are cleared without holding the heap's lock, so
+ * calloc only has to clear the pointer linking the block into the reserve.
+ * Passing 0 for count stops keeping any. Returns 0 if successful, 1 if not.
+ */
+int virtual_worker_prezero(void* heapstart, uint32_t size, uint32_t count);
+
+/**
+ * Stops the background worker, first freeing every queued block and returning
+ * the reserves to the heap. Should be called once other threads have stopped
+ * using the heap.
+ */
+void virtual_worker_stop(void* heapstart);
+
+/**
+ * Queues frees on the heap instead of doing them straight away, and frees the
+ * queued blocks together with virtual_free_batch once batch of them have built
+ * up, or when a malloc would otherwise fail. Queued blocks show as allocated in
+ * virtual_info. Can't be used together with the thread caches or the background
+ * worker. While frees are queued, virtual_free only checks that a block is in
+ * the heap, aligned to the smallest block size and not queued already, so other
+ * errors aren't reported, and a bad pointer is skipped when the queue is
+ * flushed. Passing 0 for batch flushes the queue and stops queueing. Returns 0
+ * if successful, 1 if not.
+ */
+int virtual_defer_frees(void* heapstart, uint32_t batch);
+
+/**
+ * Frees every block queued by virtual_defer_frees straight away.
+ */
+void virtual_flush_frees(void* heapstart);
+
+/**
+ * Opens a scope on the heap, returning a mark to pass to virtual_release. Every
+ * block allocated from now until the mark is released is recorded, in a log kept
+ * outside the heap, so that it can be freed along with the rest of the scope.
+ * Scopes can be nested. Only heaps managed by the buddy engine have scopes, and
+ * they can't be used together with the thread caches, the background worker or
+ * virtual_defer_frees. Returns VIRTUAL_NO_MARK if no scope could be opened.
+ */
+uint32_t virtual_mark(void* heapstart);
+
+/**
+ * Closes the scope opened by mark, along with any scopes opened inside it, and
+ * frees every block allocated in them that hasn't been freed already. Blocks
+ * allocated before the mark are left alone, as are blocks moved by realloc that
+ * were allocated before it. The blocks to free come straight from the log, so
+ * the heap is never searched for them, and they are freed and merged together in
+ * a single pass over the heap information. Returns 0 if successful, 1 if not.
+ */
+int virtual_release(void* heapstart, uint32_t mark);
+
+/**
+ * Allocates a block like virtual_malloc, and tags it so that it can be freed
+ * along with every other block with the same tag by virtual_free_tag. The tags
+ * are kept outside the heap, in a slot for every position a block can start at
+ * and a list of blocks for each tag. Only heaps managed by the buddy engine
+ * have tags, and they can't be used together with the thread caches, the
+ * background worker or virtual_defer_frees. At most 255 tags can have blocks at
+ * once. Returns NULL if allocation is not possible.
+ */
+void* virtual_malloc_tagged(void* heapstart, uint32_t size, uint32_t tag);
+
+/**
+ * Frees every block with the given tag, and forgets the tag. The blocks come
+ * straight from the tag's list, so the heap is never searched for them, and
+ * they are freed and merged together in a single pass over the heap
+ * information. Returns 0 if successful, 1 if not, e.g. if no blocks have had
+ * the tag since it was last freed.
+ */
+int virtual_free_tag(void* heapstart, uint32_t tag);
+
+/**
+ * Returns the bytes in blocks with the given tag that haven't been freed, which
+ * counts every block at its full size.
+ */
+uint64_t virtual_tag_bytes(void* heapstart, uint32_t tag);
+
+/**
+ * Sets up a bump allocator, which takes blocks of chunk_size bytes (rounded up
+ * to a power of two) from the heap with virtual_malloc as it needs them, and
+ * hands out slices of them by moving a pointer along. The blocks show as
+ * allocated in the heap's information and statistics like any other. A bump
+ * allocator is meant for one thread at a time. Nothing is allocated until the
+ * first slice is. Returns 0 if successful, 1 if not.
+ */
+int virtual_bump_init(void* heapstart, bump_t* bump, uint32_t chunk_size);
+
+/**
+ * Allocates a slice of size bytes from a bump allocator, aligned to 16 bytes.
+ * Unless the current block has run out, this only moves a pointer. Slices can't
+ * be freed on their own, only all together by virtual_bump_reset. Returns NULL
+ * if size is 0 or the heap has run out.
+ */
+void* virtual_bump_alloc(bump_t* bump, uint32_t size);
+
+/**
+ * Frees every slice from a bump allocator at once, by handing every block it
+ * took back to the heap with virtual_free_batch. The allocator can be used again
+ * afterwards.
+ */
+void virtual_bump_reset(bump_t* bump);
+
+/**
+ * Sets up a cache of objects of size bytes each, aligned to align bytes, which
+ * must be a power of two no bigger than a page. Objects are carved from slabs
+ * allocated from the heap with virtual_malloc, and ctor, if given, is called on
+ * every object when its slab is allocated. Freed objects go back to their slab
+ * as they are, so an object is only constructed once however often it is
+ * allocated, and dtor, if given, is only called when its slab is handed back to
+ * the heap. Slabs that become empty are kept until virtual_cache_reap, or until
+ * an allocation from a heap managed by the buddy engine runs out. Returns 0 if
+ * successful, 1 if not.
+ */
+int virtual_cache_init(void* heapstart, object_cache_t* cache, uint32_t size,
+                       uint32_t align, void (*ctor)(void*),
+                       void (*dtor)(void*));
+
+/**
+ * Allocates a constructed object from a cache, taking it from a slab that is
+ * already in use before an empty one, and only allocating a new slab if every
+ * slab is full. Returns NULL if the heap has run out.
+ */
+void* virtual_cache_alloc(object_cache_t* cache);
+
+/**
+ * Returns an object to its slab in a cache, still constructed. The object's
+ * slab follows from its address, since slabs are aligned to their size. Returns
+ * 0 if successful, 1 if not, e.g. if the object isn't from the cache.
+ */
+int virtual_cache_free(object_cache_t* cache, void* object);
+
+/**
+ * Hands every empty slab of a cache back to the heap, destroying its objects.
+ * Returns how many slabs were handed back.
+ */
+uint32_t virtual_cache_reap(object_cache_t* cache);
+
+/**
+ * Fills in the statistics of a cache: how many objects have been allocated and
+ * freed, constructed and destroyed, how many are in use, and how many slabs the
+ * cache has, of which how many are empty.
+ */
+void virtual_cache_stats(object_cache_t* cache, cache_stats_t* stats);
+
+/**
+ * Hands every slab of a cache back to the heap and forgets the cache, once all
+ * of its objects have been freed. Returns 0 if successful, 1 if objects are
+ * still in use.
+ */
+int virtual_cache_destroy(object_cache_t* cache);
+
+/**
+ * Sets up a ring of size bytes (rounded up to a power of two), allocated from
+ * the heap with virtual_malloc, from which records of any length are allocated
+ * one after the other, wrapping around at the end. Records are meant to be
+ * released in about the order they were allocated, so that the ring's space
+ * frees up from the oldest record, but may be released in any order. A ring is
+ * meant for one thread at a time. Returns 0 if successful, 1 if not.
+ */
+int virtual_ring_init(void* heapstart, ring_t* ring, uint32_t size);
+
+/**
+ * Allocates a record of size bytes at the head of a ring, aligned to 16 bytes.
+ * If it doesn't fit before the end of the ring, it goes at the start once the
+ * records there have been released. Returns NULL if size is 0 or there isn't
+ * enough space between the head and the oldest record that hasn't been
+ * released.
+ */
+void* virtual_ring_alloc(ring_t* ring, uint32_t size);
+
+/**
+ * Releases a record allocated from a ring. Its space is only reused once every
+ * record allocated before it has been released too, at which point the space
+ * of all of them is freed up at once. Returns 0 if successful, 1 if not, e.g.
+ * if the record has already been released.
+ */
+int virtual_ring_release(ring_t* ring, void* ptr);
+
+/**
+ * Hands a ring's space back to the heap, along with every record in it.
+ */
+void virtual_ring_destroy(ring_t* ring);
+
+/**
+ * Returns how many bytes of memory a heap of 2^initial_size bytes with blocks
+ * of at least 2^min_size bytes needs at most, including its handle and the
+ * padding to align it, its header and the padding before its first block, and
+ * the most its information can grow to, which is a byte for every block of the
+ * minimum size and as much again for realloc to back it up.
+ */
+size_t virtual_heap_footprint(uint8_t initial_size, uint8_t min_size);
+
+/**
+ * Creates a heap of 2^initial_size bytes, with blocks of at least 2^min_size
+ * bytes, in a mapping of its own rather than at the program break. The handle,
+ * header, blocks and information all live in the mapping, so any number of
+ * heaps can exist at once, independent of each other and of the heap at the
+ * program break, and destroying one is a single unmap. The mapping starts out
+ * zeroed, so calloc needn't clear blocks that have never been used. Each heap
+ * has its own lock, and is managed by the buddy engine, placing blocks
+ * leftmost. Returns NULL if the heap couldn't be mapped.
+ */
+heap_t* virtual_heap_create(uint8_t initial_size, uint8_t min_size);
+
+/**
+ * Creates a heap like virtual_heap_create, but in size bytes of memory given by
+ * the caller, which stays theirs to reuse once the heap is destroyed. The
+ * memory is not assumed to be zeroed. virtual_heap_footprint gives how much
+ * memory is enough. Returns NULL if the memory is too small.
+ */
+heap_t* virtual_heap_create_in(void* memory, size_t size, uint8_t initial_size,
+                               uint8_t min_size);
+
+/**
+ * Creates a heap of 2^order bytes with blocks of at least 2^min_order bytes in
+ * a block of that size allocated from a parent heap made by
+ * virtual_heap_create, which may itself be inside another, so that the block
+ * is the child's whole budget for its blocks. The child's handle, header and
+ * information are kept beside the block, in a second, much smaller allocation
+ * from the parent. The child is otherwise independent of its parent, with its
+ * own lock. Returns NULL if the parent has no room for either allocation.
+ */
+heap_t* virtual_subheap_create(heap_t* parent, uint8_t order,
+                               uint8_t min_order);
+
+/**
+ * Creates a heap inside a block allocated from the heap at the program break
+ * with virtual_malloc, like virtual_subheap_create.
+ */
+heap_t* virtual_subheap_create_at(void* heapstart, uint8_t order,
+                                  uint8_t min_order);
+
+/**
+ * Destroys a heap made by virtual_heap_create or virtual_heap_create_in, along
+ * with every block still allocated from it, without looking at any of them. A
+ * heap inside a block of a parent heap hands the whole block back to the
+ * parent as a single free, however many blocks are allocated inside it, along
+ * with the allocation holding its handle and information. Heaps
+ * inside a heap's blocks go along with it, so they shouldn't be destroyed
+ * afterwards.
+ */
+void virtual_heap_destroy(heap_t* heap);
+
+/**
+ * Allocates a block of at least size bytes from a heap made by
+ * virtual_heap_create, like virtual_malloc. Returns NULL if allocation is not
+ * possible.
+ */
+void* virtual_heap_malloc(heap_t* heap, uint32_t size);
+
+/**
+ * Allocates a block for count elements of size bytes each from a heap made by
+ * virtual_heap_create, like virtual_calloc, clearing it only if it might not
+ * hold zeroes already. Returns NULL if count * size overflows or if allocation
+ * is not possible.
+ */
+void* virtual_heap_calloc(heap_t* heap, uint32_t count, uint32_t size);
+
+/**
+ * Frees a block allocated from a heap made by virtual_heap_create, like
+ * virtual_free. Returns 0 if successful, 1 if not.
+ */
+int virtual_heap_free(heap_t* heap, void* ptr);
+
+/**
+ * Resizes a block allocated from a heap made by virtual_heap_create, like
+ * virtual_realloc. Returns the block, which may have moved, or NULL if it
+ * couldn't be resized, in which case it is left as it was.
+ */
+void* virtual_heap_realloc(heap_t* heap, void* ptr, uint32_t size);
+
+/**
+ * Returns how many bytes can be used in the block starting at ptr in a heap
+ * made by virtual_heap_create, or 0 if there is no such block.
+ */
+uint32_t virtual_heap_usable_size(heap_t* heap, void* ptr);
+
+/**
+ * Prints information about each block in a heap made by virtual_heap_create,
+ * like virtual_info.
+ */
+void virtual_heap_info(heap_t* heap);
+
+/**
+ * Returns how many bytes can be used in the allocated block starting at ptr,
+ * i.e. the power of two it was rounded up to, or 0 if there is no such block.
+ */
+uint32_t virtual_usable_size(void* heapstart, void* ptr);
+
+/**
+ * Fills in a snapshot of the number of free and allocated blocks of each order
+ * on the heap, the free bytes in blocks of each order, and the largest order of
+ * any free block, or -1 if there are none. The snapshot is kept up to date by
+ * the threads changing the heap, so reading it never takes the heap's lock or
+ * holds those threads up, and it is always consistent. Only heaps managed by the
+ * buddy engine have statistics. Returns 0 if successful, 1 if not.
+ */
+int virtual_stats(void* heapstart, heap_stats_t* stats);
+
+/**
+ * Fills in how many blocks virtual_malloc_near has placed near their hints
+ * since the heap was initialised, how far from their hints they ended up in
+ * total and at most, and how many fell back to normal placement because their
+ * hints weren't in the heap.
+ */
+void virtual_near_stats(void* heapstart, near_stats_t* stats);
+
 /**
  * Prints information about each block in the heap, from left (smallest address)
  * to right. For each block, displays whether it is allocated or free, and its
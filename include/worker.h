@@ -0,0 +1,49 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "virtual_alloc.h"
+
+/**
+ * Returns whether a background worker has been started for a heap, in which
+ * case every malloc, free and realloc on it has to go through it.
+ */
+bool worker_active(void* heapstart);
+
+/**
+ * Stops the background worker without returning anything to the heap, after the
+ * heap it was working on has been reinitialised.
+ */
+void worker_reset(void);
+
+/**
+ * Allocates a block from the reserve of pre-split blocks of its order, which
+ * only takes that reserve's lock. Falls back to allocating from the heap if the
+ * reserve is empty, and wakes the worker if the reserve is running low.
+ */
+void* worker_malloc(void* heapstart, uint32_t size);
+
+/**
+ * Allocates a cleared block from the reserve of blocks cleared ahead of time
+ * for its order, which only needs the link through the block to be cleared.
+ * Falls back to allocating from the heap and clearing the block if it isn't
+ * known to be clear already.
+ */
+void* worker_calloc(void* heapstart, uint32_t size);
+
+/**
+ * Queues a block handed out by the background worker to be freed and merged by
+ * the worker, without taking a lock. Freeing a block which is already queued or
+ * in a reserve is an error. Anything else, such as a block allocated before the
+ * worker started or a pointer into the middle of a block, is freed on the heap
+ * directly, which checks it without writing to it. Returns 0 if successful, 1
+ * if not.
+ */
+int worker_free(void* heapstart, void* ptr);
+
+/**
+ * Reallocates a block on the heap directly, unless the block is queued to be
+ * freed or in a reserve.
+ */
+void* worker_realloc(void* heapstart, void* ptr, uint32_t size);
+
+#endif
@@ -0,0 +1,823 @@
+#include "buddy.h"
+#include "handle.h"
+#include "stats.h"
+
+/**
+ * Initialises a virtual heap managed by the buddy engine, which stores a byte of
+ * information for every block in the heap after the heap itself, ordered by
+ * address.
+ */
+void buddy_init(void* heapstart, uint8_t initial_size, uint8_t min_size) {
+    // we store the first block (full heap size) and 2 bytes for heap size and
+    // minimum block size
+    void* prog_break = heap_sbrk(0);
+    if (prog_break == (void*) -1)
+        return;
+
+    heap_sbrk(heapstart - prog_break);  // reset heap
+
+    // store basic information about heap, which decides where the blocks start
+    if (heap_sbrk(2) == (void*) -1)
+        return;
+    *(uint8_t*) heapstart = initial_size;
+    *((uint8_t*) heapstart + 1) = min_size;
+
+    // allocate space for the padding up to the first block, the heap, and 1
+    // byte for first block information
+    block_t* info_start = get_info(heapstart);
+    heap_sbrk((uint8_t*) (info_start + 1) - ((uint8_t*) heapstart + 2));
+
+    // the information can grow to a byte for every block of the minimum size,
+    // and realloc backs it up after itself
+    size_t max_blocks = (size_t) 1 << (initial_size
+                                       - MIN(initial_size, min_size));
+    // a heap with a handle knows whether its own memory is fresh, and leaves
+    // what is kept for the heap at the program break alone
+    heap_t* handle = heap_handle();
+    bool fresh = handle != NULL
+                 ? handle->fresh
+                 : fresh_memory(prog_break, get_blocks(heapstart),
+                                (uint8_t*) info_start + 2 * max_blocks + 1);
+
+    // store information about first block (free, full heap size)
+    *info_start = (block_t) {false, initial_size, fresh};
+
+    if (handle != NULL)
+        return;
+
+    reset_growth();
+    set_placement(PLACEMENT_LEFTMOST);
+    stats_init(heapstart);
+}
+
+/**
+ * Splits a free block down to an allocated block of an order at an offset of
+ * rel bytes into it, which must be a multiple of the order's size. Returns the
+ * allocated block, or NULL if the heap information couldn't grow.
+ */
+static void* split_at(block_t* block, uint8_t* ptr, uint8_t order,
+                      uint32_t rel) {
+    uint8_t* prog_break = (uint8_t*) heap_sbrk(0);
+    uint8_t diff = block->size - order;
+    if (prog_break == (uint8_t*) -1 || heap_sbrk(diff) == (void*) -1)
+        return NULL;
+
+    memmove(block + 1 + diff, block + 1, prog_break - (uint8_t*) (block + 1));
+
+    uint8_t size_before = block->size;
+    bool zeroed = block->zeroed;
+    stats_begin();
+    stats_add(size_before, false, -1);
+
+    // splitting down to the position leaves one free half at each size. the
+    // halves the block is to the right of come before it, biggest first, and
+    // the others after it, smallest first
+    block_t* info = block;
+    for (uint8_t half = size_before; half-- > order; ) {
+        if (rel & (1 << half)) {
+            *info++ = (block_t) {false, half, zeroed};
+            stats_add(half, false, 1);
+        }
+    }
+
+    *info++ = (block_t) {true, order};
+    stats_add(order, true, 1);
+
+    for (uint8_t half = order; half < size_before; half++) {
+        if (!(rel & (1 << half))) {
+            *info++ = (block_t) {false, half, zeroed};
+            stats_add(half, false, 1);
+        }
+    }
+
+    stats_end();
+
+    return ptr + rel;
+}
+
+/**
+ * Emulates malloc on a buddy heap. Allocates the block in the leftmost
+ * unallocated position that is sufficiently large by splitting until reaching
+ * the desired size. Allocates blocks in sizes of powers of 2. If allocation is
+ * not possible, returns NULL.
+ */
+void* buddy_malloc(void* heapstart, uint32_t size) {
+    bool zeroed;
+    return buddy_malloc_zeroed(heapstart, size, &zeroed);
+}
+
+/**
+ * Allocates a block on a buddy heap like buddy_malloc, also reporting whether
+ * the block is known to hold nothing but zeroes, so that it needn't be cleared.
+ */
+void* buddy_malloc_zeroed(void* heapstart, uint32_t size, bool* zeroed) {
+    if (size == 0)
+        return NULL;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size > 1 << heap_size)
+        return NULL;
+
+    // block sizes have to be a power of 2 so take a log, however it also needs
+    // to be at least min_size
+    uint8_t needed_size = MAX(min_size, log_2(size));
+
+    // keep track of pointer in heap for the block to allocate
+    uint8_t* ptr = get_blocks(heapstart);
+    // find the leftmost block of the smallest size in the heap
+    block_t* block = smallest_block(heapstart, needed_size, &ptr);
+    if (block == NULL)
+        // no valid unallocated block was found
+        return NULL;
+
+    // a block freed recently inside the free block is handed out where it was
+    uint32_t rel = placement_offset(ptr, block->size, needed_size);
+    if (rel != 0) {
+        *zeroed = block->zeroed;
+        return split_at(block, ptr, needed_size, rel);
+    }
+
+    // if the smallest valid block size is larger than what we need, we will
+    // need to split blocks in half until we reach that size. this requires us
+    // to expand the virtual heap to fit the information for the extra blocks
+    uint8_t diff = block->size - needed_size;
+    if (heap_sbrk(diff) == (void*) -1)
+        return NULL;
+
+    uint8_t* prog_break = (uint8_t*) heap_sbrk(0);
+    if (prog_break == (uint8_t*) -1)
+        return NULL;
+
+    stats_begin();
+    stats_add(block->size, false, -1);
+
+    // if we need to split, move everything over to fit the extra blocks
+    shift(block + 1, prog_break, diff);
+
+    // split blocks and create extra unallocated blocks if needed. the halves
+    // are zeroed if the block they came from was
+    for (uint8_t i = diff; i > 0; i--) {
+        block->size--;
+        *(block + i) = (block_t) {false, block->size, block->zeroed};
+        stats_add(block->size, false, 1);
+    }
+
+    // the block won't stay zeroed once it's been handed out
+    *zeroed = block->zeroed;
+    block->zeroed = false;
+    block->allocated = true;
+    stats_add(block->size, true, 1);
+    stats_end();
+
+    return ptr;
+}
+
+/**
+ * Allocates a block on a buddy heap as close as possible to one end of the heap,
+ * splitting the first free block big enough down to its first position, or if
+ * high is set, the last free block big enough down to its last position.
+ * Returns NULL if allocation is not possible.
+ */
+void* buddy_malloc_end(void* heapstart, uint32_t size, bool high) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size == 0 || size > 1 << heap_size)
+        return NULL;
+
+    uint8_t order = MAX(min_size, log_2(size));
+
+    block_t* info_start = get_info(heapstart);
+    block_t* best = NULL;
+    uint8_t* best_ptr = NULL;
+
+    // the size of the free block doesn't matter, only how near the end it is
+    uint8_t* ptr = get_blocks(heapstart);
+    uint8_t* end = ptr + (1 << heap_size);
+    for (block_t* block = info_start; ptr < end;
+            ptr += 1 << block->size, block++) {
+        if (!block->allocated && block->size >= order) {
+            best = block;
+            best_ptr = ptr;
+            if (!high)
+                break;
+        }
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    return split_at(best, best_ptr, order,
+                    high ? (1 << best->size) - (1 << order) : 0);
+}
+
+/**
+ * Allocates a block on a buddy heap whose address is a multiple of alignment,
+ * which must be a power of two. Of the free blocks with an aligned position for
+ * a block of the order needed, the smallest is split down to that position, so
+ * the block is no bigger than for buddy_malloc. If there is no such position,
+ * returns NULL.
+ */
+void* buddy_aligned_alloc(void* heapstart, uint32_t alignment, uint32_t size) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size == 0 || size > 1 << heap_size || alignment == 0
+            || alignment & (alignment - 1))
+        return NULL;
+
+    uint8_t order = MAX(min_size, log_2(size));
+
+    block_t* info_start = get_info(heapstart);
+    block_t* best = NULL;
+    uint8_t* best_ptr = NULL;
+    uint32_t best_rel = 0;
+
+    // like smallest_block, but only counting free blocks with an aligned
+    // position inside them. the distance from the start of a free block to the
+    // next aligned address has to be a whole number of blocks of the order
+    // needed, and leave room for one
+    uint8_t* ptr = get_blocks(heapstart);
+    uint8_t* end = ptr + (1 << heap_size);
+    for (block_t* block = info_start; ptr < end;
+            ptr += 1 << block->size, block++) {
+        if (block->allocated || block->size < order
+                || (best != NULL && block->size >= best->size))
+            continue;
+
+        uint32_t rel = -(uintptr_t) ptr & (alignment - 1);
+        if (rel & ((1 << order) - 1) || rel >= 1 << block->size)
+            continue;
+
+        best = block;
+        best_ptr = ptr;
+        best_rel = rel;
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    return split_at(best, best_ptr, order, best_rel);
+}
+
+/**
+ * Allocates a block on a buddy heap as close as possible to hint, a pointer into
+ * the heap. The free blocks are searched for a position in the smallest subtree
+ * that also holds the hint, i.e. the smallest aligned block containing both,
+ * taking the smallest free block among those in the same subtree. Inside the
+ * free block, the block goes at the end nearest the hint. A hint outside the
+ * heap falls back to the placement of buddy_malloc. Returns NULL if allocation
+ * is not possible.
+ */
+void* buddy_malloc_near(void* heapstart, uint32_t size, void* hint) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if (size == 0 || size > 1 << heap_size)
+        return NULL;
+
+    if ((uint8_t*) hint < heap || (uint8_t*) hint >= heap + (1 << heap_size)) {
+        void* block = buddy_malloc(heapstart, size);
+        if (block != NULL)
+            stats_near(0, true);
+        return block;
+    }
+
+    uint8_t order = MAX(min_size, log_2(size));
+    uint32_t target = (uint8_t*) hint - heap;
+
+    block_t* info_start = get_info(heapstart);
+    block_t* best = NULL;
+    uint8_t* best_ptr = NULL;
+    uint32_t best_rel = 0;
+    uint8_t best_level = UINT8_MAX;
+
+    uint8_t* ptr = heap;
+    for (block_t* block = info_start; ptr < heap + (1 << heap_size);
+            ptr += 1 << block->size, block++) {
+        if (block->allocated || block->size < order)
+            continue;
+
+        // the closest position in the block is the one holding the hint, or
+        // otherwise whichever end of the block faces it
+        uint32_t offset = ptr - heap;
+        uint32_t rel = 0;
+        if (target >= offset + (1 << block->size))
+            rel = (1 << block->size) - (1 << order);
+        else if (target >= offset)
+            rel = (target - offset) & ~((1 << order) - 1);
+
+        // the smallest subtree holding both positions is the order of the
+        // highest bit in which they differ
+        uint32_t differ = (offset + rel) ^ target;
+        uint8_t level = differ == 0 ? 0 : 32 - __builtin_clz(differ);
+        if (level < best_level
+                || (level == best_level && block->size < best->size)) {
+            best = block;
+            best_ptr = ptr;
+            best_rel = rel;
+            best_level = level;
+        }
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    uint8_t* block = split_at(best, best_ptr, order, best_rel);
+    if (block != NULL) {
+        stats_near(block > (uint8_t*) hint ? block - (uint8_t*) hint
+                                           : (uint8_t*) hint - block, false);
+    }
+
+    return block;
+}
+
+/**
+ * Splits a free block into as many blocks of an order as are wanted from its
+ * left, leaving the rest as the largest aligned free blocks that fit, with a
+ * single move of the heap information. Returns how many blocks were allocated.
+ */
+static uint32_t carve_block(block_t* block, uint8_t* ptr, uint8_t order,
+                            uint32_t count, void** out) {
+    uint8_t* prog_break = heap_sbrk(0);
+    if (prog_break == (uint8_t*) -1)
+        return 0;
+
+    uint8_t size = block->size;
+    bool zeroed = block->zeroed;
+    uint32_t units = (uint32_t) 1 << (size - order);
+    uint32_t allocated = MIN(count, units);
+
+    // each free block left over starts where the last one ended, and is as big
+    // as that position's alignment allows. they are all right buddies of
+    // something allocated, so none of them can be merged
+    uint8_t rest[32];
+    uint8_t pieces = 0;
+    for (uint32_t pos = allocated; pos < units; pos += (uint32_t) 1 << rest[pieces++])
+        rest[pieces] = __builtin_ctz(pos);
+
+    int32_t extra = allocated + pieces - 1;
+    if (heap_sbrk(extra) == (void*) -1)
+        return 0;
+
+    stats_begin();
+    stats_add(size, false, -1);
+    stats_add(order, true, allocated);
+
+    memmove(block + 1 + extra, block + 1, prog_break - (uint8_t*) (block + 1));
+
+    for (uint32_t i = 0; i < allocated; i++) {
+        block[i] = (block_t) {true, order};
+        out[i] = ptr + (i << order);
+    }
+
+    for (uint8_t i = 0; i < pieces; i++) {
+        block[allocated + i] = (block_t) {false, order + rest[i], zeroed};
+        stats_add(order + rest[i], false, 1);
+    }
+
+    stats_end();
+
+    return allocated;
+}
+
+/**
+ * Allocates up to count blocks of the same size on a buddy heap, writing them to
+ * out. Rather than searching and splitting for every block, the smallest free
+ * block that can hold all of them is carved up in one go, into the blocks from
+ * its left and the largest free blocks that fit in what is left over. If no free
+ * block is big enough, the biggest ones are used until enough blocks have been
+ * found. Returns how many blocks were allocated.
+ */
+uint32_t buddy_malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                            void** out) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size == 0 || size > 1 << heap_size)
+        return 0;
+
+    uint8_t order = MAX(min_size, log_2(size));
+    uint32_t delivered = 0;
+
+    while (delivered < count) {
+        // look for a block that holds everything that's left first, then for
+        // ever smaller blocks
+        uint8_t wanted = MIN(heap_size, order + log_2(count - delivered));
+        uint8_t* ptr = get_blocks(heapstart);
+        block_t* block = smallest_block(heapstart, wanted, &ptr);
+
+        while (block == NULL && wanted > order) {
+            wanted--;
+            ptr = get_blocks(heapstart);
+            block = smallest_block(heapstart, wanted, &ptr);
+        }
+
+        if (block == NULL)
+            break;
+
+        uint32_t carved = carve_block(block, ptr, order, count - delivered,
+                                      out + delivered);
+        if (carved == 0)
+            break;
+
+        delivered += carved;
+    }
+
+    return delivered;
+}
+
+/**
+ * Frees a block whose information has already been found, merging it with its
+ * buddies, and recording whether it holds nothing but zeroes. Returns 0 if
+ * successful, 1 if not.
+ */
+static int free_block(void* heapstart, block_t* block, void* ptr,
+                      bool zeroed) {
+    drop_growth(ptr);
+    note_free(ptr);
+
+    stats_begin();
+    stats_add(block->size, true, -1);
+    stats_add(block->size, false, 1);
+
+    // free the block and merge if needed according to the buddy algorithm
+    block->allocated = false;
+    block->zeroed = zeroed;
+    int ret = merge_blocks(heapstart, block, ptr);
+    if (ret) {
+        // reset if non-zero (error)
+        block->allocated = true;
+        block->zeroed = false;
+        stats_recount(heapstart);
+    }
+
+    stats_end();
+
+    return ret;
+}
+
+/**
+ * Emulates free on a buddy heap. Unallocates a block pointed to by ptr and
+ * merges it with its buddy if the buddy is also unallocated. Repeats the
+ * process until no longer possible. Returns 0 if successful, 1 if not.
+ */
+int buddy_free(void* heapstart, void* ptr) {
+    // find the information about the block reference by ptr
+    block_t* block = get_block_info(heapstart, ptr);
+    if (block == NULL || !block->allocated)
+        // can't free this block, not found or already free
+        return 1;
+
+    return free_block(heapstart, block, ptr, false);
+}
+
+/**
+ * Frees a block on a buddy heap like buddy_free, where the caller has cleared
+ * the block, so that it can be handed out again without being cleared.
+ */
+int buddy_free_zeroed(void* heapstart, void* ptr) {
+    block_t* block = get_block_info(heapstart, ptr);
+    if (block == NULL || !block->allocated)
+        return 1;
+
+    return free_block(heapstart, block, ptr, true);
+}
+
+/**
+ * Frees a block on a buddy heap like buddy_free, given a size that was allocated
+ * there. The block's order follows from the size, so a pointer that isn't
+ * aligned to it is refused without searching, and the block found must be of
+ * that order. Returns 0 if successful, 1 if not.
+ */
+int buddy_free_sized(void* heapstart, void* ptr, uint32_t size) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if (size == 0 || size > 1 << heap_size || (uint8_t*) ptr < heap
+            || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return 1;
+
+    // a block can only start at a multiple of its size from the heap's start
+    uint8_t order = MIN(heap_size, MAX(min_size, log_2(size)));
+    if (((uint8_t*) ptr - heap) & ((1 << order) - 1))
+        return 1;
+
+    block_t* block = get_block_info(heapstart, ptr);
+    if (block == NULL || !block->allocated || block->size != order)
+        return 1;
+
+    return free_block(heapstart, block, ptr, false);
+}
+
+/**
+ * Frees the blocks pointed to by pointers sorted by address, merging them with
+ * their buddies in a single pass over the heap information, which is only
+ * shrunk once at the end. Pointers that aren't allocated blocks, or appear
+ * twice, are skipped if skip is set, and otherwise stop anything being freed.
+ * Returns 0 if successful, 1 if not.
+ */
+static int free_sorted(void* heapstart, void** ptrs, uint32_t count,
+                       bool skip) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t* heap = get_blocks(heapstart);
+    block_t* start = get_info(heapstart);
+
+    // check every pointer before changing anything. since both the pointers and
+    // the blocks are in address order, one walk finds them all, and a pointer
+    // that falls behind the walk isn't the start of a block we haven't seen.
+    // the pointers that are kept are moved down over the ones skipped
+    uint32_t next = 0;
+    uint32_t kept = 0;
+    uint8_t* block_ptr = heap;
+    for (block_t* block = start; block_ptr < heap + (1 << heap_size)
+            && next < count; block_ptr += 1 << block->size, block++) {
+        for (; next < count && (uint8_t*) ptrs[next] < block_ptr; next++) {
+            if (!skip)
+                return 1;
+        }
+
+        if (next < count && (uint8_t*) ptrs[next] == block_ptr) {
+            if (block->allocated)
+                ptrs[kept++] = ptrs[next];
+            else if (!skip)
+                return 1;
+            next++;
+        }
+    }
+
+    if (next < count && !skip)
+        return 1;
+
+    count = kept;
+    if (count == 0)
+        return 0;
+
+    // the blocks are rewritten in place, using the part already written as a
+    // stack. after each block is pushed, the top two blocks are merged for as
+    // long as they are free buddies. only the offset of the top block needs to
+    // be kept, since a buddy's offset follows from its size
+    block_t* top = start;
+    uint32_t top_offset = 0;
+    block_t* block = start;
+    next = 0;
+    stats_begin();
+    for (uint32_t offset = 0; offset < 1 << heap_size; block++) {
+        block_t info = *block;
+
+        if (next < count && (uint8_t*) ptrs[next] == heap + offset) {
+            drop_growth(ptrs[next]);
+            note_free(ptrs[next]);
+            info.allocated = false;
+            info.zeroed = false;
+            stats_add(info.size, true, -1);
+            stats_add(info.size, false, 1);
+            next++;
+        }
+
+        *top++ = info;
+        top_offset = offset;
+        offset += 1 << info.size;
+
+        while (top - start >= 2) {
+            block_t* right = top - 1;
+            block_t* left = top - 2;
+
+            // the left block is only a buddy if merging it gives an aligned
+            // block of the next size up
+            uint32_t left_offset = top_offset - (1 << left->size);
+            if (right->allocated || left->allocated
+                    || right->size != left->size
+                    || left_offset & ((2 << left->size) - 1))
+                break;
+
+            stats_add(left->size, false, -2);
+            left->size++;
+            left->zeroed = left->zeroed && right->zeroed;
+            stats_add(left->size, false, 1);
+            top--;
+            top_offset = left_offset;
+        }
+    }
+
+    stats_end();
+
+    // shrink the heap once for every merge
+    if (block != top && heap_sbrk(top - block) == (void*) -1)
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Frees many blocks on a buddy heap at once. The pointers are sorted by address
+ * (in place), then every block is freed and merged with its buddies in a single
+ * pass over the heap information, which is only shrunk once at the end. If any
+ * pointer isn't an allocated block, or appears twice, nothing is freed. Returns
+ * 0 if successful, 1 if not.
+ */
+int buddy_free_batch(void* heapstart, void** ptrs, uint32_t count) {
+    if (count == 0)
+        return 0;
+
+    if (heap_sbrk(0) == (void*) -1)
+        return 1;
+
+    sort_pointers(ptrs, count);
+
+    return free_sorted(heapstart, ptrs, count, false);
+}
+
+/**
+ * Frees those of many pointers that are still allocated blocks on a buddy heap,
+ * like buddy_free_batch, but skipping pointers to blocks that have already been
+ * freed, pointers into the middle of blocks, and repeated pointers instead of
+ * refusing them. Returns 0 if successful, 1 if not.
+ */
+int buddy_free_live(void* heapstart, void** ptrs, uint32_t count) {
+    if (count == 0)
+        return 0;
+
+    if (heap_sbrk(0) == (void*) -1)
+        return 1;
+
+    sort_pointers(ptrs, count);
+
+    return free_sorted(heapstart, ptrs, count, true);
+}
+
+/**
+ * Grows an allocated block to a larger order without moving it, by merging it
+ * with the free buddies to its right. Returns 0 if successful, 1 if the block
+ * isn't the left half of the bigger block or its buddies aren't all free.
+ */
+static int grow_in_place(void* heapstart, block_t* block, uint8_t* ptr,
+                         uint8_t order) {
+    uint8_t* heap = get_blocks(heapstart);
+    uint8_t diff = order - block->size;
+
+    if ((ptr - heap) & ((1 << order) - 1))
+        return 1;
+
+    // since the block starts the bigger block, its buddy at each size is the
+    // next block along, and each is twice the size of the one before
+    for (uint8_t i = 1; i <= diff; i++) {
+        if (block[i].allocated || block[i].size != block->size + i - 1)
+            return 1;
+    }
+
+    uint8_t* prog_break = (uint8_t*) heap_sbrk(0);
+    if (prog_break == (uint8_t*) -1)
+        return 1;
+
+    stats_begin();
+    stats_add(block->size, true, -1);
+    for (uint8_t i = 1; i <= diff; i++)
+        stats_add(block[i].size, false, -1);
+    stats_add(order, true, 1);
+
+    block->size = order;
+    shift(block + 1 + diff, prog_break, -diff);
+    stats_end();
+
+    // the buddies no longer need any information
+    if (heap_sbrk(-diff) == (void*) -1)
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Emulates realloc on a buddy heap. Attempts to resize a block to a specified
+ * size, moving it if necessary. A growing block takes in its free buddies
+ * rather than move if it can, and its next buddy is then kept free for as long
+ * as possible, so that it can grow in place again. Until it is freed, such a
+ * block also stays where it is while it keeps the same size. If the block is
+ * unable to be reallocated, the heap is left unchanged and NULL is returned.
+ * Otherwise, a pointer to the new block is returned.
+ */
+void* buddy_realloc(void* heapstart, void* ptr, uint32_t size) {
+    if (size == 0) {
+        // if size is 0, behave as free
+        buddy_free(heapstart, ptr);
+        return NULL;
+    }
+
+    if (ptr == NULL)
+        // if block pointer is NULL, behave as malloc
+        return buddy_malloc(heapstart, size);
+
+    size_t heap_size = 1 << *(uint8_t*) heapstart;
+
+    if (size > heap_size)
+        return NULL;
+
+    // get information about this block
+    block_t* block = get_block_info(heapstart, ptr);
+    if (block == NULL || !block->allocated)
+        return NULL;
+
+    uint8_t og_size = block->size;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t order = MAX(min_size, log_2(size));
+
+    // a block that is being grown only moves when it has to
+    if (order == og_size && growing(ptr))
+        return ptr;
+
+    if (order > og_size && grow_in_place(heapstart, block, ptr, order) == 0) {
+        reserve_growth(heapstart, ptr, order);
+        return ptr;
+    }
+
+    uint8_t* prog_break = (uint8_t*) heap_sbrk(0);
+    if (prog_break == (uint8_t*) -1)
+        return NULL;
+
+    uint8_t* info_start = (uint8_t*) get_info(heapstart);
+    size_t info_size = prog_break - info_start;
+
+    // expand the virtual heap so that we can copy heap info for backup
+    if (heap_sbrk(info_size) == (void*) -1)
+        return NULL;
+
+    // backup the existing heap info
+    memmove(prog_break, info_start, info_size);
+
+    // readers of the statistics only see the free and malloc together
+    stats_begin();
+
+    // free the block to be reallocated
+    if (buddy_free(heapstart, ptr)) {
+        stats_end();
+        return NULL;
+    }
+
+    // reallocate the block
+    void* new_block = buddy_malloc(heapstart, size);
+
+    uint8_t* new_prog_break = (uint8_t*) heap_sbrk(0);
+    if (new_prog_break == (uint8_t*) -1) {
+        stats_end();
+        return NULL;
+    }
+
+    // since free/malloc can change the size of the heap, we should recompute
+    // where the backup is stored
+    uint8_t* backup_heap = new_prog_break - info_size;
+
+    // if reallocating failed, then restore the backup
+    if (new_block == NULL) {
+        memmove(info_start, backup_heap, info_size);
+        heap_sbrk(prog_break - new_prog_break);
+        stats_recount(heapstart);
+        stats_end();
+        return NULL;
+    }
+
+    stats_end();
+
+    // otherwise if reallocation succeeded, copy the data into the new block,
+    // unless it ended up where it was
+    if (new_block != ptr)
+        memmove(new_block, ptr, MIN(1 << og_size, size));
+
+    if (order > og_size)
+        reserve_growth(heapstart, new_block, order);
+
+    // finally, reshrink the heap, getting rid of the backup
+    if (heap_sbrk(-info_size) == (void*) -1)
+        return NULL;
+
+    return new_block;
+}
+
+/**
+ * Returns the size of the allocated block starting at ptr on a buddy heap, or 0
+ * if there is no such block.
+ */
+uint32_t buddy_usable_size(void* heapstart, void* ptr) {
+    block_t* block = get_block_info(heapstart, ptr);
+    if (block == NULL || !block->allocated)
+        return 0;
+
+    return (uint32_t) 1 << block->size;
+}
+
+/**
+ * Prints information about each block in a buddy heap, from left (smallest
+ * address) to right.
+ */
+void buddy_info(void* heapstart) {
+    size_t heap_size = 1 << *(uint8_t*) heapstart;
+    block_t* block = get_info(heapstart);
+
+    for (size_t pos = 0; pos < heap_size; pos += 1 << block->size, block++) {
+        printf(block->allocated ? "allocated" : "free");
+        printf(" %d\n", 1 << block->size);
+    }
+}
\ No newline at end of file
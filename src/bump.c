@@ -0,0 +1,100 @@
+#include "bump.h"
+
+// blocks are handed back to the heap in batches of this many on reset
+#define BUMP_BATCH 64
+
+/**
+ * Allocates a new block for a bump allocator whose current block has run out,
+ * and takes a slice of size bytes from it. A slice too big for a block of the
+ * usual size gets a block of its own, and the current block carries on. Returns
+ * NULL if the heap has run out.
+ */
+void* bump_refill(bump_t* bump, uint32_t size) {
+    // each block starts with a link to the previous one, padded so that the
+    // slices after it are aligned
+    size_t needed = (size_t) BUMP_ALIGN + size;
+    bool own = needed > bump->chunk_size;
+    if (needed > UINT32_MAX)
+        return NULL;
+
+    uint8_t* chunk = virtual_malloc(bump->heapstart,
+                                    own ? needed : bump->chunk_size);
+    if (chunk == NULL)
+        return NULL;
+
+    *(void**) chunk = bump->chunks;
+    bump->chunks = chunk;
+
+    uint8_t* slice = chunk + BUMP_ALIGN;
+    if (!own) {
+        bump->next = slice + ((size + BUMP_ALIGN - 1) & ~(BUMP_ALIGN - 1));
+        bump->end = chunk + bump->chunk_size;
+    }
+
+    return slice;
+}
+
+/**
+ * Sets up a bump allocator, which takes blocks of chunk_size bytes (rounded up
+ * to a power of two) from the heap with virtual_malloc as it needs them, and
+ * hands out slices of them by moving a pointer along. The blocks show as
+ * allocated in the heap's information and statistics like any other. A bump
+ * allocator is meant for one thread at a time. Nothing is allocated until the
+ * first slice is. Returns 0 if successful, 1 if not.
+ */
+int virtual_bump_init(void* heapstart, bump_t* bump, uint32_t chunk_size) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    if (chunk_size > 1 << heap_size)
+        return 1;
+
+    *bump = (bump_t) {
+        .heapstart = heapstart,
+        .chunk_size = MAX(1 << log_2(chunk_size), 2 * BUMP_ALIGN),
+    };
+
+    return 0;
+}
+
+/**
+ * Allocates a slice of size bytes from a bump allocator, aligned to 16 bytes.
+ * Unless the current block has run out, this only moves a pointer. Slices can't
+ * be freed on their own, only all together by virtual_bump_reset. Returns NULL
+ * if size is 0 or the heap has run out.
+ */
+void* virtual_bump_alloc(bump_t* bump, uint32_t size) {
+    size_t rounded = ((size_t) size + BUMP_ALIGN - 1)
+                     & ~(size_t) (BUMP_ALIGN - 1);
+
+    // a size of 0 wraps around, so that it never fits
+    if (rounded - 1 < (size_t) (bump->end - bump->next)) {
+        void* slice = bump->next;
+        bump->next += rounded;
+        return slice;
+    }
+
+    return size == 0 ? NULL : bump_refill(bump, size);
+}
+
+/**
+ * Frees every slice from a bump allocator at once, by handing every block it
+ * took back to the heap with virtual_free_batch. The allocator can be used again
+ * afterwards.
+ */
+void virtual_bump_reset(bump_t* bump) {
+    void* batch[BUMP_BATCH];
+    uint32_t count = 0;
+
+    for (void* chunk = bump->chunks; chunk != NULL;) {
+        batch[count++] = chunk;
+        chunk = *(void**) chunk;
+
+        if (count == BUMP_BATCH || chunk == NULL) {
+            virtual_free_batch(bump->heapstart, batch, count);
+            count = 0;
+        }
+    }
+
+    bump->next = NULL;
+    bump->end = NULL;
+    bump->chunks = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include "deferred.h"
+#include "buddy.h"
+#include "scope.h"
+#include "tags.h"
+#include "tcache.h"
+#include "worker.h"
+
+#include <sys/mman.h>
+
+// frees waiting to be done in one batch. the queue lives outside the virtual
+// heap so that it can't get in the way of the heap's information, and is only
+// touched under the heap's lock
+static void* deferred_heap;
+static void** queue;
+static uint32_t queued;
+static uint32_t capacity;
+
+/**
+ * Frees every queued block in one batch. If the batch is refused because one
+ * of the pointers is bad, the blocks are freed one at a time instead, so that
+ * the bad pointer doesn't keep the rest allocated. Expects the heap's lock to be
+ * held.
+ */
+static void flush_queue(void* heapstart) {
+    if (buddy_free_batch(heapstart, queue, queued)) {
+        for (uint32_t i = 0; i < queued; i++)
+            buddy_free(heapstart, queue[i]);
+    }
+
+    queued = 0;
+}
+
+/**
+ * Unmaps the queue, if there is one.
+ */
+static void free_queue(void) {
+    if (queue != NULL)
+        munmap(queue, capacity * sizeof(void*));
+
+    deferred_heap = NULL;
+    queue = NULL;
+    queued = 0;
+    capacity = 0;
+}
+
+/**
+ * Returns whether frees on a heap are being queued, in which case every malloc
+ * and free on it has to go through the queue.
+ */
+bool deferred_active(void* heapstart) {
+    return deferred_heap != NULL && deferred_heap == heapstart;
+}
+
+/**
+ * Forgets the queue of deferred frees without freeing anything, after the heap
+ * it was queueing for has been reinitialised.
+ */
+void deferred_reset(void) {
+    free_queue();
+}
+
+/**
+ * Queues frees on the heap instead of doing them straight away, and frees the
+ * queued blocks together with virtual_free_batch once batch of them have built
+ * up, or when a malloc would otherwise fail. Queued blocks show as allocated in
+ * virtual_info. Can't be used together with the thread caches or the background
+ * worker. While frees are queued, virtual_free only checks that a block is in
+ * the heap, aligned to the smallest block size and not queued already, so other
+ * errors aren't reported, and a bad pointer is skipped when the queue is
+ * flushed. Passing 0 for batch flushes the queue and stops queueing. Returns 0
+ * if successful, 1 if not.
+ */
+int virtual_defer_frees(void* heapstart, uint32_t batch) {
+    if (heap_engine(heapstart) != ENGINE_BUDDY || tcache_active(heapstart)
+            || worker_active(heapstart) || scope_active(heapstart)
+            || tags_active(heapstart))
+        return 1;
+
+    void** new_queue = NULL;
+    if (batch != 0) {
+        new_queue = mmap(NULL, batch * sizeof(void*), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new_queue == MAP_FAILED)
+            return 1;
+    }
+
+    lock_heap(heapstart);
+
+    if (deferred_active(heapstart))
+        flush_queue(heapstart);
+    free_queue();
+
+    if (new_queue != NULL) {
+        deferred_heap = heapstart;
+        queue = new_queue;
+        capacity = batch;
+    }
+
+    unlock_heap(heapstart);
+
+    return 0;
+}
+
+/**
+ * Frees every block queued by virtual_defer_frees straight away.
+ */
+void virtual_flush_frees(void* heapstart) {
+    lock_heap(heapstart);
+    if (deferred_active(heapstart))
+        flush_queue(heapstart);
+    unlock_heap(heapstart);
+}
+
+/**
+ * Allocates a block from the heap. If the heap has run out, the queued frees
+ * are done first and the allocation is tried again.
+ */
+void* deferred_malloc(void* heapstart, uint32_t size) {
+    lock_heap(heapstart);
+
+    void* block = buddy_malloc(heapstart, size);
+    if (block == NULL && queued != 0) {
+        // the space may be tied up in frees that haven't been done yet
+        flush_queue(heapstart);
+        block = buddy_malloc(heapstart, size);
+    }
+
+    unlock_heap(heapstart);
+
+    return block;
+}
+
+/**
+ * Allocates a batch of blocks from the heap. If the heap runs out part way, the
+ * queued frees are done first and the rest of the batch is tried again.
+ */
+uint32_t deferred_malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                               void** out) {
+    lock_heap(heapstart);
+
+    uint32_t delivered = buddy_malloc_batch(heapstart, size, count, out);
+    if (delivered < count && queued != 0) {
+        flush_queue(heapstart);
+        delivered += buddy_malloc_batch(heapstart, size, count - delivered,
+                                        out + delivered);
+    }
+
+    unlock_heap(heapstart);
+
+    return delivered;
+}
+
+/**
+ * Adds a block to the queue of deferred frees, freeing the whole queue in one
+ * batch once it is full. Before it is queued, the block is only checked to be in
+ * the heap, aligned to the smallest block size and not queued already, so any
+ * other bad pointer isn't reported as an error. Returns 0 if successful, 1 if
+ * not.
+ */
+int deferred_free(void* heapstart, void* ptr) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if ((uint8_t*) ptr < heap || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return 1;
+
+    // every block starts on a multiple of the smallest block size
+    if (((uint8_t*) ptr - heap) & ((1 << min_size) - 1))
+        return 1;
+
+    lock_heap(heapstart);
+
+    // the queue is never longer than a batch, so a double free is cheap to
+    // catch here rather than taking the whole batch down with it later
+    for (uint32_t i = 0; i < queued; i++) {
+        if (queue[i] == ptr) {
+            unlock_heap(heapstart);
+            return 1;
+        }
+    }
+
+    queue[queued++] = ptr;
+    if (queued == capacity)
+        flush_queue(heapstart);
+
+    unlock_heap(heapstart);
+
+    return 0;
+}
\ No newline at end of file
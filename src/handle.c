@@ -0,0 +1,353 @@
+#include "handle.h"
+#include "buddy.h"
+
+#include <sys/mman.h>
+
+// the heap the calling thread is working on, whose break stands in for the
+// program break while the buddy engine works on it
+static __thread heap_t* current_heap;
+
+/**
+ * Returns the heap made by virtual_heap_create that the calling thread is
+ * working on, or NULL if it is working on the heap at the program break.
+ */
+heap_t* heap_handle(void) {
+    return current_heap;
+}
+
+/**
+ * Moves the break of the heap the calling thread is working on, like
+ * virtual_sbrk. For a heap made by virtual_heap_create, the break moves within
+ * the heap's own memory, and can't go below the heap's header or past the
+ * furthest its information can reach. Returns the old break, or (void*) -1 if
+ * it can't move that far.
+ */
+void* heap_sbrk(int32_t increment) {
+    if (current_heap == NULL)
+        return virtual_sbrk(increment);
+
+    uint8_t* prog_break = current_heap->brk;
+    if (increment > current_heap->limit - prog_break
+            || increment < (uint8_t*) current_heap->heapstart - prog_break)
+        return (void*) -1;
+
+    current_heap->brk = prog_break + increment;
+    return prog_break;
+}
+
+/**
+ * Locks a heap made by virtual_heap_create and points the buddy engine at it.
+ */
+static void enter_heap(heap_t* heap) {
+    pthread_mutex_lock(&heap->lock);
+    current_heap = heap;
+}
+
+/**
+ * Points the buddy engine back at the heap at the program break and unlocks a
+ * heap entered with enter_heap.
+ */
+static void leave_heap(heap_t* heap) {
+    current_heap = NULL;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * Returns how many bytes of memory a heap of 2^initial_size bytes with blocks
+ * of at least 2^min_size bytes needs at most, including its handle and the
+ * padding to align it, its header and the padding before its first block, and
+ * the most its information can grow to, which is a byte for every block of the
+ * minimum size and as much again for realloc to back it up.
+ */
+size_t virtual_heap_footprint(uint8_t initial_size, uint8_t min_size) {
+    size_t heap_size = (size_t) 1 << initial_size;
+    size_t align = MIN(heap_size, HEAP_ALIGN);
+    size_t max_blocks = (size_t) 1 << (initial_size
+                                       - MIN(initial_size, min_size));
+
+    return _Alignof(heap_t) - 1 + sizeof(heap_t) + 2 + align - 1 + heap_size
+           + 2 * max_blocks + 1;
+}
+
+/**
+ * Sets up a heap in size bytes of memory, with its handle at the start, and
+ * initialises it with the buddy engine. Returns the heap, or NULL if the memory
+ * is too small for it.
+ */
+static heap_t* make_heap(void* memory, size_t size, uint8_t initial_size,
+                         uint8_t min_size, backend_t backend, bool fresh) {
+    // the handle has to be aligned for its lock
+    uintptr_t align = _Alignof(heap_t);
+    heap_t* heap = (heap_t*) (((uintptr_t) memory + align - 1) & ~(align - 1));
+    uint8_t* end = (uint8_t*) memory + size;
+    if ((uint8_t*) (heap + 1) + 2 > end)
+        return NULL;
+
+    // the header decides where the blocks, and so the information, start
+    uint8_t* heapstart = (uint8_t*) (heap + 1);
+    min_size = MIN(min_size, MIN_SIZE_MASK);
+    heapstart[0] = initial_size;
+    heapstart[1] = min_size;
+
+    size_t max_blocks = (size_t) 1 << (initial_size
+                                       - MIN(initial_size, min_size));
+    uint8_t* info = (uint8_t*) get_info(heapstart);
+    if (info > end || (size_t) (end - info) < 2 * max_blocks + 1)
+        return NULL;
+
+    heap->heapstart = heapstart;
+    heap->brk = heapstart;
+    heap->limit = info + 2 * max_blocks + 1;
+    heap->memory = memory;
+    heap->size = size;
+    heap->backend = backend;
+    heap->blocks = NULL;
+    heap->parent = NULL;
+    heap->fresh = fresh;
+    pthread_mutex_init(&heap->lock, NULL);
+
+    enter_heap(heap);
+    buddy_init(heapstart, initial_size, min_size);
+    leave_heap(heap);
+
+    return heap;
+}
+
+/**
+ * Creates a heap of 2^initial_size bytes, with blocks of at least 2^min_size
+ * bytes, in a mapping of its own rather than at the program break. The handle,
+ * header, blocks and information all live in the mapping, so any number of
+ * heaps can exist at once, independent of each other and of the heap at the
+ * program break, and destroying one is a single unmap. The mapping starts out
+ * zeroed, so calloc needn't clear blocks that have never been used. Each heap
+ * has its own lock, and is managed by the buddy engine, placing blocks
+ * leftmost. Returns NULL if the heap couldn't be mapped.
+ */
+heap_t* virtual_heap_create(uint8_t initial_size, uint8_t min_size) {
+    size_t size = virtual_heap_footprint(initial_size, min_size);
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+
+    return make_heap(memory, size, initial_size, min_size, BACKEND_MMAP, true);
+}
+
+/**
+ * Creates a heap like virtual_heap_create, but in size bytes of memory given by
+ * the caller, which stays theirs to reuse once the heap is destroyed. The
+ * memory is not assumed to be zeroed. virtual_heap_footprint gives how much
+ * memory is enough. Returns NULL if the memory is too small.
+ */
+heap_t* virtual_heap_create_in(void* memory, size_t size, uint8_t initial_size,
+                               uint8_t min_size) {
+    if (memory == NULL)
+        return NULL;
+
+    return make_heap(memory, size, initial_size, min_size, BACKEND_MEMORY,
+                     false);
+}
+
+/**
+ * Returns how many bytes a child heap of 2^order bytes with blocks of at least
+ * 2^min_order bytes needs beside its block, for its handle, its header and the
+ * most its information can grow to, with as much again for realloc.
+ */
+static size_t subheap_footprint(uint8_t order, uint8_t min_order) {
+    size_t max_blocks = (size_t) 1 << (order - MIN(order, min_order));
+    return sizeof(heap_t) + 2 + 2 * max_blocks + 1;
+}
+
+/**
+ * Sets up a heap whose blocks are the whole of a block of 2^order bytes
+ * allocated from a parent heap, with its handle, header and information in
+ * meta, which is subheap_footprint bytes allocated from the same parent.
+ */
+static heap_t* make_subheap(void* block, void* meta, uint8_t order,
+                            uint8_t min_order, backend_t backend, void* parent,
+                            bool fresh) {
+    heap_t* heap = meta;
+    uint8_t* heapstart = (uint8_t*) (heap + 1);
+    min_order = MIN(min_order, MIN_SIZE_MASK);
+
+    heap->heapstart = heapstart;
+    heap->blocks = block;
+    heap->brk = heapstart;
+    heap->limit = (uint8_t*) meta + subheap_footprint(order, min_order);
+    heap->memory = block;
+    heap->size = (size_t) 1 << order;
+    heap->backend = backend;
+    heap->parent = parent;
+    heap->fresh = fresh;
+    pthread_mutex_init(&heap->lock, NULL);
+
+    enter_heap(heap);
+    buddy_init(heapstart, order, min_order);
+    leave_heap(heap);
+
+    return heap;
+}
+
+/**
+ * Creates a heap of 2^order bytes with blocks of at least 2^min_order bytes in
+ * a block of that size allocated from a parent heap made by
+ * virtual_heap_create, which may itself be inside another, so that the block
+ * is the child's whole budget for its blocks. The child's handle, header and
+ * information are kept beside the block, in a second, much smaller allocation
+ * from the parent. The child is otherwise independent of its parent, with its
+ * own lock. Returns NULL if the parent has no room for either allocation.
+ */
+heap_t* virtual_subheap_create(heap_t* parent, uint8_t order,
+                               uint8_t min_order) {
+    if (order >= 32)
+        return NULL;
+
+    // a block the parent knows is clear makes for a fresh child
+    bool zeroed;
+    enter_heap(parent);
+    void* block = buddy_malloc_zeroed(parent->heapstart, 1U << order, &zeroed);
+    void* meta = buddy_malloc(parent->heapstart,
+                              subheap_footprint(order, min_order));
+    leave_heap(parent);
+
+    if (block == NULL || meta == NULL) {
+        if (block != NULL)
+            virtual_heap_free(parent, block);
+        if (meta != NULL)
+            virtual_heap_free(parent, meta);
+        return NULL;
+    }
+
+    return make_subheap(block, meta, order, min_order, BACKEND_HEAP, parent,
+                        zeroed);
+}
+
+/**
+ * Creates a heap inside a block allocated from the heap at the program break
+ * with virtual_malloc, like virtual_subheap_create.
+ */
+heap_t* virtual_subheap_create_at(void* heapstart, uint8_t order,
+                                  uint8_t min_order) {
+    if (order >= 32)
+        return NULL;
+
+    void* block = virtual_malloc(heapstart, 1U << order);
+    void* meta = virtual_malloc(heapstart, subheap_footprint(order, min_order));
+    if (block == NULL || meta == NULL) {
+        if (block != NULL)
+            virtual_free(heapstart, block);
+        if (meta != NULL)
+            virtual_free(heapstart, meta);
+        return NULL;
+    }
+
+    return make_subheap(block, meta, order, min_order, BACKEND_BREAK,
+                        heapstart, false);
+}
+
+/**
+ * Destroys a heap made by virtual_heap_create or virtual_heap_create_in, along
+ * with every block still allocated from it, without looking at any of them. A
+ * heap inside a block of a parent heap hands the whole block back to the
+ * parent as a single free, however many blocks are allocated inside it, along
+ * with the allocation holding its handle and information. Heaps
+ * inside a heap's blocks go along with it, so they shouldn't be destroyed
+ * afterwards.
+ */
+void virtual_heap_destroy(heap_t* heap) {
+    if (heap == NULL)
+        return;
+
+    pthread_mutex_destroy(&heap->lock);
+    if (heap->backend == BACKEND_MMAP) {
+        munmap(heap->memory, heap->size);
+    } else if (heap->backend == BACKEND_HEAP) {
+        virtual_heap_free(heap->parent, heap->memory);
+        virtual_heap_free(heap->parent, heap);
+    } else if (heap->backend == BACKEND_BREAK) {
+        virtual_free(heap->parent, heap->memory);
+        virtual_free(heap->parent, heap);
+    }
+}
+
+/**
+ * Allocates a block of at least size bytes from a heap made by
+ * virtual_heap_create, like virtual_malloc. Returns NULL if allocation is not
+ * possible.
+ */
+void* virtual_heap_malloc(heap_t* heap, uint32_t size) {
+    enter_heap(heap);
+    void* block = buddy_malloc(heap->heapstart, size);
+    leave_heap(heap);
+
+    return block;
+}
+
+/**
+ * Allocates a block for count elements of size bytes each from a heap made by
+ * virtual_heap_create, like virtual_calloc, clearing it only if it might not
+ * hold zeroes already. Returns NULL if count * size overflows or if allocation
+ * is not possible.
+ */
+void* virtual_heap_calloc(heap_t* heap, uint32_t count, uint32_t size) {
+    uint64_t total = (uint64_t) count * size;
+    if (total > UINT32_MAX)
+        return NULL;
+
+    bool zeroed;
+    enter_heap(heap);
+    void* block = buddy_malloc_zeroed(heap->heapstart, total, &zeroed);
+    leave_heap(heap);
+
+    if (block != NULL && !zeroed)
+        zero_block(block, total);
+
+    return block;
+}
+
+/**
+ * Frees a block allocated from a heap made by virtual_heap_create, like
+ * virtual_free. Returns 0 if successful, 1 if not.
+ */
+int virtual_heap_free(heap_t* heap, void* ptr) {
+    enter_heap(heap);
+    int ret = buddy_free(heap->heapstart, ptr);
+    leave_heap(heap);
+
+    return ret;
+}
+
+/**
+ * Resizes a block allocated from a heap made by virtual_heap_create, like
+ * virtual_realloc. Returns the block, which may have moved, or NULL if it
+ * couldn't be resized, in which case it is left as it was.
+ */
+void* virtual_heap_realloc(heap_t* heap, void* ptr, uint32_t size) {
+    enter_heap(heap);
+    void* block = buddy_realloc(heap->heapstart, ptr, size);
+    leave_heap(heap);
+
+    return block;
+}
+
+/**
+ * Returns how many bytes can be used in the block starting at ptr in a heap
+ * made by virtual_heap_create, or 0 if there is no such block.
+ */
+uint32_t virtual_heap_usable_size(heap_t* heap, void* ptr) {
+    enter_heap(heap);
+    uint32_t size = buddy_usable_size(heap->heapstart, ptr);
+    leave_heap(heap);
+
+    return size;
+}
+
+/**
+ * Prints information about each block in a heap made by virtual_heap_create,
+ * like virtual_info.
+ */
+void virtual_heap_info(heap_t* heap) {
+    enter_heap(heap);
+    buddy_info(heap->heapstart);
+    leave_heap(heap);
+}
\ No newline at end of file
@@ -1,4 +1,48 @@
 #include "virtual_alloc.h"
+#include "handle.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// blocks at least this big are cleared with non-temporal stores
+#define STREAM_SIZE (1 << 18)
+
+// lists of pointers start with room for this many, a page's worth
+#define LIST_SIZE 512
+
+// how many blocks grown by realloc can have their buddies kept free at once
+#define GROWTHS 16
+
+// how many of the most recently freed blocks PLACEMENT_LIFO remembers
+#define RECENT_FREES 8
+
+// there is only ever one heap at a time, at the program break
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// nothing from here up has been part of a heap yet
+static uint8_t* fresh_from;
+
+// a block grown by realloc, and the range of its right buddy that it could
+// grow into next without moving
+typedef struct {
+    uint8_t* block;
+    uint8_t* start;
+    uint8_t* end;
+} growth_t;
+
+// reservations are replaced oldest first once they're all in use
+static growth_t growths[GROWTHS];
+static uint32_t growth_count;
+static uint32_t growth_next;
+
+// how free blocks are picked on the buddy heap, and the blocks freed last
+static placement_t placement;
+static uint8_t* recent_frees[RECENT_FREES];
+static uint32_t recent_next;
 
 /**
  * Computes the base-2 logarithm of a given integer, giving the result as a
@@ -17,39 +61,376 @@ uint8_t log_2(uint32_t x) {
     return exp;
 }
 
+/**
+ * Returns the first block of a heap, which is aligned to the heap's size or to
+ * HEAP_ALIGN, whichever is smaller. The heap's header is at heapstart, followed
+ * by padding up to the first block, unless the heap is in a block of a parent
+ * heap, whose handle says where its blocks are.
+ */
+uint8_t* get_blocks(void* heapstart) {
+    heap_t* handle = heap_handle();
+    if (handle != NULL && handle->blocks != NULL
+            && handle->heapstart == heapstart)
+        return handle->blocks;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uintptr_t align = MIN((uintptr_t) 1 << heap_size, HEAP_ALIGN);
+    uintptr_t header_end = (uintptr_t) heapstart + 2;
+
+    return (uint8_t*) ((header_end + align - 1) & ~(align - 1));
+}
+
+/**
+ * Returns the information about the first block of a buddy heap, which is
+ * stored straight after the last block, or straight after the header for a heap
+ * whose blocks are apart from it.
+ */
+block_t* get_info(void* heapstart) {
+    heap_t* handle = heap_handle();
+    if (handle != NULL && handle->blocks != NULL
+            && handle->heapstart == heapstart)
+        return (block_t*) ((uint8_t*) heapstart + 2);
+
+    return (block_t*) (get_blocks(heapstart) + (1 << *(uint8_t*) heapstart));
+}
+
+/**
+ * Returns whether the memory from start onwards has never been part of a heap,
+ * and so still holds the zeroes virtual_sbrk handed it out with. Like sbrk,
+ * virtual_sbrk is assumed to give zeroed memory the first time it grows past
+ * the furthest it has been, and prog_break is where the break was before the
+ * new heap reset it. Everything up to limit, the furthest the new heap can
+ * reach, is counted as used from now on.
+ */
+bool fresh_memory(uint8_t* prog_break, uint8_t* start, uint8_t* limit) {
+    // whatever is below the break may have been used by someone, even if it was
+    // never part of a heap
+    if (fresh_from == NULL || prog_break > fresh_from)
+        fresh_from = prog_break;
+
+    bool fresh = start >= fresh_from;
+    fresh_from = MAX(fresh_from, limit);
+
+    return fresh;
+}
+
+/**
+ * Clears the first size bytes of a block. Large blocks are cleared with
+ * non-temporal stores, so that clearing them doesn't evict everything else from
+ * the cache only to fill it with zeroes.
+ */
+void zero_block(void* block, uint32_t size) {
+#ifdef __SSE2__
+    if (size >= STREAM_SIZE && ((uintptr_t) block & 15) == 0) {
+        __m128i zero = _mm_setzero_si128();
+        uint8_t* end = (uint8_t*) block + (size & ~15u);
+
+        for (__m128i* pos = block; (uint8_t*) pos < end; pos++)
+            _mm_stream_si128(pos, zero);
+
+        // the streamed stores have to land before the block is used
+        _mm_sfence();
+        memset(end, 0, size & 15);
+        return;
+    }
+#endif
+
+    memset(block, 0, size);
+}
+
+/**
+ * Keeps the buddy to the right of a block that realloc has grown free for as
+ * long as there are other blocks to allocate from, so that the block can grow
+ * into it without moving. Replaces any reservation the block already had, and
+ * once there are GROWTHS reservations, the oldest is dropped.
+ */
+void reserve_growth(void* heapstart, uint8_t* ptr, uint8_t order) {
+    // reservations are only kept for the heap at the program break
+    if (heap_handle() != NULL)
+        return;
+
+    drop_growth(ptr);
+
+    // a right child, or the whole heap, has no buddy to grow into, so nothing
+    // is kept free for it
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    if (order >= heap_size || (ptr - get_blocks(heapstart)) & (1 << order)) {
+        growths[growth_next] = (growth_t) {ptr, NULL, NULL};
+    } else {
+        growths[growth_next] = (growth_t) {
+            ptr, ptr + (1 << order), ptr + (2 << order)
+        };
+    }
+    growth_next = (growth_next + 1) % GROWTHS;
+    growth_count = MIN(growth_count + 1, GROWTHS);
+}
+
+/**
+ * Returns whether a block has been grown by realloc and not freed or moved
+ * since, even if it had no buddy to keep free.
+ */
+bool growing(uint8_t* ptr) {
+    if (heap_handle() != NULL)
+        return false;
+
+    for (uint32_t i = 0; i < growth_count; i++) {
+        if (growths[i].block == ptr)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Drops the reservation of a block that is being freed or moved, if it has one.
+ */
+void drop_growth(uint8_t* ptr) {
+    if (heap_handle() != NULL)
+        return;
+
+    for (uint32_t i = 0; i < growth_count; i++) {
+        if (growths[i].block == ptr) {
+            growths[i] = (growth_t) {NULL, NULL, NULL};
+            return;
+        }
+    }
+}
+
+/**
+ * Drops every reservation, for when a new heap is initialised.
+ */
+void reset_growth(void) {
+    growth_count = 0;
+    growth_next = 0;
+}
+
+/**
+ * Returns whether the block at ptr lies in a buddy kept free for a block grown
+ * by realloc.
+ */
+static bool growth_reserved(uint8_t* ptr) {
+    for (uint32_t i = 0; i < growth_count; i++) {
+        if (ptr >= growths[i].start && ptr < growths[i].end)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Sets how free blocks are picked to allocate from on the buddy heap, and
+ * forgets every block freed so far.
+ */
+void set_placement(placement_t policy) {
+    placement = policy;
+    memset(recent_frees, 0, sizeof(recent_frees));
+    recent_next = 0;
+}
+
+/**
+ * Returns the placement policy of the heap being worked on. Heaps made by
+ * virtual_heap_create always place blocks leftmost.
+ */
+static placement_t current_placement(void) {
+    return heap_handle() == NULL ? placement : PLACEMENT_LEFTMOST;
+}
+
+/**
+ * Remembers a block that has just been freed, which PLACEMENT_LIFO hands out
+ * again first.
+ */
+void note_free(uint8_t* ptr) {
+    if (current_placement() != PLACEMENT_LIFO)
+        return;
+
+    recent_frees[recent_next] = ptr;
+    recent_next = (recent_next + 1) % RECENT_FREES;
+}
+
+/**
+ * Returns how recently the last block freed inside the free block at ptr was
+ * freed, from RECENT_FREES if it was the very last block freed down to 1, or 0
+ * if none of the blocks remembered are inside it. Sets hot to that block.
+ */
+static uint32_t recency(uint8_t* ptr, uint8_t size, uint8_t** hot) {
+    uint32_t recency = 0;
+
+    // the oldest block remembered is the next to be replaced
+    for (uint32_t i = 0; i < RECENT_FREES; i++) {
+        uint8_t* freed = recent_frees[i];
+        if (freed < ptr || freed >= ptr + (1 << size))
+            continue;
+
+        uint32_t newer = (i + RECENT_FREES - recent_next) % RECENT_FREES + 1;
+        if (newer > recency) {
+            recency = newer;
+            *hot = freed;
+        }
+    }
+
+    return recency;
+}
+
+/**
+ * Writes the blocks freed recently to hot in order of address, along with how
+ * recently each was freed, as for recency. Returns how many there are.
+ */
+static uint32_t sorted_frees(uint8_t** hot, uint32_t* ages) {
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < RECENT_FREES; i++) {
+        if (recent_frees[i] == NULL)
+            continue;
+
+        // insertion sort, since there are only a few
+        uint32_t pos = count++;
+        for (; pos > 0 && hot[pos - 1] > recent_frees[i]; pos--) {
+            hot[pos] = hot[pos - 1];
+            ages[pos] = ages[pos - 1];
+        }
+        hot[pos] = recent_frees[i];
+        ages[pos] = (i + RECENT_FREES - recent_next) % RECENT_FREES + 1;
+    }
+
+    return count;
+}
+
+/**
+ * Returns where in the free block at ptr a block of an order should be split
+ * off, as an offset from ptr. This is the start of the block, unless the heap
+ * hands out recently freed blocks first, in which case it is the position of
+ * the most recently freed block inside it.
+ */
+uint32_t placement_offset(uint8_t* ptr, uint8_t size, uint8_t order) {
+    uint8_t* hot;
+    if (current_placement() != PLACEMENT_LIFO || recency(ptr, size, &hot) == 0)
+        return 0;
+
+    return (hot - ptr) & ~((1 << order) - 1);
+}
+
+/**
+ * Returns whether the buddy of a free block at an offset into the heap is a
+ * single allocated block, so that allocating from the block leaves no free
+ * space in the subtree holding both. A free block's buddy can never be wholly
+ * free, since they would have been merged.
+ */
+static bool buddy_allocated(block_t* block, uint32_t offset,
+                            uint8_t heap_size) {
+    if (block->size == heap_size)
+        return false;
+
+    block_t* buddy = offset & (1 << block->size) ? block - 1 : block + 1;
+    return buddy->allocated && buddy->size == block->size;
+}
+
+/**
+ * Returns whether a free block is a better choice to allocate from than the
+ * best found so far under the heap's placement policy, given how recently a
+ * block inside each was freed. Smaller blocks are always better, unless the
+ * policy prefers recently freed blocks, which are better than any others, more
+ * so the more recently they were freed.
+ */
+static bool better_block(block_t* block, uint32_t offset, uint32_t age,
+                         block_t* best, uint32_t best_offset,
+                         uint32_t best_age, uint8_t heap_size) {
+    if (best == NULL)
+        return true;
+
+    if (age != best_age)
+        return age > best_age;
+
+    if (block->size != best->size)
+        return block->size < best->size;
+
+    // of blocks of the same size, the leftmost is kept unless the policy
+    // prefers to fill in subtrees whose other half is already in use
+    return current_placement() == PLACEMENT_BUDDY
+           && buddy_allocated(block, offset, heap_size)
+           && !buddy_allocated(best, best_offset, heap_size);
+}
+
 /**
  * Finds the smallest unallocated block in the virtual heap that is not smaller
  * than 2^min_size bytes. Modifies a pointer passed as a parameter to point to
  * the block in the heap and returns a pointer to the section of the heap
- * storing its information.
+ * storing its information. Of the blocks of the same size, the leftmost is
+ * found, unless the heap was given a different placement policy. Blocks kept
+ * free for realloc to grow into are only returned if there is no other.
  */
 block_t* smallest_block(void* heapstart, uint8_t min_size, uint8_t** ptr) {
-    uint8_t lowest_size = UINT8_MAX;
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t* heap = get_blocks(heapstart);
+
+    // the blocks freed recently, sorted by address so that the walk over the
+    // heap can find them in the free blocks as it goes
+    uint8_t* hot[RECENT_FREES];
+    uint32_t hot_ages[RECENT_FREES];
+    uint32_t hot_count = 0;
+    uint32_t next_hot = 0;
+    bool lifo = current_placement() == PLACEMENT_LIFO;
+    if (lifo)
+        hot_count = sorted_frees(hot, hot_ages);
+
     block_t* smallest_block = NULL;
-    uint8_t* smallest_block_ptr = NULL;
+    uint32_t smallest_offset = 0;
+    uint32_t smallest_age = 0;
 
-    uint8_t heap_size = * (uint8_t*) heapstart;
+    bool reservations = heap_handle() == NULL && growth_count != 0;
+    block_t* reserved_block = NULL;
+    uint32_t reserved_offset = 0;
+    uint32_t reserved_age = 0;
 
-    block_t* info_start = (block_t*) heapstart + 2 + (1 << heap_size);
-    block_t* block = info_start;
+    block_t* block = get_info(heapstart);
+    uint8_t* end = get_blocks(heapstart) + (1 << heap_size);
 
     // iterate through all the blocks in the heap, keeping track of our position
     // not only in the section with information of the blocks, but the blocks
     // themselves
-    for (; *ptr < (uint8_t*) info_start; *ptr += 1 << block->size, block++) {
+    for (; *ptr < end; *ptr += 1 << block->size, block++) {
+        if (block->allocated || block->size < min_size)
+            continue;
+
         // by ignoring any blocks of the same size as previously found, it is
         // guaranteed that we only record the leftmost blocks of any particular
         // size. thus we can optimise the algorithm to one pass instead of
         // repeatedly increasing the size to test
-        if (!block->allocated && block->size >= min_size
-                && block->size < lowest_size) {
-            lowest_size = block->size;
-            smallest_block = block;
-            smallest_block_ptr = *ptr;
+        uint32_t offset = *ptr - heap;
+        uint32_t age = 0;
+        if (lifo) {
+            // the blocks freed before this one can't be in any that follow
+            for (; next_hot < hot_count && hot[next_hot] < *ptr; next_hot++);
+            for (uint32_t i = next_hot; i < hot_count
+                    && hot[i] < *ptr + (1 << block->size); i++)
+                age = MAX(age, hot_ages[i]);
         }
+        if (!better_block(block, offset, age, smallest_block, smallest_offset,
+                          smallest_age, heap_size))
+            continue;
+
+        // only a candidate needs checking against the reservations, so this
+        // rarely happens more than once per size
+        if (reservations && growth_reserved(*ptr)) {
+            if (better_block(block, offset, age, reserved_block,
+                             reserved_offset, reserved_age, heap_size)) {
+                reserved_block = block;
+                reserved_offset = offset;
+                reserved_age = age;
+            }
+            continue;
+        }
+
+        smallest_block = block;
+        smallest_offset = offset;
+        smallest_age = age;
+    }
+
+    if (smallest_block == NULL) {
+        smallest_block = reserved_block;
+        smallest_offset = reserved_offset;
     }
 
-    *ptr = smallest_block_ptr;
+    *ptr = smallest_block == NULL ? NULL : heap + smallest_offset;
 
     return smallest_block;
 }
@@ -59,12 +440,12 @@ block_t* smallest_block(void* heapstart, uint8_t min_size, uint8_t** ptr) {
  * are no more buddies that can be merged with.
  */
 int merge_blocks(void* heapstart, block_t* block, uint8_t* block_ptr) {
-    uint8_t* prog_break = virtual_sbrk(0);
+    uint8_t* prog_break = heap_sbrk(0);
     if (prog_break == (uint8_t*) -1)
         return 1;
 
     uint8_t heap_size = *(uint8_t*) heapstart;
-    uint8_t* heap = (uint8_t*) heapstart + 2;
+    uint8_t* heap = get_blocks(heapstart);
 
     while (1) {
         // we can determine if a block is a right child using the bit that
@@ -72,15 +453,21 @@ int merge_blocks(void* heapstart, block_t* block, uint8_t* block_ptr) {
         bool right = (block_ptr - heap) & (1 << block->size);
 
         if (right && should_merge_left(block, heap_size)) {
+            stats_add(block->size, false, -2);
+            stats_add(block->size + 1, false, 1);
             block[-1].size++;
+            block[-1].zeroed = block[-1].zeroed && block->zeroed;
             shift(block + 1, prog_break, -1);
 
             // since we're merging left, the location of the block changes and
             // we have to update our pointers
             block--;
             block_ptr -= 1 << (block->size - 1);
-        } else if (!right && should_merge_right(block)) {
+        } else if (!right && should_merge_right(block, heap_size)) {
+            stats_add(block->size, false, -2);
+            stats_add(block->size + 1, false, 1);
             block[1].size++;
+            block[1].zeroed = block[1].zeroed && block->zeroed;
             shift(block + 1, prog_break, -1);
         } else {
             // we can no longer merge buddies, we are finished
@@ -88,7 +475,7 @@ int merge_blocks(void* heapstart, block_t* block, uint8_t* block_ptr) {
         }
 
         // shrink heap
-        if (virtual_sbrk(-1) == (void*) -1)
+        if (heap_sbrk(-1) == (void*) -1)
             return 1;
 
         // since we've merged 2 blocks together, the heap is now 1 block smaller
@@ -110,9 +497,11 @@ bool should_merge_left(block_t* block, uint8_t heap_size) {
  * Returns whether a block is able to be merged to the right with its buddy, if
  * one exists. Assumes that the block in question is a left child.
  */
-bool should_merge_right(block_t* block) {
+bool should_merge_right(block_t* block, uint8_t heap_size) {
+    // the whole heap is the last block, so whatever follows it is not a block
     block_t* right = block + 1;
-    return !right->allocated && block->size == right->size;
+    return block->size != heap_size && !right->allocated
+           && block->size == right->size;
 }
 
 /**
@@ -127,12 +516,13 @@ void shift(block_t* block, uint8_t* prog_break, int16_t offset) {
  * holding its information and returns it.
  */
 block_t* get_block_info(void* heapstart, void* ptr) {
-    uint8_t heap_size = *(uint8_t*) heapstart;
-
-    block_t* start = (block_t*) heapstart + 2 + (1 << heap_size);
-    uint8_t* block_ptr = heapstart + 2;
+    block_t* start = get_info(heapstart);
+    uint8_t* block_ptr = get_blocks(heapstart);
+    uint8_t* end = block_ptr + (1 << *(uint8_t*) heapstart);
 
-    for (block_t* block = start; block_ptr < (uint8_t*) start; block++) {
+    // the blocks are in address order, so stop once we're past ptr
+    for (block_t* block = start; block_ptr < end
+            && block_ptr <= (uint8_t*) ptr; block++) {
         if (block_ptr == ptr)
             return block;
 
@@ -141,4 +531,87 @@ block_t* get_block_info(void* heapstart, void* ptr) {
 
     // block was not found
     return NULL;
+}
+
+/**
+ * Moves the pointer at index i down a binary max-heap of pointers until it is
+ * no smaller than either of its children.
+ */
+static void sift_down(void** ptrs, uint32_t i, uint32_t count) {
+    while (2 * i + 1 < count) {
+        uint32_t child = 2 * i + 1;
+        if (child + 1 < count && ptrs[child + 1] > ptrs[child])
+            child++;
+
+        if (ptrs[i] >= ptrs[child])
+            return;
+
+        void* tmp = ptrs[i];
+        ptrs[i] = ptrs[child];
+        ptrs[child] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * Sorts an array of pointers into increasing order of address, in place and
+ * without allocating any memory.
+ */
+void sort_pointers(void** ptrs, uint32_t count) {
+    // heapsort, since qsort may call the real malloc, which moves the program
+    // break out from under the virtual heap
+    for (uint32_t i = count / 2; i > 0; i--)
+        sift_down(ptrs, i - 1, count);
+
+    for (uint32_t end = count; end > 1; end--) {
+        void* tmp = ptrs[0];
+        ptrs[0] = ptrs[end - 1];
+        ptrs[end - 1] = tmp;
+        sift_down(ptrs, 0, end - 1);
+    }
+}
+
+/**
+ * Moves a list of count pointers into a new mapping outside the virtual heap
+ * with room for twice its capacity, or for LIST_SIZE pointers if it has none
+ * yet, unmapping the old one. Returns the new list, or NULL if it couldn't be
+ * mapped, in which case the old list is left as it was.
+ */
+void** grow_list(void** list, uint32_t count, uint32_t* capacity) {
+    uint32_t new_capacity = *capacity == 0 ? LIST_SIZE : 2 * *capacity;
+    void** new_list = mmap(NULL, new_capacity * sizeof(void*),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+    if (new_list == MAP_FAILED)
+        return NULL;
+
+    if (list != NULL) {
+        memcpy(new_list, list, count * sizeof(void*));
+        munmap(list, *capacity * sizeof(void*));
+    }
+
+    *capacity = new_capacity;
+    return new_list;
+}
+
+/**
+ * Returns the engine managing the heap, as recorded in its header.
+ */
+engine_t heap_engine(void* heapstart) {
+    return *((uint8_t*) heapstart + 1) & ENGINE_MASK;
+}
+
+/**
+ * Acquires the lock protecting the information of a buddy heap from being
+ * modified by multiple threads at once.
+ */
+void lock_heap(void* heapstart) {
+    pthread_mutex_lock(&heap_mutex);
+}
+
+/**
+ * Releases the lock acquired with lock_heap.
+ */
+void unlock_heap(void* heapstart) {
+    pthread_mutex_unlock(&heap_mutex);
 }
\ No newline at end of file
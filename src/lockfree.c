@@ -0,0 +1,270 @@
+#include "lockfree.h"
+#include "tree.h"
+
+#include <sched.h>
+
+// the largest free block below each node is kept after the tree, as its order
+// plus one, or 0 if there is none, so that a malloc can walk straight down to a
+// free node. these are only hints, updated after the nodes they describe, and
+// every claim is still made on the nodes themselves
+typedef _Atomic uint8_t hint_t;
+
+/**
+ * Returns the hints stored after the tree.
+ */
+static hint_t* get_hints(void* heapstart) {
+    return tree_extra(heapstart);
+}
+
+/**
+ * Works out the hint of a node of an order from the node itself and, unless it
+ * is at the bottom of the tree, the hints of its children.
+ */
+static uint8_t node_hint(node_t* tree, hint_t* hints, uint32_t node,
+                         uint8_t order, bool bottom) {
+    uint32_t state = atomic_load(&tree[node]);
+    if (state == NODE_FULL)
+        return 0;
+
+    if (bottom)
+        return state == 0 ? order + 1 : 0;
+
+    // two wholly free halves make a wholly free node
+    uint8_t left = atomic_load(&hints[node << 1]);
+    uint8_t right = atomic_load(&hints[(node << 1) + 1]);
+    if (left == order && right == order)
+        return order + 1;
+
+    return MAX(left, right);
+}
+
+/**
+ * Updates the hints of a node that has just changed and of all its ancestors.
+ * Each hint is checked again after it is stored, and redone if its children
+ * changed in the meantime, so that whichever thread stores a hint last leaves
+ * it matching its children once every change has finished.
+ */
+static void update_hints(void* heapstart, uint32_t node) {
+    node_t* tree = get_tree(heapstart);
+    hint_t* hints = get_hints(heapstart);
+    uint8_t depth = node_depth(node);
+    uint8_t levels = tree_depth(heapstart) - depth;
+    uint8_t order = *(uint8_t*) heapstart - depth;
+
+    for (; node; node >>= 1, order++, levels++) {
+        uint8_t hint;
+        do {
+            hint = node_hint(tree, hints, node, order, levels == 0);
+            atomic_store(&hints[node], hint);
+        } while (node_hint(tree, hints, node, order, levels == 0) != hint);
+    }
+}
+
+/**
+ * Removes a node from the occupancy counts of its ancestors, stopping before
+ * the ancestor `stop` (0 to go all the way to the root).
+ */
+static void release_ancestors(node_t* tree, uint32_t node, uint32_t stop) {
+    for (uint32_t parent = node >> 1; parent != stop; parent >>= 1)
+        atomic_fetch_sub(&tree[parent], 1);
+}
+
+/**
+ * Adds a freshly claimed node to the occupancy counts of its ancestors. If an
+ * ancestor has been allocated as a whole in the meantime, the counts added so
+ * far are undone and that ancestor is returned. Otherwise returns 0.
+ */
+static uint32_t claim_ancestors(node_t* tree, uint32_t node) {
+    for (uint32_t parent = node >> 1; parent; parent >>= 1) {
+        uint32_t old = atomic_load_explicit(&tree[parent], memory_order_relaxed);
+        do {
+            if (old & NODE_FULL) {
+                release_ancestors(tree, node, parent);
+                return parent;
+            }
+        } while (!atomic_compare_exchange_weak(&tree[parent], &old, old + 1));
+    }
+
+    return 0;
+}
+
+/**
+ * Initialises a virtual heap of size 2^initial_size bytes managed by the
+ * lock-free engine. Instead of a list of blocks, the heap information is a
+ * complete binary tree of atomic nodes, one per potential block, stored after
+ * the heap, followed by a hint for every node of the largest free block below
+ * it. The tree is allocated once and never resized.
+ */
+void lockfree_init(void* heapstart, uint8_t initial_size, uint8_t min_size) {
+    size_t nodes = (size_t) 2 << (initial_size - MIN(initial_size, min_size));
+    if (tree_init(heapstart, initial_size, min_size, ENGINE_LOCKFREE,
+                  nodes * sizeof(hint_t)) == NULL)
+        return;
+
+    // every block starts out free
+    hint_t* hints = get_hints(heapstart);
+    for (size_t node = 1; node < nodes; node++)
+        atomic_init(&hints[node], initial_size - node_depth(node) + 1);
+}
+
+/**
+ * Allocates a block on a lock-free heap. The hints lead from the root straight
+ * down to a free node of the required order, which is claimed with
+ * compare-and-swap, and the occupancy change is then propagated up to the
+ * root. Halves that are already split are tried before whole free halves, and
+ * otherwise the left half, so that blocks are placed as in the buddy engine.
+ * If the claim fails, or an ancestor turns out to be allocated as a whole, the
+ * claim is rolled back and the walk starts again from the root. Returns NULL if
+ * no block could be claimed.
+ */
+void* lockfree_malloc(void* heapstart, uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size > 1 << heap_size)
+        return NULL;
+
+    uint8_t needed_size = MAX(min_size, log_2(size));
+    if (needed_size > heap_size)
+        return NULL;
+
+    node_t* tree = get_tree(heapstart);
+    hint_t* hints = get_hints(heapstart);
+    uint8_t wanted = needed_size + 1;
+
+    // a walk that finds the hints have changed under it starts again, but only
+    // while the root still has room
+    while (atomic_load(&hints[1]) >= wanted) {
+        uint32_t node = 1;
+        uint8_t order = heap_size;
+
+        for (; order > needed_size; order--) {
+            uint32_t left = node << 1;
+            uint8_t left_hint = atomic_load(&hints[left]);
+            uint8_t right_hint = atomic_load(&hints[left + 1]);
+
+            bool go_left = left_hint >= wanted;
+            if (go_left && left_hint == order && right_hint >= wanted
+                    && right_hint != order)
+                // the left half is whole and the right one split, so keep
+                // the whole one for larger blocks
+                go_left = false;
+
+            if (go_left)
+                node = left;
+            else if (right_hint >= wanted)
+                node = left + 1;
+            else
+                break;
+        }
+
+        // the node must be free and have nothing allocated below it. if the
+        // hints were wrong, whoever changed the tree is about to update them,
+        // but may not be running, so the hints are brought up to date here
+        // too before giving that thread a chance to finish
+        uint32_t expected = 0;
+        if (order != needed_size
+                || !atomic_compare_exchange_strong(&tree[node], &expected,
+                                                   NODE_FULL)) {
+            update_hints(heapstart, node);
+            sched_yield();
+            continue;
+        }
+
+        uint32_t blocker = claim_ancestors(tree, node);
+        if (blocker != 0)
+            atomic_store(&tree[node], 0);
+        update_hints(heapstart, node);
+
+        if (blocker == 0) {
+            uint32_t offset = (node - ((uint32_t) 1 << (heap_size - order)))
+                              << order;
+            return get_blocks(heapstart) + offset;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Frees the block of a node found by find_node or sized_node, or fails if the
+ * node is 0. Returns 0 if successful, 1 if not.
+ */
+static int free_node(void* heapstart, uint32_t node) {
+    if (node == 0)
+        return 1;
+
+    // only one of several threads freeing the same block may succeed
+    uint32_t expected = NODE_FULL;
+    node_t* tree = get_tree(heapstart);
+    if (!atomic_compare_exchange_strong(&tree[node], &expected, 0))
+        return 1;
+
+    release_ancestors(tree, node, 0);
+    update_hints(heapstart, node);
+    return 0;
+}
+
+/**
+ * Frees a block on a lock-free heap by clearing its node and removing it from
+ * the occupancy counts of its ancestors, which implicitly merges it with any
+ * free buddies. Returns 0 if successful, 1 if not.
+ */
+int lockfree_free(void* heapstart, void* ptr) {
+    return free_node(heapstart, find_node(heapstart, ptr));
+}
+
+/**
+ * Frees a block on a lock-free heap like lockfree_free, given a size that was
+ * allocated there, which finds its node without searching the tree. Returns 0
+ * if successful, 1 if not.
+ */
+int lockfree_free_sized(void* heapstart, void* ptr, uint32_t size) {
+    return free_node(heapstart, sized_node(heapstart, ptr, size));
+}
+
+/**
+ * Reallocates a block on a lock-free heap. Since other threads may claim the
+ * space at any time, the new block is allocated before the old one is freed.
+ */
+void* lockfree_realloc(void* heapstart, void* ptr, uint32_t size) {
+    if (size == 0) {
+        lockfree_free(heapstart, ptr);
+        return NULL;
+    }
+
+    if (ptr == NULL)
+        return lockfree_malloc(heapstart, size);
+
+    uint32_t node = find_node(heapstart, ptr);
+    if (node == 0)
+        return NULL;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t og_size = heap_size - node_depth(node);
+
+    // the block is already the right size
+    if (size <= 1 << heap_size && MAX(min_size, log_2(size)) == og_size)
+        return ptr;
+
+    void* new_block = lockfree_malloc(heapstart, size);
+    if (new_block == NULL)
+        return NULL;
+
+    memmove(new_block, ptr, MIN(1 << og_size, size));
+    lockfree_free(heapstart, ptr);
+
+    return new_block;
+}
+
+/**
+ * Prints the blocks of a lock-free heap in the same format as virtual_info.
+ * The output is only consistent if no other thread is modifying the heap.
+ */
+void lockfree_info(void* heapstart) {
+    tree_info(heapstart);
+}
\ No newline at end of file
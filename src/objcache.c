@@ -0,0 +1,360 @@
+#include "objcache.h"
+
+// slabs are made big enough for at least this many objects, if the heap allows
+#define SLAB_OBJECTS 8
+
+// the header at the start of every slab. the slab's free objects are linked
+// through a pointer after each object, so that what the constructor set up is
+// left alone
+struct slab {
+    struct slab* next;
+    struct slab* prev;
+    object_cache_t* cache;
+    void* free;
+    uint32_t in_use;
+};
+
+typedef struct slab slab_t;
+
+// every cache that has been set up, so that their empty slabs can be handed
+// back when a heap runs out
+static object_cache_t* caches;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns x rounded up to a multiple of align, which must be a power of two.
+ */
+static uint32_t round_up(uint32_t x, uint32_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+/**
+ * Returns the link to the next free object, stored after an object.
+ */
+static void** link_of(object_cache_t* cache, void* object) {
+    return (void**) ((uint8_t*) object + round_up(cache->size, sizeof(void*)));
+}
+
+/**
+ * Adds a slab to the front of a list.
+ */
+static void push_slab(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/**
+ * Takes a slab out of a list.
+ */
+static void remove_slab(slab_t** list, slab_t* slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+/**
+ * Allocates a slab from the heap and constructs every object in it. Returns
+ * NULL if the heap has run out. Expects the cache's lock to be held.
+ */
+static slab_t* new_slab(object_cache_t* cache) {
+    slab_t* slab = virtual_malloc(cache->heapstart, cache->slab_size);
+    if (slab == NULL)
+        return NULL;
+
+    *slab = (slab_t) {.cache = cache};
+
+    // link the objects in address order, so that they are handed out in it
+    uint8_t* object = (uint8_t*) slab + cache->offset;
+    void** link = &slab->free;
+    for (uint32_t i = 0; i < cache->per_slab; i++, object += cache->stride) {
+        if (cache->ctor != NULL)
+            cache->ctor(object);
+        *link = object;
+        link = link_of(cache, object);
+    }
+    *link = NULL;
+
+    cache->stats.slabs++;
+    cache->stats.constructed += cache->per_slab;
+
+    return slab;
+}
+
+/**
+ * Destroys every object in a slab and hands it back to the heap. Expects the
+ * cache's lock to be held.
+ */
+static void destroy_slab(object_cache_t* cache, slab_t* slab) {
+    if (cache->dtor != NULL) {
+        uint8_t* object = (uint8_t*) slab + cache->offset;
+        for (uint32_t i = 0; i < cache->per_slab; i++, object += cache->stride)
+            cache->dtor(object);
+    }
+
+    cache->stats.slabs--;
+    cache->stats.destroyed += cache->per_slab;
+
+    virtual_free(cache->heapstart, slab);
+}
+
+/**
+ * Hands every empty slab of a cache back to the heap. Returns how many slabs
+ * were handed back. Expects the cache's lock to be held.
+ */
+static uint32_t reap(object_cache_t* cache) {
+    uint32_t reaped = 0;
+
+    while (cache->empty != NULL) {
+        slab_t* slab = cache->empty;
+        remove_slab(&cache->empty, slab);
+        destroy_slab(cache, slab);
+        reaped++;
+    }
+
+    cache->stats.empty_slabs = 0;
+
+    return reaped;
+}
+
+/**
+ * Forgets every object cache without freeing anything, after the heap they were
+ * on has been reinitialised.
+ */
+void objcache_reset(void) {
+    pthread_mutex_lock(&caches_lock);
+    caches = NULL;
+    pthread_mutex_unlock(&caches_lock);
+}
+
+/**
+ * Hands the empty slabs of every object cache on a heap back to it, skipping
+ * caches that are busy, since the heap running out may be what has kept them
+ * busy. Returns how many slabs were handed back.
+ */
+uint32_t objcache_reap_heap(void* heapstart) {
+    uint32_t reaped = 0;
+
+    // the lock is only tried, since a thread destroying a cache takes it before
+    // the cache's own lock, which the thread that ran out may be holding
+    if (pthread_mutex_trylock(&caches_lock) != 0)
+        return 0;
+
+    for (object_cache_t* cache = caches; cache != NULL; cache = cache->next) {
+        if (cache->heapstart != heapstart || cache->empty == NULL
+                || pthread_mutex_trylock(&cache->lock) != 0)
+            continue;
+
+        reaped += reap(cache);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    pthread_mutex_unlock(&caches_lock);
+
+    return reaped;
+}
+
+/**
+ * Sets up a cache of objects of size bytes each, aligned to align bytes, which
+ * must be a power of two no bigger than a page. Objects are carved from slabs
+ * allocated from the heap with virtual_malloc, and ctor, if given, is called on
+ * every object when its slab is allocated. Freed objects go back to their slab
+ * as they are, so an object is only constructed once however often it is
+ * allocated, and dtor, if given, is only called when its slab is handed back to
+ * the heap. Slabs that become empty are kept until virtual_cache_reap, or until
+ * an allocation from a heap managed by the buddy engine runs out. Returns 0 if
+ * successful, 1 if not.
+ */
+int virtual_cache_init(void* heapstart, object_cache_t* cache, uint32_t size,
+                       uint32_t align, void (*ctor)(void*),
+                       void (*dtor)(void*)) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+
+    if (size == 0 || size > 1 << heap_size || align == 0
+            || align & (align - 1) || align > HEAP_ALIGN)
+        return 1;
+
+    // each object is followed by the link for the free list
+    uint32_t stride = round_up(round_up(size, sizeof(void*)) + sizeof(void*),
+                               align);
+    uint32_t offset = round_up(sizeof(slab_t), align);
+
+    // slabs are aligned to their own size, which must cover the alignment
+    uint64_t wanted = MAX((uint64_t) offset + SLAB_OBJECTS * stride, align);
+    uint32_t slab_size = wanted >= 1u << heap_size ? 1u << heap_size
+                                                   : 1u << log_2(wanted);
+    if (slab_size < (uint64_t) offset + stride || slab_size < align)
+        return 1;
+
+    *cache = (object_cache_t) {
+        .heapstart = heapstart,
+        .size = size,
+        .stride = stride,
+        .offset = offset,
+        .slab_size = slab_size,
+        .per_slab = (slab_size - offset) / stride,
+        .ctor = ctor,
+        .dtor = dtor,
+    };
+    cache->stats.objects_per_slab = cache->per_slab;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    pthread_mutex_lock(&caches_lock);
+    cache->next = caches;
+    caches = cache;
+    pthread_mutex_unlock(&caches_lock);
+
+    return 0;
+}
+
+/**
+ * Allocates a constructed object from a cache, taking it from a slab that is
+ * already in use before an empty one, and only allocating a new slab if every
+ * slab is full. Returns NULL if the heap has run out.
+ */
+void* virtual_cache_alloc(object_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+
+    slab_t* slab = cache->partial;
+    if (slab == NULL && cache->empty != NULL) {
+        slab = cache->empty;
+        remove_slab(&cache->empty, slab);
+        push_slab(&cache->partial, slab);
+        cache->stats.empty_slabs--;
+    }
+
+    if (slab == NULL) {
+        slab = new_slab(cache);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+
+        push_slab(&cache->partial, slab);
+    }
+
+    void* object = slab->free;
+    slab->free = *link_of(cache, object);
+    if (++slab->in_use == cache->per_slab) {
+        remove_slab(&cache->partial, slab);
+        push_slab(&cache->full, slab);
+    }
+
+    cache->stats.allocs++;
+    cache->stats.objects_in_use++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return object;
+}
+
+/**
+ * Returns an object to its slab in a cache, still constructed. The object's
+ * slab follows from its address, since slabs are aligned to their size. Returns
+ * 0 if successful, 1 if not, e.g. if the object isn't from the cache.
+ */
+int virtual_cache_free(object_cache_t* cache, void* object) {
+    uint8_t heap_size = *(uint8_t*) cache->heapstart;
+    uint8_t* heap = get_blocks(cache->heapstart);
+
+    if ((uint8_t*) object < heap
+            || (uint8_t*) object >= heap + (1 << heap_size))
+        return 1;
+
+    size_t offset = (uint8_t*) object - heap;
+    size_t slab_mask = (size_t) cache->slab_size - 1;
+    slab_t* slab = (slab_t*) (heap + (offset & ~slab_mask));
+    size_t position = (uint8_t*) object - (uint8_t*) slab;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (slab->cache != cache || slab->in_use == 0 || position < cache->offset
+            || (position - cache->offset) % cache->stride != 0
+            || (position - cache->offset) / cache->stride >= cache->per_slab) {
+        pthread_mutex_unlock(&cache->lock);
+        return 1;
+    }
+
+    if (slab->in_use-- == cache->per_slab) {
+        remove_slab(&cache->full, slab);
+        push_slab(&cache->partial, slab);
+    }
+
+    *link_of(cache, object) = slab->free;
+    slab->free = object;
+
+    if (slab->in_use == 0) {
+        remove_slab(&cache->partial, slab);
+        push_slab(&cache->empty, slab);
+        cache->stats.empty_slabs++;
+    }
+
+    cache->stats.frees++;
+    cache->stats.objects_in_use--;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
+
+/**
+ * Hands every empty slab of a cache back to the heap, destroying its objects.
+ * Returns how many slabs were handed back.
+ */
+uint32_t virtual_cache_reap(object_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+    uint32_t reaped = reap(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return reaped;
+}
+
+/**
+ * Fills in the statistics of a cache: how many objects have been allocated and
+ * freed, constructed and destroyed, how many are in use, and how many slabs the
+ * cache has, of which how many are empty.
+ */
+void virtual_cache_stats(object_cache_t* cache, cache_stats_t* stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Hands every slab of a cache back to the heap and forgets the cache, once all
+ * of its objects have been freed. Returns 0 if successful, 1 if objects are
+ * still in use.
+ */
+int virtual_cache_destroy(object_cache_t* cache) {
+    pthread_mutex_lock(&caches_lock);
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->stats.objects_in_use != 0) {
+        pthread_mutex_unlock(&cache->lock);
+        pthread_mutex_unlock(&caches_lock);
+        return 1;
+    }
+
+    reap(cache);
+
+    for (object_cache_t** prev = &caches; *prev != NULL;
+            prev = &(*prev)->next) {
+        if (*prev == cache) {
+            *prev = cache->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&caches_lock);
+
+    pthread_mutex_destroy(&cache->lock);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,246 @@
+#include "pcpu.h"
+
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PCPU_RSEQ
+#endif
+
+// ThreadSanitizer can't see inside the critical sections, so tell it that a
+// block pushed by one thread is handed over to the thread that pops it
+#ifdef __SANITIZE_THREAD__
+#include <sanitizer/tsan_interface.h>
+#define HANDOVER_RELEASE(block) __tsan_release(block)
+#define HANDOVER_ACQUIRE(block) __tsan_acquire(block)
+#else
+#define HANDOVER_RELEASE(block)
+#define HANDOVER_ACQUIRE(block)
+#endif
+
+// the descriptor of a restartable critical section, running from label 1 up to
+// the commit at label 2, which the kernel restarts at label 4 if the thread is
+// preempted, migrated or signalled in between
+#define RSEQ_CS_START \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0, 0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, 8(%[rs])\n\t" \
+    "1:\n\t"
+
+// the kernel only jumps to an abort handler preceded by the signature glibc
+// registered, which is hidden in an invalid instruction
+#define RSEQ_CS_ABORT \
+    "2:\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[abort]\n\t" \
+    ".popsection\n\t"
+
+// each CPU has a bin for every order, each a count followed by a stack of
+// blocks. the count is the last thing a critical section stores, so a section
+// that is interrupted has no effect
+typedef struct {
+    uint64_t count;
+    void* slots[];
+} bin_t;
+
+static uint8_t* slabs;
+static size_t slabs_size;
+static uint32_t cpus;
+static size_t bin_stride;
+static size_t cpu_stride;
+static uint32_t capacity[PCPU_ORDERS];
+
+#ifdef PCPU_RSEQ
+/**
+ * Returns the calling thread's restartable sequence area, which glibc
+ * registers for every thread.
+ */
+static struct rseq* rseq_area(void) {
+    return (struct rseq*) ((uint8_t*) __builtin_thread_pointer()
+                           + __rseq_offset);
+}
+#endif
+
+/**
+ * Returns whether the calling thread can use the per-CPU caches, i.e. whether
+ * it has registered a restartable sequence area with the kernel.
+ */
+bool pcpu_supported(void) {
+#ifdef PCPU_RSEQ
+    // the cpu id is negative if glibc's registration was turned off or failed
+    return __rseq_size != 0
+           && (int32_t) *(volatile uint32_t*) &rseq_area()->cpu_id >= 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Maps a cache for every CPU with room for up to max_count blocks of each
+ * order, and at most max_bytes bytes of each order. Returns 0 if successful, 1
+ * if not, in which case the per-CPU caches can't be used.
+ */
+int pcpu_init(uint32_t max_count, uint32_t max_bytes) {
+    pcpu_reset();
+
+    if (max_count == 0 || !pcpu_supported())
+        return 1;
+
+    cpus = get_nprocs_conf();
+    bin_stride = sizeof(bin_t) + (size_t) max_count * sizeof(void*);
+    cpu_stride = bin_stride * PCPU_ORDERS;
+
+    // fresh anonymous pages are zeroed, i.e. every bin is empty
+    slabs_size = cpu_stride * cpus;
+    void* map = mmap(NULL, slabs_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    slabs = map;
+    for (uint8_t order = 0; order < PCPU_ORDERS; order++)
+        capacity[order] = MIN(max_count, max_bytes >> order);
+
+    return 0;
+}
+
+/**
+ * Unmaps the per-CPU caches, forgetting any blocks in them.
+ */
+void pcpu_reset(void) {
+    if (slabs != NULL)
+        munmap(slabs, slabs_size);
+
+    slabs = NULL;
+    cpus = 0;
+    memset(capacity, 0, sizeof(capacity));
+}
+
+/**
+ * Returns the number of CPUs that have a cache.
+ */
+uint32_t pcpu_cpus(void) {
+    return cpus;
+}
+
+/**
+ * Returns how many blocks of an order each CPU's cache can hold.
+ */
+uint32_t pcpu_capacity(uint8_t order) {
+    return capacity[order];
+}
+
+/**
+ * Removes the most recently added block of an order from the cache of the CPU
+ * the calling thread is running on. Returns NULL if that cache has none.
+ */
+void* pcpu_pop(uint8_t order) {
+#ifdef PCPU_RSEQ
+    if (capacity[order] == 0)
+        return NULL;
+
+    struct rseq* rs = rseq_area();
+    uint8_t* base = slabs + order * bin_stride;
+    void* block;
+
+    // the top of the stack is slots[count - 1], i.e. 8 * count bytes into the
+    // bin
+    asm goto(
+        RSEQ_CS_START
+        "movl 4(%[rs]), %%eax\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[base], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "movq (%%rax, %%rcx, 8), %[block]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        RSEQ_CS_ABORT
+        : [block] "=&r" (block)
+        : [rs] "r" (rs), [stride] "r" (cpu_stride), [base] "r" (base)
+        : "rax", "rcx", "memory", "cc"
+        : empty, abort);
+
+    HANDOVER_ACQUIRE(block);
+    return block;
+
+abort:
+    return pcpu_pop(order);
+
+empty:
+#endif
+    return NULL;
+}
+
+/**
+ * Adds a block of an order to the cache of the CPU the calling thread is
+ * running on. Returns whether there was room for it.
+ */
+bool pcpu_push(void* block, uint8_t order) {
+#ifdef PCPU_RSEQ
+    if (capacity[order] == 0)
+        return false;
+
+    struct rseq* rs = rseq_area();
+    uint8_t* base = slabs + order * bin_stride;
+    uint64_t cap = capacity[order];
+
+    HANDOVER_RELEASE(block);
+
+    // the slot is written before the count, so an interrupted push leaves
+    // nothing behind but an unused slot
+    asm goto(
+        RSEQ_CS_START
+        "movl 4(%[rs]), %%eax\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[base], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "cmpq %[cap], %%rcx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[block], 8(%%rax, %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        RSEQ_CS_ABORT
+        :
+        : [rs] "r" (rs), [stride] "r" (cpu_stride), [base] "r" (base),
+          [cap] "r" (cap), [block] "r" (block)
+        : "rax", "rcx", "memory", "cc"
+        : full, abort);
+
+    return true;
+
+abort:
+    return pcpu_push(block, order);
+
+full:
+#endif
+    return false;
+}
+
+/**
+ * Removes a block of an order from the cache of a given CPU without a
+ * restartable sequence. Only safe while no other thread uses the caches.
+ * Returns NULL if that cache has none.
+ */
+void* pcpu_take(uint32_t cpu, uint8_t order) {
+    if (slabs == NULL || cpu >= cpus)
+        return NULL;
+
+    bin_t* bin = (bin_t*) (slabs + cpu * cpu_stride + order * bin_stride);
+    if (bin->count == 0)
+        return NULL;
+
+    void* block = bin->slots[--bin->count];
+    HANDOVER_ACQUIRE(block);
+    return block;
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "ring.h"
+
+/**
+ * Writes a record of size bytes, including its header, at the head of a ring,
+ * and moves the head past it. Returns the record's header.
+ */
+static record_t* push_record(ring_t* ring, uint32_t size, bool released) {
+    record_t* record = (record_t*) (ring->base + ring->head);
+    record->size = size;
+    record->released = released;
+
+    ring->head += size;
+    if (ring->head == ring->size)
+        ring->head = 0;
+    ring->used += size;
+
+    return record;
+}
+
+/**
+ * Sets up a ring of size bytes (rounded up to a power of two), allocated from
+ * the heap with virtual_malloc, from which records of any length are allocated
+ * one after the other, wrapping around at the end. Records are meant to be
+ * released in about the order they were allocated, so that the ring's space
+ * frees up from the oldest record, but may be released in any order. A ring is
+ * meant for one thread at a time. Returns 0 if successful, 1 if not.
+ */
+int virtual_ring_init(void* heapstart, ring_t* ring, uint32_t size) {
+    size = MAX(size, 2 * RING_ALIGN);
+
+    uint8_t* base = virtual_malloc(heapstart, size);
+    if (base == NULL)
+        return 1;
+
+    *ring = (ring_t) {
+        .heapstart = heapstart,
+        .base = base,
+        .size = 1 << log_2(size),
+    };
+
+    return 0;
+}
+
+/**
+ * Allocates a record of size bytes at the head of a ring, aligned to 16 bytes.
+ * If it doesn't fit before the end of the ring, it goes at the start once the
+ * records there have been released. Returns NULL if size is 0 or there isn't
+ * enough space between the head and the oldest record that hasn't been
+ * released.
+ */
+void* virtual_ring_alloc(ring_t* ring, uint32_t size) {
+    uint64_t needed = sizeof(record_t)
+                      + (((uint64_t) size + RING_ALIGN - 1) & ~(RING_ALIGN - 1));
+    if (size == 0 || needed > ring->size - ring->used)
+        return NULL;
+
+    if (ring->head >= ring->tail) {
+        // the free space is split between the end and the start of the ring
+        if (needed > ring->size - ring->head) {
+            if (needed > ring->tail)
+                return NULL;
+
+            push_record(ring, ring->size - ring->head, true);
+        }
+    } else if (needed > ring->tail - ring->head) {
+        return NULL;
+    }
+
+    return push_record(ring, needed, false) + 1;
+}
+
+/**
+ * Releases a record allocated from a ring. Its space is only reused once every
+ * record allocated before it has been released too, at which point the space
+ * of all of them is freed up at once. Returns 0 if successful, 1 if not, e.g.
+ * if the record has already been released.
+ */
+int virtual_ring_release(ring_t* ring, void* ptr) {
+    uint8_t* position = ptr;
+    if (position < ring->base + sizeof(record_t)
+            || position >= ring->base + ring->size
+            || (position - ring->base) % RING_ALIGN != 0)
+        return 1;
+
+    record_t* record = (record_t*) ptr - 1;
+    if (record->released || ring->used == 0)
+        return 1;
+
+    record->released = true;
+
+    // free up every released record at the tail
+    while (ring->used != 0) {
+        record_t* oldest = (record_t*) (ring->base + ring->tail);
+        if (!oldest->released)
+            break;
+
+        ring->used -= oldest->size;
+        ring->tail += oldest->size;
+        if (ring->tail == ring->size)
+            ring->tail = 0;
+    }
+
+    // an empty ring starts again from the start, so that records don't wrap
+    if (ring->used == 0) {
+        ring->head = 0;
+        ring->tail = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Hands a ring's space back to the heap, along with every record in it.
+ */
+void virtual_ring_destroy(ring_t* ring) {
+    virtual_free(ring->heapstart, ring->base);
+    *ring = (ring_t) {0};
+}
\ No newline at end of file
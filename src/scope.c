@@ -0,0 +1,169 @@
+#include "scope.h"
+#include "buddy.h"
+#include "deferred.h"
+#include "tags.h"
+#include "tcache.h"
+#include "worker.h"
+
+#include <sys/mman.h>
+
+// every block allocated since the oldest open mark, in the order they were
+// allocated, with a NULL entry for each mark so that scopes can nest. the log
+// lives outside the virtual heap like the deferred frees, and is only touched
+// under the heap's lock. it is kept after the last scope is released, since
+// scopes tend to be opened over and over
+static void* scope_heap;
+static void** scope_log;
+static uint32_t logged;
+static uint32_t capacity;
+
+/**
+ * Appends an entry to the log, doubling the log if it is full. Returns 0 if
+ * successful, 1 if not.
+ */
+static int append(void* entry) {
+    if (logged == capacity) {
+        void** new_log = grow_list(scope_log, logged, &capacity);
+        if (new_log == NULL)
+            return 1;
+
+        scope_log = new_log;
+    }
+
+    scope_log[logged++] = entry;
+    return 0;
+}
+
+/**
+ * Returns whether a heap has open scopes, in which case every block allocated on
+ * it has to be recorded.
+ */
+bool scope_active(void* heapstart) {
+    return scope_heap != NULL && scope_heap == heapstart;
+}
+
+/**
+ * Forgets every open scope without freeing anything, after the heap they were
+ * open on has been reinitialised.
+ */
+void scope_reset(void) {
+    if (scope_log != NULL)
+        munmap(scope_log, capacity * sizeof(void*));
+
+    scope_heap = NULL;
+    scope_log = NULL;
+    logged = 0;
+    capacity = 0;
+}
+
+/**
+ * Records a block allocated on a heap, so that releasing the innermost open
+ * scope frees it. If the block can't be recorded, it is freed again rather than
+ * escape the scope, and NULL is returned. Otherwise returns the block. Expects
+ * the heap's lock to be held.
+ */
+void* scope_record(void* heapstart, void* block) {
+    if (block == NULL || !scope_active(heapstart))
+        return block;
+
+    if (append(block)) {
+        buddy_free(heapstart, block);
+        return NULL;
+    }
+
+    return block;
+}
+
+/**
+ * Follows a block that realloc moved from old to new, so that the new block
+ * belongs to whichever scope the old one did, if any. Expects the heap's lock
+ * to be held.
+ */
+void scope_moved(void* heapstart, void* old, void* new) {
+    if (new == NULL || new == old || !scope_active(heapstart))
+        return;
+
+    // only the latest entry for the old block can be the block itself. the
+    // heap's header is never the start of a block, so it stands in for entries
+    // for blocks that were at the new address before, which mustn't take the
+    // new block with them if it outlives their scope
+    bool found = false;
+    for (uint32_t i = logged; i-- > 0;) {
+        if (scope_log[i] == new) {
+            scope_log[i] = heapstart;
+        } else if (scope_log[i] == old && !found) {
+            scope_log[i] = new;
+            found = true;
+        }
+    }
+}
+
+/**
+ * Opens a scope on the heap, returning a mark to pass to virtual_release. Every
+ * block allocated from now until the mark is released is recorded, in a log kept
+ * outside the heap, so that it can be freed along with the rest of the scope.
+ * Scopes can be nested. Only heaps managed by the buddy engine have scopes, and
+ * they can't be used together with the thread caches, the background worker or
+ * virtual_defer_frees. Returns VIRTUAL_NO_MARK if no scope could be opened.
+ */
+uint32_t virtual_mark(void* heapstart) {
+    if (heap_engine(heapstart) != ENGINE_BUDDY || tcache_active(heapstart)
+            || worker_active(heapstart) || deferred_active(heapstart))
+        return VIRTUAL_NO_MARK;
+
+    lock_heap(heapstart);
+
+    uint32_t mark = logged;
+    if ((scope_heap != NULL && scope_heap != heapstart) || append(NULL)) {
+        unlock_heap(heapstart);
+        return VIRTUAL_NO_MARK;
+    }
+
+    scope_heap = heapstart;
+
+    unlock_heap(heapstart);
+
+    return mark;
+}
+
+/**
+ * Closes the scope opened by mark, along with any scopes opened inside it, and
+ * frees every block allocated in them that hasn't been freed already. Blocks
+ * allocated before the mark are left alone, as are blocks moved by realloc that
+ * were allocated before it. The blocks to free come straight from the log, so
+ * the heap is never searched for them, and they are freed and merged together in
+ * a single pass over the heap information. Returns 0 if successful, 1 if not.
+ */
+int virtual_release(void* heapstart, uint32_t mark) {
+#ifdef DEBUG
+    printf("RELEASE %u\n", mark);
+#endif
+
+    lock_heap(heapstart);
+
+    if (!scope_active(heapstart) || mark >= logged
+            || scope_log[mark] != NULL) {
+        unlock_heap(heapstart);
+        return 1;
+    }
+
+    // drop the marks of nested scopes, leaving just the blocks, which lose any
+    // tags they have
+    uint32_t count = 0;
+    for (uint32_t i = mark + 1; i < logged; i++) {
+        if (scope_log[i] != NULL) {
+            tag_forget(heapstart, scope_log[i]);
+            scope_log[mark + count++] = scope_log[i];
+        }
+    }
+
+    int ret = buddy_free_live(heapstart, scope_log + mark, count);
+
+    logged = mark;
+    if (logged == 0)
+        scope_heap = NULL;
+
+    unlock_heap(heapstart);
+
+    return ret;
+}
\ No newline at end of file
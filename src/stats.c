@@ -0,0 +1,181 @@
+#include "stats.h"
+#include "handle.h"
+
+#include <stdatomic.h>
+
+// the counts are only written by whichever thread holds the heap's lock, so a
+// sequence number is enough to let readers see them without taking the lock. it
+// is odd while a change is being made, and a reader whose copy spans a change
+// sees the number move and copies again. the counts themselves are atomic only
+// so that those racing copies are well defined. only the heap at the program
+// break keeps statistics, so none of this is touched while a heap made by
+// virtual_heap_create is being worked on
+static _Atomic uint32_t sequence;
+static _Atomic uint32_t free_blocks[STATS_ORDERS];
+static _Atomic uint32_t allocated_blocks[STATS_ORDERS];
+
+// how deeply the current change is nested, only touched by the writer
+static uint32_t depth;
+
+// counters for virtual_malloc_near, also only written under the heap's lock
+static _Atomic uint64_t near_placed;
+static _Atomic uint64_t near_fallbacks;
+static _Atomic uint64_t near_distance;
+static _Atomic uint64_t near_max_distance;
+
+/**
+ * Counts the blocks of a buddy heap that has just been initialised or changed
+ * wholesale, starting the statistics afresh.
+ */
+void stats_init(void* heapstart) {
+    atomic_store(&near_placed, 0);
+    atomic_store(&near_fallbacks, 0);
+    atomic_store(&near_distance, 0);
+    atomic_store(&near_max_distance, 0);
+
+    stats_begin();
+    stats_recount(heapstart);
+    stats_end();
+}
+
+/**
+ * Starts a change to the statistics, after which readers retry until the
+ * matching stats_end. Changes may be nested, e.g. a realloc made of a free and a
+ * malloc, and only the outermost one is seen by readers. Expects the heap's lock
+ * to be held.
+ */
+void stats_begin(void) {
+    if (heap_handle() != NULL)
+        return;
+
+    if (depth++ != 0)
+        return;
+
+    uint32_t seq = atomic_load_explicit(&sequence, memory_order_relaxed);
+    atomic_store_explicit(&sequence, seq + 1, memory_order_relaxed);
+    // the odd number has to be seen before any of the counts change
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * Finishes a change to the statistics started with stats_begin.
+ */
+void stats_end(void) {
+    if (heap_handle() != NULL)
+        return;
+
+    if (--depth != 0)
+        return;
+
+    uint32_t seq = atomic_load_explicit(&sequence, memory_order_relaxed);
+    atomic_store_explicit(&sequence, seq + 1, memory_order_release);
+}
+
+/**
+ * Adds delta to the number of free or allocated blocks of an order. Should only
+ * be called between stats_begin and stats_end.
+ */
+void stats_add(uint8_t order, bool allocated, int32_t delta) {
+    if (heap_handle() != NULL)
+        return;
+
+    _Atomic uint32_t* count = allocated ? &allocated_blocks[order]
+                                        : &free_blocks[order];
+
+    // there is only ever one writer, so this needn't be a locked instruction
+    uint32_t value = atomic_load_explicit(count, memory_order_relaxed);
+    atomic_store_explicit(count, value + delta, memory_order_relaxed);
+}
+
+/**
+ * Counts a block allocated by buddy_malloc_near, either at distance bytes from
+ * its hint or, for a hint outside the heap, wherever buddy_malloc put it.
+ * Expects the heap's lock to be held.
+ */
+void stats_near(uint32_t distance, bool fallback) {
+    if (heap_handle() != NULL)
+        return;
+
+    if (fallback) {
+        atomic_fetch_add(&near_fallbacks, 1);
+        return;
+    }
+
+    atomic_fetch_add(&near_placed, 1);
+    atomic_fetch_add(&near_distance, distance);
+    if (distance > atomic_load(&near_max_distance))
+        atomic_store(&near_max_distance, distance);
+}
+
+/**
+ * Recounts every block in a buddy heap, after an error has left the heap in a
+ * state that is easier to count than to work out. Should only be called between
+ * stats_begin and stats_end.
+ */
+void stats_recount(void* heapstart) {
+    if (heap_handle() != NULL)
+        return;
+
+    for (uint8_t order = 0; order < STATS_ORDERS; order++) {
+        atomic_store_explicit(&free_blocks[order], 0, memory_order_relaxed);
+        atomic_store_explicit(&allocated_blocks[order], 0,
+                              memory_order_relaxed);
+    }
+
+    size_t heap_size = 1 << *(uint8_t*) heapstart;
+    block_t* block = get_info(heapstart);
+
+    for (size_t pos = 0; pos < heap_size; pos += 1 << block->size, block++)
+        stats_add(block->size, block->allocated, 1);
+}
+
+/**
+ * Fills in a snapshot of the number of free and allocated blocks of each order
+ * on the heap, the free bytes in blocks of each order, and the largest order of
+ * any free block, or -1 if there are none. The snapshot is kept up to date by
+ * the threads changing the heap, so reading it never takes the heap's lock or
+ * holds those threads up, and it is always consistent. Only heaps managed by the
+ * buddy engine have statistics. Returns 0 if successful, 1 if not.
+ */
+int virtual_stats(void* heapstart, heap_stats_t* stats) {
+    if (heap_engine(heapstart) != ENGINE_BUDDY)
+        return 1;
+
+    uint32_t start;
+    do {
+        start = atomic_load_explicit(&sequence, memory_order_acquire);
+
+        for (uint8_t order = 0; order < STATS_ORDERS; order++) {
+            stats->free_blocks[order] = atomic_load_explicit(
+                &free_blocks[order], memory_order_relaxed);
+            stats->allocated_blocks[order] = atomic_load_explicit(
+                &allocated_blocks[order], memory_order_relaxed);
+        }
+
+        // the copies have to be finished before the number is checked again
+        atomic_thread_fence(memory_order_acquire);
+    } while (start & 1
+             || start != atomic_load_explicit(&sequence, memory_order_relaxed));
+
+    stats->largest_free_order = -1;
+    for (uint8_t order = 0; order < STATS_ORDERS; order++) {
+        stats->free_bytes[order] = (uint64_t) stats->free_blocks[order] << order;
+        if (stats->free_blocks[order] != 0)
+            stats->largest_free_order = order;
+    }
+
+    return 0;
+}
+
+/**
+ * Fills in how many blocks virtual_malloc_near has placed near their hints
+ * since the heap was initialised, how far from their hints they ended up in
+ * total and at most, and how many fell back to normal placement because their
+ * hints weren't in the heap.
+ */
+void virtual_near_stats(void* heapstart, near_stats_t* stats) {
+    stats->placed = atomic_load(&near_placed);
+    stats->fallbacks = atomic_load(&near_fallbacks);
+    stats->total_distance = atomic_load(&near_distance);
+    stats->max_distance = atomic_load(&near_max_distance);
+}
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include "subtree.h"
+#include "tree.h"
+
+#include <pthread.h>
+
+// the number of levels of the tree above the subtree roots, so a heap has up
+// to 2^SUBTREE_LEVELS subtrees. the top levels count how many subtree roots and
+// whole blocks below them are in use, rather than every allocated block, so
+// that they only change when a subtree as a whole fills or empties
+#define SUBTREE_LEVELS 4
+
+// each lock gets its own cache line so that threads working in neighbouring
+// subtrees don't slow each other down
+typedef struct {
+    pthread_mutex_t mutex;
+    char padding[64 - sizeof(pthread_mutex_t)];
+} subtree_lock_t;
+
+// the next home subtree to hand out to a thread
+static _Atomic uint32_t next_home;
+
+// the calling thread's home subtree plus one, or 0 if it hasn't been given one
+static __thread uint32_t home;
+
+/**
+ * Returns the number of levels of the tree above the subtree roots.
+ */
+static uint8_t subtree_levels(void* heapstart) {
+    return MIN(SUBTREE_LEVELS, tree_depth(heapstart));
+}
+
+/**
+ * Returns the locks stored after the tree. The first is the parent lock, and
+ * the lock of subtree i is at 1 + i.
+ */
+static subtree_lock_t* get_locks(void* heapstart) {
+    return tree_extra(heapstart);
+}
+
+/**
+ * Returns the calling thread's home subtree. Threads are handed subtrees in
+ * turn, which spreads them out more evenly than hashing their ids.
+ */
+static uint32_t home_subtree(uint32_t subtrees) {
+    if (home == 0)
+        home = atomic_fetch_add(&next_home, 1) + 1;
+
+    return (home - 1) & (subtrees - 1);
+}
+
+/**
+ * Updates the counts of the nodes above the subtree roots when a node at or
+ * above the subtree roots starts or stops being in use. When starting, fails
+ * without changing anything if one of those nodes has been allocated as a
+ * whole. Must be called with the parent lock held. Returns 0 if successful, 1
+ * if not.
+ */
+static int update_top(node_t* tree, uint32_t node, bool in_use) {
+    if (in_use) {
+        for (uint32_t parent = node >> 1; parent; parent >>= 1) {
+            if (atomic_load(&tree[parent]) == NODE_FULL)
+                return 1;
+        }
+    }
+
+    for (uint32_t parent = node >> 1; parent; parent >>= 1)
+        atomic_fetch_add(&tree[parent], in_use ? 1 : -1);
+
+    return 0;
+}
+
+/**
+ * Finds a free node `levels` below a node, skipping anything already
+ * allocated. Halves that are already split are tried before whole free halves,
+ * so that large free blocks stay intact for as long as possible, as in the
+ * buddy engine. Returns 0 if there is no free node.
+ */
+static uint32_t find_free(node_t* tree, uint32_t node, uint8_t levels) {
+    uint32_t state = atomic_load(&tree[node]);
+    if (state == NODE_FULL)
+        return 0;
+
+    if (levels == 0)
+        return state == 0 ? node : 0;
+
+    if (state == 0)
+        // everything below is free, so take the leftmost node
+        return node << levels;
+
+    uint32_t first = node << 1;
+    uint32_t second = first + 1;
+
+    uint32_t right = atomic_load(&tree[second]);
+    if (atomic_load(&tree[first]) == 0 && right != 0 && right != NODE_FULL) {
+        first = second;
+        second = node << 1;
+    }
+
+    uint32_t found = find_free(tree, first, levels - 1);
+    return found ? found : find_free(tree, second, levels - 1);
+}
+
+/**
+ * Allocates a node `levels` below the root of a subtree under the subtree's
+ * lock. If the subtree was empty, the parent lock is taken to mark it as in
+ * use, which fails if a larger block covering the whole subtree is allocated.
+ * Returns 0 if the subtree has no room.
+ */
+static uint32_t subtree_claim(node_t* tree, subtree_lock_t* locks,
+                              uint32_t root, uint32_t subtree, uint8_t levels) {
+    pthread_mutex_lock(&locks[1 + subtree].mutex);
+
+    uint32_t node = find_free(tree, root, levels);
+    if (node && atomic_load(&tree[root]) == 0) {
+        pthread_mutex_lock(&locks[0].mutex);
+        if (update_top(tree, root, true))
+            node = 0;
+        pthread_mutex_unlock(&locks[0].mutex);
+    }
+
+    if (node) {
+        atomic_store(&tree[node], NODE_FULL);
+        for (uint32_t parent = node; parent != root; ) {
+            parent >>= 1;
+            atomic_fetch_add(&tree[parent], 1);
+        }
+    }
+
+    pthread_mutex_unlock(&locks[1 + subtree].mutex);
+    return node;
+}
+
+/**
+ * Initialises a virtual heap of size 2^initial_size bytes managed by the
+ * subtree engine. The heap information is the same tree of nodes as the
+ * lock-free engine, but the top levels of the tree are cut into subtrees which
+ * each have their own lock, plus a parent lock over the levels above them. The
+ * locks are stored after the tree.
+ */
+void subtree_init(void* heapstart, uint8_t initial_size, uint8_t min_size) {
+    uint8_t levels = MIN(SUBTREE_LEVELS,
+                         initial_size - MIN(initial_size, min_size));
+    size_t count = 1 + ((size_t) 1 << levels);
+
+    if (tree_init(heapstart, initial_size, min_size, ENGINE_SUBTREE,
+                  count * sizeof(subtree_lock_t)) == NULL)
+        return;
+
+    subtree_lock_t* locks = get_locks(heapstart);
+    for (size_t i = 0; i < count; i++)
+        pthread_mutex_init(&locks[i].mutex, NULL);
+}
+
+/**
+ * Allocates a block on a subtree heap. Each thread has a home subtree, and
+ * tries the other subtrees in turn if its home subtree has no room. Blocks
+ * larger than a subtree are allocated under the parent lock. Returns NULL if
+ * no subtree has room.
+ */
+void* subtree_malloc(void* heapstart, uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size > 1 << heap_size)
+        return NULL;
+
+    uint8_t needed_size = MAX(min_size, log_2(size));
+    if (needed_size > heap_size)
+        return NULL;
+
+    node_t* tree = get_tree(heapstart);
+    subtree_lock_t* locks = get_locks(heapstart);
+    uint8_t depth = heap_size - needed_size;
+    uint8_t levels = subtree_levels(heapstart);
+    uint32_t node = 0;
+
+    if (depth < levels) {
+        // the block spans several subtrees
+        pthread_mutex_lock(&locks[0].mutex);
+        node = find_free(tree, 1, depth);
+        if (node) {
+            atomic_store(&tree[node], NODE_FULL);
+            update_top(tree, node, true);
+        }
+        pthread_mutex_unlock(&locks[0].mutex);
+    } else {
+        uint32_t subtrees = (uint32_t) 1 << levels;
+        uint32_t start = home_subtree(subtrees);
+
+        for (uint32_t i = 0; i < subtrees && node == 0; i++) {
+            uint32_t subtree = (start + i) & (subtrees - 1);
+            node = subtree_claim(tree, locks, subtrees + subtree, subtree,
+                                 depth - levels);
+        }
+    }
+
+    if (node == 0)
+        return NULL;
+
+    uint32_t offset = (node - ((uint32_t) 1 << depth)) << needed_size;
+    return get_blocks(heapstart) + offset;
+}
+
+/**
+ * Frees the block of a node found by find_node or sized_node under the lock of
+ * its subtree, or fails if the node is 0. Returns 0 if successful, 1 if not.
+ */
+static int free_node(void* heapstart, uint32_t node) {
+    if (node == 0)
+        return 1;
+
+    node_t* tree = get_tree(heapstart);
+    subtree_lock_t* locks = get_locks(heapstart);
+    uint8_t depth = node_depth(node);
+    uint8_t levels = subtree_levels(heapstart);
+
+    if (depth < levels) {
+        pthread_mutex_lock(&locks[0].mutex);
+
+        // another thread may have freed the same block in the meantime
+        int ret = atomic_load(&tree[node]) != NODE_FULL;
+        if (ret == 0) {
+            atomic_store(&tree[node], 0);
+            update_top(tree, node, false);
+        }
+
+        pthread_mutex_unlock(&locks[0].mutex);
+        return ret;
+    }
+
+    uint32_t root = node >> (depth - levels);
+    uint32_t subtree = root - ((uint32_t) 1 << levels);
+    pthread_mutex_lock(&locks[1 + subtree].mutex);
+
+    int ret = atomic_load(&tree[node]) != NODE_FULL;
+    if (ret == 0) {
+        atomic_store(&tree[node], 0);
+        for (uint32_t parent = node; parent != root; ) {
+            parent >>= 1;
+            atomic_fetch_sub(&tree[parent], 1);
+        }
+
+        if (atomic_load(&tree[root]) == 0) {
+            pthread_mutex_lock(&locks[0].mutex);
+            update_top(tree, root, false);
+            pthread_mutex_unlock(&locks[0].mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&locks[1 + subtree].mutex);
+    return ret;
+}
+
+/**
+ * Frees a block on a subtree heap under the lock of the subtree it is in. The
+ * parent lock is only taken if the subtree becomes empty, since that is the
+ * only time the block merges past the subtree's root. Returns 0 if successful,
+ * 1 if not.
+ */
+int subtree_free(void* heapstart, void* ptr) {
+    return free_node(heapstart, find_node(heapstart, ptr));
+}
+
+/**
+ * Frees a block on a subtree heap like subtree_free, given a size that was
+ * allocated there, which finds its node without searching the tree. Returns 0
+ * if successful, 1 if not.
+ */
+int subtree_free_sized(void* heapstart, void* ptr, uint32_t size) {
+    return free_node(heapstart, sized_node(heapstart, ptr, size));
+}
+
+/**
+ * Reallocates a block on a subtree heap. The new block is allocated before the
+ * old one is freed, as the old block's subtree may be locked by other threads
+ * in between.
+ */
+void* subtree_realloc(void* heapstart, void* ptr, uint32_t size) {
+    if (size == 0) {
+        subtree_free(heapstart, ptr);
+        return NULL;
+    }
+
+    if (ptr == NULL)
+        return subtree_malloc(heapstart, size);
+
+    uint32_t node = find_node(heapstart, ptr);
+    if (node == 0)
+        return NULL;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t og_size = heap_size - node_depth(node);
+
+    // the block is already the right size
+    if (size <= 1 << heap_size && MAX(min_size, log_2(size)) == og_size)
+        return ptr;
+
+    void* new_block = subtree_malloc(heapstart, size);
+    if (new_block == NULL)
+        return NULL;
+
+    memmove(new_block, ptr, MIN(1 << og_size, size));
+    subtree_free(heapstart, ptr);
+
+    return new_block;
+}
+
+/**
+ * Prints the blocks of a subtree heap in the same format as virtual_info.
+ * The output is only consistent if no other thread is modifying the heap.
+ */
+void subtree_info(void* heapstart) {
+    tree_info(heapstart);
+}
\ No newline at end of file
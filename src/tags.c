@@ -0,0 +1,346 @@
+#include "tags.h"
+#include "buddy.h"
+#include "deferred.h"
+#include "scope.h"
+#include "tcache.h"
+#include "worker.h"
+
+#include <sys/mman.h>
+
+// the most tags that can have blocks at once, so that a group fits in a byte
+#define TAG_GROUPS 255
+
+// the tag of a block, kept for every position a block can start at. the group
+// is 1 more than its index in groups, or 0 for an untagged block, and the order
+// is the block's size, so that its bytes can be taken off its group's
+typedef struct {
+    uint8_t group;
+    uint8_t order;
+} tag_slot_t;
+
+// the blocks with a tag. members may also hold blocks that have since been
+// freed, or been freed and tagged again, which are only weeded out once the
+// list fills up or the group is freed, so that a free only has to touch its
+// slot
+typedef struct {
+    bool used;
+    uint32_t tag;
+    void** members;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t bytes;
+} group_t;
+
+// only one heap can have tags at a time. everything is kept outside the heap
+// like the scopes' log, and is only touched under the heap's lock. the slots are
+// kept once every group has been freed, since tags tend to be used over and over
+static void* tag_heap;
+static tag_slot_t* slots;
+static size_t slot_count;
+static group_t groups[TAG_GROUPS];
+static group_t* last_group;
+static uint32_t used_groups;
+
+/**
+ * Returns the slot for the block starting at ptr, or NULL if no block can start
+ * there.
+ */
+static tag_slot_t* slot_of(void* heapstart, void* ptr) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if ((uint8_t*) ptr < heap || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return NULL;
+
+    size_t offset = (uint8_t*) ptr - heap;
+    min_size = MIN(min_size, heap_size);
+    if (offset & ((1 << min_size) - 1))
+        return NULL;
+
+    return &slots[offset >> min_size];
+}
+
+/**
+ * Returns the group for a tag, or NULL if it has no group.
+ */
+static group_t* find_group(uint32_t tag) {
+    // blocks tend to be tagged in runs with the same tag
+    if (last_group != NULL && last_group->used && last_group->tag == tag)
+        return last_group;
+
+    for (int i = 0; i < TAG_GROUPS; i++) {
+        if (groups[i].used && groups[i].tag == tag) {
+            last_group = &groups[i];
+            return last_group;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Unmaps a group's list of members and marks it unused.
+ */
+static void free_group(group_t* group) {
+    if (group->members != NULL)
+        munmap(group->members, group->capacity * sizeof(void*));
+    if (group->used)
+        used_groups--;
+
+    *group = (group_t) {0};
+}
+
+/**
+ * Adds a block to a group's members, first weeding out the members that have
+ * left the group if the list is full, and only growing it if that doesn't free
+ * up half of it. Returns 0 if successful, 1 if not.
+ */
+static int add_member(void* heapstart, group_t* group, void* block) {
+    uint8_t index = group - groups + 1;
+
+    if (group->count == group->capacity && group->count != 0) {
+        // sorting brings any block that is in the list twice together
+        sort_pointers(group->members, group->count);
+
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < group->count; i++) {
+            void* member = group->members[i];
+            if (slot_of(heapstart, member)->group == index
+                    && (kept == 0 || group->members[kept - 1] != member))
+                group->members[kept++] = member;
+        }
+
+        group->count = kept;
+    }
+
+    if (group->count > group->capacity / 2 || group->capacity == 0) {
+        void** members = grow_list(group->members, group->count,
+                                   &group->capacity);
+        if (members == NULL && group->count == group->capacity)
+            return 1;
+        if (members != NULL)
+            group->members = members;
+    }
+
+    group->members[group->count++] = block;
+    return 0;
+}
+
+/**
+ * Gives the block starting at ptr, of the given order, to a group.
+ */
+static void set_slot(void* heapstart, group_t* group, void* ptr,
+                     uint8_t order) {
+    *slot_of(heapstart, ptr) = (tag_slot_t) {group - groups + 1, order};
+    group->bytes += (uint64_t) 1 << order;
+}
+
+/**
+ * Returns the order of the block allocated for size bytes.
+ */
+static uint8_t block_order(void* heapstart, uint32_t size) {
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    return MAX(min_size, log_2(size));
+}
+
+/**
+ * Returns whether blocks on a heap have been tagged, in which case frees on it
+ * have to untag them.
+ */
+bool tags_active(void* heapstart) {
+    return tag_heap != NULL && tag_heap == heapstart && used_groups != 0;
+}
+
+/**
+ * Forgets every tag without freeing anything, after the heap they were on has
+ * been reinitialised.
+ */
+void tags_reset(void) {
+    if (slots != NULL)
+        munmap(slots, slot_count * sizeof(tag_slot_t));
+
+    for (int i = 0; i < TAG_GROUPS; i++)
+        free_group(&groups[i]);
+
+    tag_heap = NULL;
+    used_groups = 0;
+    slots = NULL;
+    slot_count = 0;
+    last_group = NULL;
+}
+
+/**
+ * Untags the block starting at ptr, if it is tagged, because it has been or is
+ * about to be freed. Expects the heap's lock to be held.
+ */
+void tag_forget(void* heapstart, void* ptr) {
+    if (!tags_active(heapstart))
+        return;
+
+    tag_slot_t* slot = slot_of(heapstart, ptr);
+    if (slot == NULL || slot->group == 0)
+        return;
+
+    groups[slot->group - 1].bytes -= (uint64_t) 1 << slot->order;
+    slot->group = 0;
+}
+
+/**
+ * Follows a block that realloc moved from old to new and resized to size bytes,
+ * so that the new block has the old one's tag, if any. Expects the heap's lock
+ * to be held.
+ */
+void tag_moved(void* heapstart, void* old, void* new, uint32_t size) {
+    if (new == NULL || !tags_active(heapstart))
+        return;
+
+    tag_slot_t* slot = slot_of(heapstart, old);
+    if (slot == NULL || slot->group == 0)
+        return;
+
+    group_t* group = &groups[slot->group - 1];
+    tag_forget(heapstart, old);
+
+    // a block moved out of its group's list is left untagged if the list can't
+    // grow, rather than failing a realloc that has already happened
+    if (new == old || add_member(heapstart, group, new) == 0)
+        set_slot(heapstart, group, new, block_order(heapstart, size));
+}
+
+/**
+ * Allocates a block like virtual_malloc, and tags it so that it can be freed
+ * along with every other block with the same tag by virtual_free_tag. The tags
+ * are kept outside the heap, in a slot for every position a block can start at
+ * and a list of blocks for each tag. Only heaps managed by the buddy engine
+ * have tags, and they can't be used together with the thread caches, the
+ * background worker or virtual_defer_frees. At most 255 tags can have blocks at
+ * once. Returns NULL if allocation is not possible.
+ */
+void* virtual_malloc_tagged(void* heapstart, uint32_t size, uint32_t tag) {
+#ifdef DEBUG
+    printf("ALLOC_TAGGED %u %u\n", size, tag);
+#endif
+
+    if (heap_engine(heapstart) != ENGINE_BUDDY || tcache_active(heapstart)
+            || worker_active(heapstart) || deferred_active(heapstart))
+        return NULL;
+
+    lock_heap(heapstart);
+
+    if (tag_heap != heapstart) {
+        if (used_groups != 0) {
+            unlock_heap(heapstart);
+            return NULL;
+        }
+
+        if (slots != NULL)
+            munmap(slots, slot_count * sizeof(tag_slot_t));
+        tag_heap = NULL;
+        slots = NULL;
+
+        // a slot for every block of the minimum size
+        uint8_t heap_size = *(uint8_t*) heapstart;
+        uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+        size_t count = (size_t) 1 << (heap_size - MIN(min_size, heap_size));
+
+        tag_slot_t* new_slots = mmap(NULL, count * sizeof(tag_slot_t),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new_slots == MAP_FAILED) {
+            unlock_heap(heapstart);
+            return NULL;
+        }
+
+        tag_heap = heapstart;
+        slots = new_slots;
+        slot_count = count;
+    }
+
+    group_t* group = find_group(tag);
+    for (int i = 0; group == NULL && i < TAG_GROUPS; i++) {
+        if (!groups[i].used) {
+            group = &groups[i];
+            *group = (group_t) {.used = true, .tag = tag};
+            used_groups++;
+        }
+    }
+
+    void* block = group != NULL ? buddy_malloc(heapstart, size) : NULL;
+    if (block != NULL && add_member(heapstart, group, block)) {
+        buddy_free(heapstart, block);
+        block = NULL;
+    }
+
+    if (block != NULL) {
+        set_slot(heapstart, group, block, block_order(heapstart, size));
+
+        // a tagged block still belongs to the scope it was allocated in
+        if (scope_record(heapstart, block) == NULL) {
+            tag_forget(heapstart, block);
+            block = NULL;
+        }
+    }
+
+    // a group made just for this block goes again if it stayed empty
+    if (group != NULL && group->count == 0)
+        free_group(group);
+
+    unlock_heap(heapstart);
+
+    return block;
+}
+
+/**
+ * Frees every block with the given tag, and forgets the tag. The blocks come
+ * straight from the tag's list, so the heap is never searched for them, and
+ * they are freed and merged together in a single pass over the heap
+ * information. Returns 0 if successful, 1 if not, e.g. if no blocks have had
+ * the tag since it was last freed.
+ */
+int virtual_free_tag(void* heapstart, uint32_t tag) {
+#ifdef DEBUG
+    printf("FREE_TAG %u\n", tag);
+#endif
+
+    lock_heap(heapstart);
+
+    group_t* group = tags_active(heapstart) ? find_group(tag) : NULL;
+    if (group == NULL) {
+        unlock_heap(heapstart);
+        return 1;
+    }
+
+    // take the members still in the group out of it, once each
+    uint8_t index = group - groups + 1;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < group->count; i++) {
+        tag_slot_t* slot = slot_of(heapstart, group->members[i]);
+        if (slot->group == index) {
+            slot->group = 0;
+            group->members[count++] = group->members[i];
+        }
+    }
+
+    int ret = buddy_free_live(heapstart, group->members, count);
+    free_group(group);
+
+    unlock_heap(heapstart);
+
+    return ret;
+}
+
+/**
+ * Returns the bytes in blocks with the given tag that haven't been freed, which
+ * counts every block at its full size.
+ */
+uint64_t virtual_tag_bytes(void* heapstart, uint32_t tag) {
+    lock_heap(heapstart);
+
+    group_t* group = tags_active(heapstart) ? find_group(tag) : NULL;
+    uint64_t bytes = group != NULL ? group->bytes : 0;
+
+    unlock_heap(heapstart);
+
+    return bytes;
+}
\ No newline at end of file
@@ -0,0 +1,910 @@
+#include "tcache.h"
+#include "buddy.h"
+#include "deferred.h"
+#include "pcpu.h"
+#include "scope.h"
+#include "tags.h"
+#include "worker.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// blocks are linked into a cache through their first bytes, so blocks smaller
+// than a pointer can't be cached
+#define TCACHE_MIN_SIZE 3
+#define TCACHE_ORDERS PCPU_ORDERS
+
+// each thread's cache gets an owner id, recorded against the blocks it hands
+// out. id 0 means no owner
+#define MAX_OWNERS 512
+
+// entries of the order map pack the owner of a block, whether it is in use or
+// sitting in a cache, and its order
+#define ENTRY(owner, state, order) \
+    ((uint16_t) ((owner) << 7 | (state) << 5 | (order)))
+#define ENTRY_OWNER(entry) ((entry) >> 7)
+#define ENTRY_STATE(entry) (((entry) >> 5) & 0x3)
+#define ENTRY_ORDER(entry) ((entry) & 0x1f)
+
+enum {
+    BLOCK_UNKNOWN,
+    BLOCK_IN_USE,
+    BLOCK_CACHED,
+};
+
+// the bins of a cache with an owner id can be stolen from by other threads, so
+// they are only touched under its arena's lock. the counts are atomic so that
+// the owner can check them without the lock
+typedef struct {
+    void* heapstart;
+    uint32_t generation;
+    uint16_t owner;
+    _Atomic uint32_t bytes;
+    _Atomic uint32_t counts[TCACHE_ORDERS];
+    void* bins[TCACHE_ORDERS];
+} tcache_t;
+
+// what other threads can see of the cache of each owner id. the counts of
+// cached blocks of each order are published here so that a thread that runs out
+// can pick the cache to steal from without looking inside every one
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    tcache_t* cache;
+    _Atomic uint32_t counts[TCACHE_ORDERS];
+} arena_t;
+
+// blocks freed by other threads, waiting for their owner to collect them.
+// padded so that pushes for different owners don't contend on a cache line
+typedef struct {
+    _Atomic(void*) head;
+    char padding[64 - sizeof(void*)];
+} remote_list_t;
+
+static __thread tcache_t cache;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// bumped whenever the heap is reinitialised, invalidating every thread's cache
+static _Atomic uint32_t generation = 1;
+
+static void* cached_heap;
+static _Atomic uint32_t max_count;
+static _Atomic uint32_t max_bytes;
+
+// whether threads that can use the per-CPU caches do so instead of their own
+static _Atomic bool per_cpu;
+
+// records the order and owner of every block handed out through the caches,
+// indexed by the block's offset in units of the minimum block size. this lets
+// a block be freed without searching the heap information for its size
+static _Atomic uint16_t* order_map;
+static size_t order_map_size;
+
+// a bit for every owner id in use, with id 0 permanently taken
+static _Atomic uint64_t owner_ids[MAX_OWNERS / 64] = {1};
+static remote_list_t remote_lists[MAX_OWNERS];
+static arena_t arenas[MAX_OWNERS];
+
+// one more than the highest owner id ever claimed, to bound searches for a
+// cache to steal from
+static _Atomic uint16_t owners_seen;
+
+static _Atomic uint64_t remote_frees;
+static _Atomic uint64_t remote_drains;
+static _Atomic uint64_t remote_max_batch;
+static _Atomic uint64_t steals;
+
+/**
+ * Returns the order map entry for the block starting at ptr, or NULL if ptr
+ * can't be the start of a block.
+ */
+static _Atomic uint16_t* map_entry(void* heapstart, void* ptr) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if ((uint8_t*) ptr < heap || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return NULL;
+
+    uint32_t offset = (uint8_t*) ptr - heap;
+    if (min_size > heap_size || offset & ((1 << min_size) - 1))
+        return NULL;
+
+    return &order_map[offset >> min_size];
+}
+
+/**
+ * Claims an unused owner id, or returns 0 if they have all been taken.
+ */
+static uint16_t claim_owner(void) {
+    for (uint16_t word = 0; word < MAX_OWNERS / 64; word++) {
+        uint64_t ids = atomic_load(&owner_ids[word]);
+
+        while (ids != UINT64_MAX) {
+            uint8_t bit = __builtin_ctzll(~ids);
+            if (atomic_compare_exchange_weak(&owner_ids[word], &ids,
+                                             ids | (uint64_t) 1 << bit)) {
+                uint16_t owner = word * 64 + bit;
+
+                uint16_t seen = atomic_load(&owners_seen);
+                while (owner >= seen && !atomic_compare_exchange_weak(
+                        &owners_seen, &seen, owner + 1));
+
+                return owner;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Makes a cache visible to threads looking for blocks to steal.
+ */
+static void register_cache(tcache_t* tc) {
+    if (tc->owner == 0)
+        return;
+
+    arena_t* arena = &arenas[tc->owner];
+    pthread_mutex_lock(&arena->lock);
+    arena->cache = tc;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Gives up an owner id claimed with claim_owner, first hiding its cache from
+ * threads looking for blocks to steal. Blocks freed to it afterwards go
+ * straight back to the heap while no thread holds it, and are collected by the
+ * next thread to claim it otherwise.
+ */
+static void release_owner(uint16_t owner) {
+    if (owner == 0)
+        return;
+
+    arena_t* arena = &arenas[owner];
+    pthread_mutex_lock(&arena->lock);
+    arena->cache = NULL;
+    for (uint8_t order = 0; order < TCACHE_ORDERS; order++)
+        atomic_store_explicit(&arena->counts[order], 0, memory_order_relaxed);
+    pthread_mutex_unlock(&arena->lock);
+
+    atomic_fetch_and(&owner_ids[owner / 64], ~((uint64_t) 1 << owner % 64));
+}
+
+/**
+ * Returns whether some thread holds an owner id.
+ */
+static bool owner_held(uint16_t owner) {
+    return atomic_load(&owner_ids[owner / 64]) & (uint64_t) 1 << owner % 64;
+}
+
+/**
+ * Returns the blocks freed back to an owner id that no thread holds to the
+ * heap, under a single lock, rather than leaving them for a thread that may
+ * never claim the id again.
+ */
+static void free_orphans(void* heapstart, uint16_t owner) {
+    void* block = atomic_exchange(&remote_lists[owner].head, NULL);
+    if (block == NULL)
+        return;
+
+    lock_heap(heapstart);
+
+    while (block != NULL) {
+        void* next = *(void**) block;
+        atomic_store(map_entry(heapstart, block), 0);
+        buddy_free(heapstart, block);
+        block = next;
+    }
+
+    unlock_heap(heapstart);
+}
+
+/**
+ * Locks a cache's bins against threads stealing from it. A cache without an
+ * owner id can't be stolen from, so needs no lock.
+ */
+static void lock_cache(tcache_t* tc) {
+    if (tc->owner != 0)
+        pthread_mutex_lock(&arenas[tc->owner].lock);
+}
+
+static void unlock_cache(tcache_t* tc) {
+    if (tc->owner != 0)
+        pthread_mutex_unlock(&arenas[tc->owner].lock);
+}
+
+/**
+ * Returns whether a cache has room for another block of an order.
+ */
+static bool has_room(tcache_t* tc, uint8_t order) {
+    return tc->counts[order] < max_count
+           && tc->bytes + (1 << order) <= max_bytes;
+}
+
+/**
+ * Updates the count of blocks of an order in a cache, and publishes it for
+ * threads looking for blocks to steal. Must be called with the cache locked.
+ */
+static void count_blocks(tcache_t* tc, uint8_t order, int32_t change) {
+    uint32_t count = tc->counts[order] + change;
+
+    atomic_store_explicit(&tc->counts[order], count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&tc->bytes, (uint32_t) change << order,
+                              memory_order_relaxed);
+
+    if (tc->owner != 0)
+        atomic_store_explicit(&arenas[tc->owner].counts[order], count,
+                              memory_order_relaxed);
+}
+
+/**
+ * Adds a block to a cache, marking it as cached in the order map.
+ */
+static void push_block(tcache_t* tc, void* block, uint8_t order) {
+    atomic_store_explicit(map_entry(tc->heapstart, block),
+                          ENTRY(tc->owner, BLOCK_CACHED, order),
+                          memory_order_relaxed);
+
+    lock_cache(tc);
+    *(void**) block = tc->bins[order];
+    tc->bins[order] = block;
+    count_blocks(tc, order, 1);
+    unlock_cache(tc);
+}
+
+/**
+ * Removes the most recently added block of an order from a cache that is
+ * already locked. Its order map entry is left for the caller to update. Returns
+ * NULL if the cache has no blocks of that order.
+ */
+static void* take_block(tcache_t* tc, uint8_t order) {
+    void* block = tc->bins[order];
+    if (block == NULL)
+        return NULL;
+
+    tc->bins[order] = *(void**) block;
+    count_blocks(tc, order, -1);
+
+    return block;
+}
+
+/**
+ * Removes the most recently added block of an order from a cache. Its order
+ * map entry is left for the caller to update. Returns NULL if the cache has no
+ * blocks of that order.
+ */
+static void* pop_block(tcache_t* tc, uint8_t order) {
+    lock_cache(tc);
+    void* block = take_block(tc, order);
+    unlock_cache(tc);
+
+    return block;
+}
+
+/**
+ * Takes a cached block of at least the given order from another thread's cache,
+ * for a thread whose own cache is empty and whose heap has run out. The
+ * smallest order any cache has published a block of is used, and the cache with
+ * the most blocks of that order is stolen from. Must be called with the heap
+ * locked. Returns NULL if there was nothing to steal.
+ */
+static void* steal_block(tcache_t* thief, uint8_t order, uint8_t* stolen) {
+    uint16_t owners = atomic_load(&owners_seen);
+
+    for (*stolen = order; *stolen < TCACHE_ORDERS; (*stolen)++) {
+        uint16_t victim = 0;
+        uint32_t most = 0;
+
+        for (uint16_t owner = 1; owner < owners; owner++) {
+            uint32_t count = atomic_load_explicit(&arenas[owner].counts[*stolen],
+                                                  memory_order_relaxed);
+            if (owner != thief->owner && count > most) {
+                victim = owner;
+                most = count;
+            }
+        }
+
+        if (victim == 0)
+            continue;
+
+        // the victim may have exited or moved on to a new heap since publishing
+        arena_t* arena = &arenas[victim];
+        void* block = NULL;
+
+        pthread_mutex_lock(&arena->lock);
+        tcache_t* tc = arena->cache;
+        if (tc != NULL && tc->heapstart == thief->heapstart
+                && tc->generation == atomic_load(&generation))
+            block = take_block(tc, *stolen);
+        pthread_mutex_unlock(&arena->lock);
+
+        if (block != NULL) {
+            atomic_fetch_add(&steals, 1);
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns every block in a cache to the heap, under a single lock.
+ */
+static void flush_cache(tcache_t* tc) {
+    if (tc->bytes == 0)
+        return;
+
+    lock_heap(tc->heapstart);
+
+    for (uint8_t order = 0; order < TCACHE_ORDERS; order++) {
+        void* block;
+        while ((block = pop_block(tc, order)) != NULL) {
+            atomic_store(map_entry(tc->heapstart, block), 0);
+            buddy_free(tc->heapstart, block);
+        }
+    }
+
+    unlock_heap(tc->heapstart);
+}
+
+/**
+ * Returns blocks of one order in a cache to the heap until only `keep` are left,
+ * under a single lock.
+ */
+static void flush_bin(tcache_t* tc, uint8_t order, uint32_t keep) {
+    lock_heap(tc->heapstart);
+
+    void* block;
+    while (tc->counts[order] > keep && (block = pop_block(tc, order)) != NULL) {
+        atomic_store(map_entry(tc->heapstart, block), 0);
+        buddy_free(tc->heapstart, block);
+    }
+
+    unlock_heap(tc->heapstart);
+}
+
+/**
+ * Collects the blocks other threads have freed back to a cache's owner in one
+ * go. They are kept in the cache where there is room, and the rest are returned
+ * to the heap under a single lock.
+ */
+static void drain_remote(tcache_t* tc) {
+    if (tc->owner == 0)
+        return;
+
+    void* block = atomic_exchange(&remote_lists[tc->owner].head, NULL);
+    if (block == NULL)
+        return;
+
+    uint64_t batch = 0;
+    bool locked = false;
+
+    for (; block != NULL; batch++) {
+        void* next = *(void**) block;
+        _Atomic uint16_t* entry = map_entry(tc->heapstart, block);
+        uint8_t order = ENTRY_ORDER(atomic_load(entry));
+
+        if (has_room(tc, order)) {
+            push_block(tc, block, order);
+        } else {
+            if (!locked) {
+                lock_heap(tc->heapstart);
+                locked = true;
+            }
+
+            atomic_store(entry, 0);
+            buddy_free(tc->heapstart, block);
+        }
+
+        block = next;
+    }
+
+    if (locked)
+        unlock_heap(tc->heapstart);
+
+    atomic_fetch_add(&remote_frees, batch);
+    atomic_fetch_add(&remote_drains, 1);
+
+    uint64_t max = atomic_load(&remote_max_batch);
+    while (batch > max
+           && !atomic_compare_exchange_weak(&remote_max_batch, &max, batch));
+}
+
+/**
+ * Hands a block back to the thread whose cache it came from, which collects it
+ * on its next malloc.
+ */
+static void push_remote(_Atomic uint16_t* entry, void* block, uint16_t owner,
+                        uint8_t order) {
+    remote_list_t* list = &remote_lists[owner];
+    atomic_store_explicit(entry, ENTRY(owner, BLOCK_CACHED, order),
+                          memory_order_relaxed);
+
+    void* head = atomic_load_explicit(&list->head, memory_order_relaxed);
+    do {
+        *(void**) block = head;
+    } while (!atomic_compare_exchange_weak(&list->head, &head, block));
+}
+
+/**
+ * Returns every block in every CPU's cache to the heap, under a single lock.
+ * Only safe while no other thread uses the caches.
+ */
+static void flush_cpus(void* heapstart) {
+    lock_heap(heapstart);
+
+    for (uint32_t cpu = 0; cpu < pcpu_cpus(); cpu++) {
+        for (uint8_t order = 0; order < PCPU_ORDERS; order++) {
+            void* block;
+            while ((block = pcpu_take(cpu, order)) != NULL) {
+                atomic_store(map_entry(heapstart, block), 0);
+                buddy_free(heapstart, block);
+            }
+        }
+    }
+
+    unlock_heap(heapstart);
+}
+
+/**
+ * Returns whether the calling thread should use the per-CPU caches.
+ */
+static bool use_cpu_cache(void) {
+    return atomic_load_explicit(&per_cpu, memory_order_relaxed)
+           && pcpu_supported();
+}
+
+/**
+ * Allocates a block through the cache of the CPU the calling thread is running
+ * on. If the cache is empty, it is refilled with a batch of blocks from the
+ * shared heap under a single lock.
+ */
+static void* cpu_malloc(void* heapstart, uint32_t size, uint8_t order) {
+    void* block = pcpu_pop(order);
+
+    if (block == NULL) {
+        uint32_t batch = MAX(1, pcpu_capacity(order) / 2);
+
+        lock_heap(heapstart);
+
+        block = buddy_malloc(heapstart, size);
+        for (uint32_t i = 1; block != NULL && i < batch; i++) {
+            void* extra = buddy_malloc(heapstart, size);
+            if (extra == NULL)
+                break;
+
+            // the entry has to be written before the block is visible to other
+            // threads on this CPU
+            _Atomic uint16_t* entry = map_entry(heapstart, extra);
+            atomic_store(entry, ENTRY(0, BLOCK_CACHED, order));
+            if (!pcpu_push(extra, order)) {
+                // this thread moved to a CPU whose cache is already full
+                atomic_store(entry, 0);
+                buddy_free(heapstart, extra);
+                break;
+            }
+        }
+
+        unlock_heap(heapstart);
+    }
+
+    if (block != NULL)
+        atomic_store_explicit(map_entry(heapstart, block),
+                              ENTRY(0, BLOCK_IN_USE, order),
+                              memory_order_relaxed);
+
+    return block;
+}
+
+/**
+ * Frees a block into the cache of the CPU the calling thread is running on. If
+ * that cache is full, half of its blocks of the same order are returned to the
+ * shared heap along with this one, under a single lock. Returns 0 if
+ * successful, 1 if not.
+ */
+static int cpu_free(void* heapstart, void* ptr, uint8_t order) {
+    _Atomic uint16_t* entry = map_entry(heapstart, ptr);
+    atomic_store(entry, ENTRY(0, BLOCK_CACHED, order));
+    if (pcpu_push(ptr, order))
+        return 0;
+
+    lock_heap(heapstart);
+
+    void* block;
+    for (uint32_t i = pcpu_capacity(order) / 2;
+            i > 0 && (block = pcpu_pop(order)) != NULL; i--) {
+        atomic_store(map_entry(heapstart, block), 0);
+        buddy_free(heapstart, block);
+    }
+
+    atomic_store(entry, 0);
+    int ret = buddy_free(heapstart, ptr);
+
+    unlock_heap(heapstart);
+
+    return ret;
+}
+
+/**
+ * Drains a thread's cache when the thread exits, and gives up its owner id.
+ */
+static void destroy_cache(void* arg) {
+    tcache_t* tc = arg;
+
+    bool current = tc->generation == atomic_load(&generation);
+    if (current) {
+        drain_remote(tc);
+        flush_cache(tc);
+    }
+
+    // blocks freed to this thread while it was draining are returned to the
+    // heap, either here or by the thread that freed them
+    release_owner(tc->owner);
+    if (current && tc->owner != 0)
+        free_orphans(tc->heapstart, tc->owner);
+    tc->owner = 0;
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, destroy_cache);
+
+    for (uint16_t owner = 0; owner < MAX_OWNERS; owner++)
+        pthread_mutex_init(&arenas[owner].lock, NULL);
+}
+
+/**
+ * Returns the calling thread's cache for a heap, emptying it first if the heap
+ * has been reinitialised since it was last used.
+ */
+static tcache_t* get_cache(void* heapstart) {
+    uint32_t current = atomic_load(&generation);
+
+    if (cache.generation != current || cache.heapstart != heapstart) {
+        // the blocks in the cache no longer exist, so just forget them
+        release_owner(cache.owner);
+        memset(&cache, 0, sizeof(cache));
+        cache.heapstart = heapstart;
+        cache.generation = current;
+
+        // make sure the cache gets drained when this thread exits
+        pthread_once(&cache_key_once, create_cache_key);
+        pthread_setspecific(cache_key, &cache);
+
+        cache.owner = claim_owner();
+        register_cache(&cache);
+    }
+
+    // the caches were turned off, so get rid of anything left in this one
+    if (max_count == 0) {
+        drain_remote(&cache);
+        flush_cache(&cache);
+        return NULL;
+    }
+
+    return &cache;
+}
+
+/**
+ * Returns whether the thread caches have been set up for a heap, in which case
+ * every malloc, free and realloc on it has to go through them.
+ */
+bool tcache_active(void* heapstart) {
+    return order_map != NULL && cached_heap == heapstart;
+}
+
+/**
+ * Forgets any thread caches and the order map, after the heap they were caching
+ * has been reinitialised.
+ */
+void tcache_reset(void) {
+    atomic_fetch_add(&generation, 1);
+
+    if (order_map != NULL)
+        munmap(order_map, order_map_size);
+
+    order_map = NULL;
+    cached_heap = NULL;
+    max_count = 0;
+    max_bytes = 0;
+    per_cpu = false;
+    pcpu_reset();
+
+    for (uint16_t owner = 0; owner < MAX_OWNERS; owner++)
+        atomic_store(&remote_lists[owner].head, NULL);
+
+    remote_frees = 0;
+    remote_drains = 0;
+    remote_max_batch = 0;
+    steals = 0;
+}
+
+/**
+ * Puts a cache of recently freed blocks of each size in front of the heap for
+ * every thread, so that most mallocs and frees by the same thread don't take
+ * the heap's lock or search its information. Each thread's cache holds at most
+ * max_count blocks of each size and max_bytes bytes in total, and is flushed
+ * back to the heap when the thread exits. A thread whose cache is empty when
+ * the heap has run out takes a block from the cache of whichever thread has the
+ * most to spare. Cached blocks still show as allocated in virtual_info. Should
+ * be called before other threads use the heap. Passing 0 for max_count turns
+ * the caches off again, with each thread flushing its cache on its next call.
+ * Returns 0 if successful, 1 if not.
+ */
+int virtual_tcache_enable(void* heapstart, uint32_t count, uint32_t bytes) {
+    // the lock-free engine has no lock to avoid, and the background worker
+    // already keeps blocks ready
+    if (heap_engine(heapstart) != ENGINE_BUDDY || worker_active(heapstart)
+            || deferred_active(heapstart) || scope_active(heapstart)
+            || tags_active(heapstart))
+        return 1;
+
+    if (!tcache_active(heapstart)) {
+        uint8_t heap_size = *(uint8_t*) heapstart;
+        uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+        // fresh anonymous pages are zeroed, i.e. every entry is unknown
+        size_t size = sizeof(uint16_t)
+                      << (heap_size - MIN(heap_size, min_size));
+        void* map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            return 1;
+
+        order_map = map;
+        order_map_size = size;
+        cached_heap = heapstart;
+    }
+
+    if (per_cpu) {
+        per_cpu = false;
+        flush_cpus(heapstart);
+        pcpu_reset();
+    }
+
+    max_count = count;
+    max_bytes = bytes;
+
+    return 0;
+}
+
+/**
+ * Like virtual_tcache_enable, but with a cache for every CPU instead of every
+ * thread, so that threads which sit idle don't hold on to any blocks. Each
+ * CPU's cache holds at most max_count blocks of each size, and at most max_bytes
+ * bytes of each size. The caches are updated inside restartable sequences,
+ * which the kernel restarts if the thread is preempted or moved to another CPU
+ * part way through, so they need no atomic operations. Threads that can't use
+ * restartable sequences get their own cache as with virtual_tcache_enable.
+ * Turning the caches off or back to per-thread caches returns the blocks in
+ * every CPU's cache to the heap at once, so no other thread may be using the
+ * heap at the time. Returns 0 if successful, 1 if not.
+ */
+int virtual_pcpu_enable(void* heapstart, uint32_t count, uint32_t bytes) {
+    if (virtual_tcache_enable(heapstart, count, bytes))
+        return 1;
+
+    // if restartable sequences aren't available, every thread falls back to
+    // the per-thread caches that are already on
+    per_cpu = pcpu_init(count, bytes) == 0;
+
+    return 0;
+}
+
+/**
+ * Returns every block in the calling thread's cache to the heap, including
+ * blocks other threads have freed back to it, as well as every block in the
+ * cache of the CPU it is running on.
+ */
+void virtual_tcache_flush(void* heapstart) {
+    if (tcache_active(heapstart) && cache.heapstart == heapstart
+            && cache.generation == atomic_load(&generation)) {
+        drain_remote(&cache);
+        flush_cache(&cache);
+    }
+
+    if (tcache_active(heapstart) && use_cpu_cache()) {
+        lock_heap(heapstart);
+
+        for (uint8_t order = 0; order < PCPU_ORDERS; order++) {
+            void* block;
+            while ((block = pcpu_pop(order)) != NULL) {
+                atomic_store(map_entry(heapstart, block), 0);
+                buddy_free(heapstart, block);
+            }
+        }
+
+        unlock_heap(heapstart);
+    }
+}
+
+/**
+ * Fills in statistics about blocks freed by a thread other than the one whose
+ * cache they came from, which are counted as their owner collects them, and
+ * about blocks stolen from another thread's cache.
+ */
+void virtual_remote_stats(void* heapstart, remote_stats_t* stats) {
+    stats->remote_frees = atomic_load(&remote_frees);
+    stats->drains = atomic_load(&remote_drains);
+    stats->max_batch = atomic_load(&remote_max_batch);
+    stats->steals = atomic_load(&steals);
+}
+
+/**
+ * Allocates a block through the calling thread's cache. A block of the right
+ * order is taken from the cache if there is one, and otherwise the cache is
+ * refilled with a batch of blocks from the shared heap under a single lock.
+ * Blocks other threads have freed back to this thread are collected first.
+ */
+void* tcache_malloc(void* heapstart, uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (size > 1 << heap_size)
+        return NULL;
+
+    uint8_t order = MAX(min_size, log_2(size));
+    if (order < TCACHE_ORDERS && use_cpu_cache())
+        return cpu_malloc(heapstart, size, order);
+
+    tcache_t* tc = get_cache(heapstart);
+
+    if (tc == NULL || order < TCACHE_MIN_SIZE || order >= TCACHE_ORDERS) {
+        // the block can't come from a cache, so it isn't recorded either
+        lock_heap(heapstart);
+        void* block = buddy_malloc(heapstart, size);
+        unlock_heap(heapstart);
+
+        return block;
+    }
+
+    if (tc->owner != 0 && atomic_load_explicit(&remote_lists[tc->owner].head,
+                                               memory_order_relaxed) != NULL)
+        drain_remote(tc);
+
+    void* block = pop_block(tc, order);
+    if (block != NULL) {
+        atomic_store_explicit(map_entry(heapstart, block),
+                              ENTRY(tc->owner, BLOCK_IN_USE, order),
+                              memory_order_relaxed);
+        return block;
+    }
+
+    // the cache is empty, so fetch up to half its capacity at once. only the
+    // first block is handed out, the rest are kept for later
+    uint32_t batch = MAX(1, max_count / 2);
+    if (max_bytes > tc->bytes)
+        batch = MIN(batch, 1 + ((max_bytes - tc->bytes) >> order));
+    else
+        batch = 1;
+
+    lock_heap(heapstart);
+
+    block = buddy_malloc(heapstart, size);
+    if (block == NULL) {
+        // the heap has run out, but other threads may be sitting on free blocks
+        uint8_t stolen;
+        block = steal_block(tc, order, &stolen);
+
+        if (block != NULL && stolen != order) {
+            // too big, so give it back to the heap to be split
+            atomic_store(map_entry(heapstart, block), 0);
+            buddy_free(heapstart, block);
+            block = buddy_malloc(heapstart, size);
+        }
+
+        batch = 1;
+    }
+
+    if (block != NULL)
+        atomic_store_explicit(map_entry(heapstart, block),
+                              ENTRY(tc->owner, BLOCK_IN_USE, order),
+                              memory_order_relaxed);
+
+    for (uint32_t i = 1; block != NULL && i < batch; i++) {
+        void* extra = buddy_malloc(heapstart, size);
+        if (extra == NULL)
+            break;
+
+        push_block(tc, extra, order);
+    }
+
+    unlock_heap(heapstart);
+
+    return block;
+}
+
+/**
+ * Frees a block into the calling thread's cache, without touching the shared
+ * heap. If the block came from another thread's cache, it is pushed onto that
+ * thread's list of remote frees with a single atomic operation instead. If the
+ * cache is over its limits, part of it is flushed back to the shared heap under
+ * a single lock first. Returns 0 if successful, 1 if not.
+ */
+int tcache_free(void* heapstart, void* ptr) {
+    _Atomic uint16_t* entry = map_entry(heapstart, ptr);
+    uint16_t state = entry == NULL ? 0 : atomic_load(entry);
+
+    // the block is already sitting in a cache
+    if (ENTRY_STATE(state) == BLOCK_CACHED)
+        return 1;
+
+    bool cpu = use_cpu_cache();
+    tcache_t* tc = cpu ? NULL : get_cache(heapstart);
+
+    if (ENTRY_STATE(state) == BLOCK_UNKNOWN || (tc == NULL && !cpu)) {
+        // the block didn't come from a cache (or the caches are off), so the
+        // heap information has to be searched for it
+        if (entry != NULL)
+            atomic_store(entry, 0);
+
+        lock_heap(heapstart);
+        int ret = buddy_free(heapstart, ptr);
+        unlock_heap(heapstart);
+
+        return ret;
+    }
+
+    uint8_t order = ENTRY_ORDER(state);
+    uint16_t owner = ENTRY_OWNER(state);
+
+    if (cpu && owner == 0)
+        return cpu_free(heapstart, ptr, order);
+
+    if (owner != 0 && (cpu || owner != tc->owner)) {
+        push_remote(entry, ptr, owner, order);
+
+        // the owner may have exited since handing the block out, in which case
+        // nobody would collect it. either this check sees the id released, or
+        // the exiting thread sees the block when it releases the id
+        if (!owner_held(owner))
+            free_orphans(heapstart, owner);
+        return 0;
+    }
+
+    // make room by flushing half of the blocks of this order
+    if (!has_room(tc, order))
+        flush_bin(tc, order, tc->counts[order] / 2);
+
+    if (!has_room(tc, order)) {
+        // the rest of the cache is full, so this block can't stay either
+        atomic_store(entry, 0);
+
+        lock_heap(heapstart);
+        int ret = buddy_free(heapstart, ptr);
+        unlock_heap(heapstart);
+
+        return ret;
+    }
+
+    push_block(tc, ptr, order);
+    return 0;
+}
+
+/**
+ * Reallocates a block on the shared heap, keeping the order map up to date.
+ */
+void* tcache_realloc(void* heapstart, void* ptr, uint32_t size) {
+    _Atomic uint16_t* entry = map_entry(heapstart, ptr);
+    if (entry != NULL && ENTRY_STATE(atomic_load(entry)) == BLOCK_CACHED)
+        return NULL;
+
+    lock_heap(heapstart);
+    void* new_block = buddy_realloc(heapstart, ptr, size);
+    unlock_heap(heapstart);
+
+    if (new_block == NULL)
+        return NULL;
+
+    // the block was moved through the shared heap, so it is no longer known to
+    // the caches
+    if (entry != NULL)
+        atomic_store(entry, 0);
+
+    return new_block;
+}
\ No newline at end of file
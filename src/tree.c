@@ -0,0 +1,185 @@
+#include "tree.h"
+
+// the tree is aligned so that neighbouring nodes don't straddle cache lines
+#define TREE_ALIGN 64
+
+/**
+ * Returns the start of the tree for a heap whose header has been written.
+ */
+static node_t* tree_start(void* heapstart) {
+    uintptr_t heap_end = (uintptr_t) get_blocks(heapstart)
+                         + (1 << *(uint8_t*) heapstart);
+    return (node_t*) ((heap_end + TREE_ALIGN - 1) & ~(uintptr_t) (TREE_ALIGN - 1));
+}
+
+/**
+ * Initialises a virtual heap whose information is a complete binary tree of
+ * nodes, one per potential block, stored after the heap and followed by
+ * `extra` bytes for the engine's own use. The nodes are indexed from 1 (the
+ * root), so that the children of node i are at 2i and 2i + 1. Returns the tree,
+ * or NULL if the heap could not be allocated.
+ */
+node_t* tree_init(void* heapstart, uint8_t initial_size, uint8_t min_size,
+                  engine_t engine, size_t extra) {
+    void* prog_break = virtual_sbrk(0);
+    if (prog_break == (void*) -1)
+        return NULL;
+
+    virtual_sbrk(heapstart - prog_break);  // reset heap
+
+    // the header decides where the blocks and the tree start
+    if (virtual_sbrk(2) == (void*) -1)
+        return NULL;
+    *(uint8_t*) heapstart = initial_size;
+    *((uint8_t*) heapstart + 1) = min_size | engine;
+
+    // allocate space for the padding, the heap and a node for every block that
+    // could possibly exist, with index 0 left unused
+    node_t* tree = tree_start(heapstart);
+    size_t nodes = (size_t) 2 << (initial_size - MIN(initial_size, min_size));
+    uint8_t* end = (uint8_t*) (tree + nodes) + extra;
+    if (virtual_sbrk(end - ((uint8_t*) heapstart + 2)) == (void*) -1)
+        return NULL;
+
+    // the tree engines don't track clear blocks, but the memory is used now
+    fresh_memory(prog_break, get_blocks(heapstart), end);
+
+    for (size_t i = 0; i < nodes; i++)
+        atomic_init(&tree[i], 0);
+
+    return tree;
+}
+
+/**
+ * Returns the number of levels in the tree below the root.
+ */
+uint8_t tree_depth(void* heapstart) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    return heap_size - MIN(heap_size, min_size);
+}
+
+/**
+ * Returns the tree of nodes stored after the heap.
+ */
+node_t* get_tree(void* heapstart) {
+    return tree_start(heapstart);
+}
+
+/**
+ * Returns the extra bytes stored after the tree, as requested in tree_init.
+ */
+void* tree_extra(void* heapstart) {
+    return get_tree(heapstart) + ((size_t) 2 << tree_depth(heapstart));
+}
+
+/**
+ * Returns the depth of a node in the tree, i.e. floor(log2(node)).
+ */
+uint8_t node_depth(uint32_t node) {
+    uint8_t depth = 0;
+    while (node >>= 1)
+        depth++;
+
+    return depth;
+}
+
+/**
+ * Finds the node of the allocated block starting at ptr. Returns 0 if there is
+ * no such block.
+ */
+uint32_t find_node(void* heapstart, void* ptr) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if ((uint8_t*) ptr < heap || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return 0;
+
+    uint32_t offset = (uint8_t*) ptr - heap;
+    node_t* tree = get_tree(heapstart);
+
+    // several nodes start at the same address, so search from the root
+    // downwards. a tentative claim from a failing allocation can only ever be
+    // below the real allocation, so the first whole node found is the right one
+    for (uint8_t depth = 0; depth <= tree_depth(heapstart); depth++) {
+        uint8_t size = heap_size - depth;
+        if (offset & (((uint32_t) 1 << size) - 1))
+            continue;
+
+        uint32_t node = ((uint32_t) 1 << depth) + (offset >> size);
+        uint32_t state = atomic_load(&tree[node]);
+        if (state == NODE_FULL)
+            return node;
+        if (state == 0)
+            // nothing below this node is allocated
+            return 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the blocks below a node from left to right.
+ */
+static void print_node(node_t* tree, uint32_t node, uint8_t size,
+                       uint8_t levels) {
+    uint32_t state = atomic_load(&tree[node]);
+
+    if (state == NODE_FULL || state == 0 || levels == 0) {
+        printf(state == NODE_FULL ? "allocated" : "free");
+        printf(" %d\n", 1 << size);
+        return;
+    }
+
+    print_node(tree, node << 1, size - 1, levels - 1);
+    print_node(tree, (node << 1) + 1, size - 1, levels - 1);
+}
+
+/**
+ * Finds the node of the allocated block starting at ptr, given a size that was
+ * allocated there. The node follows straight from the block's order and offset,
+ * so no other nodes are looked at. Returns 0 if there is no such block of that
+ * order.
+ */
+uint32_t sized_node(void* heapstart, void* ptr, uint32_t size) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if (size == 0 || size > 1 << heap_size || (uint8_t*) ptr < heap
+            || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return 0;
+
+    uint8_t order = MIN(heap_size, MAX(min_size, log_2(size)));
+    uint32_t offset = (uint8_t*) ptr - heap;
+    if (offset & (((uint32_t) 1 << order) - 1))
+        return 0;
+
+    uint32_t node = ((uint32_t) 1 << (heap_size - order)) + (offset >> order);
+    if (atomic_load(&get_tree(heapstart)[node]) != NODE_FULL)
+        return 0;
+
+    return node;
+}
+
+/**
+ * Returns the size of the allocated block starting at ptr on a tree heap, or 0
+ * if there is no such block.
+ */
+uint32_t tree_usable_size(void* heapstart, void* ptr) {
+    uint32_t node = find_node(heapstart, ptr);
+    if (node == 0)
+        return 0;
+
+    return (uint32_t) 1 << (*(uint8_t*) heapstart - node_depth(node));
+}
+
+/**
+ * Prints the blocks of a tree heap in the same format as virtual_info. A node
+ * with nothing allocated below it is printed as a single free block. The
+ * output is only consistent if no other thread is modifying the heap.
+ */
+void tree_info(void* heapstart) {
+    print_node(get_tree(heapstart), 1, *(uint8_t*) heapstart,
+               tree_depth(heapstart));
+}
\ No newline at end of file
@@ -1,4 +1,16 @@
 #include "virtual_alloc.h"
+#include "buddy.h"
+#include "deferred.h"
+#include "lockfree.h"
+#include "objcache.h"
+#include "scope.h"
+#include "subtree.h"
+#include "tags.h"
+#include "tcache.h"
+#include "tree.h"
+#include "worker.h"
+
+#include <errno.h>
 
 /**
  * Initialises the virtual heap with size 2^initial_size bytes, with minimum
@@ -6,28 +18,68 @@
  * enough space for the heap and for information about the heap.
  */
 void init_allocator(void* heapstart, uint8_t initial_size, uint8_t min_size) {
+    init_allocator_engine(heapstart, initial_size, min_size, ENGINE_BUDDY);
+}
+
+/**
+ * Initialises the virtual heap like init_allocator, but with the heap managed
+ * by the given engine. The other functions work on the heap regardless of which
+ * engine manages it.
+ */
+void init_allocator_engine(void* heapstart, uint8_t initial_size,
+                           uint8_t min_size, engine_t engine) {
 #ifdef DEBUG
     printf("INIT %d %d\n", initial_size, min_size);
 #endif
 
-    // we store the first block (full heap size) and 2 bytes for heap size and
-    // minimum block size
-    void* prog_break = virtual_sbrk(0);
-    if (prog_break == (void*) -1)
-        return;
+    // the minimum size shares its byte with the engine. no heap can have
+    // blocks this large anyway, so clamping doesn't change its behaviour
+    min_size = MIN(min_size, MIN_SIZE_MASK);
+
+    // any blocks cached from the previous heap are gone
+    tcache_reset();
+    worker_reset();
+    deferred_reset();
+    scope_reset();
+    tags_reset();
+    objcache_reset();
+
+    if (engine == ENGINE_LOCKFREE)
+        lockfree_init(heapstart, initial_size, min_size);
+    else if (engine == ENGINE_SUBTREE)
+        subtree_init(heapstart, initial_size, min_size);
+    else
+        buddy_init(heapstart, initial_size, min_size);
+}
 
-    virtual_sbrk(heapstart - prog_break);  // reset heap
-    // allocate space for heap, as well as 1 byte for first block information,
-    // and storing initial_size and min_size
-    virtual_sbrk((1 << initial_size) + 1 + 2);
+/**
+ * Initialises the virtual heap like init_allocator, managed by the buddy engine
+ * and picking the free blocks to allocate from with the given placement policy
+ * rather than always the leftmost. The policy lasts until the heap is next
+ * initialised.
+ */
+void init_allocator_placement(void* heapstart, uint8_t initial_size,
+                              uint8_t min_size, placement_t placement) {
+    init_allocator_engine(heapstart, initial_size, min_size, ENGINE_BUDDY);
+    set_placement(placement);
+}
 
-    // store information about first block (free, full heap size)
-    block_t* info_start = (block_t*) heapstart + 2 + (1 << initial_size);
-    *info_start = (block_t) {false, initial_size};
+/**
+ * Tries to free the space a failed allocation may need, which can be tied up in
+ * empty slabs of the object caches on the heap, or in frees queued by
+ * virtual_defer_frees that haven't been done yet. Returns whether the
+ * allocation is worth trying again.
+ */
+static bool reclaim_space(void* heapstart) {
+    bool reaped = objcache_reap_heap(heapstart) != 0;
+
+    // with frees deferred, the reaped slabs are only queued along with the rest
+    if (deferred_active(heapstart)) {
+        virtual_flush_frees(heapstart);
+        return true;
+    }
 
-    // store basic information about heap
-    *(uint8_t*) heapstart = initial_size;
-    *((uint8_t*) heapstart + 1) = min_size;
+    return reaped;
 }
 
 /**
@@ -41,75 +93,387 @@ void* virtual_malloc(void* heapstart, uint32_t size) {
     printf("ALLOC %d\n", size);
 #endif
 
-    if (size == 0)
-        return NULL;
+    if (heap_engine(heapstart) == ENGINE_LOCKFREE)
+        return lockfree_malloc(heapstart, size);
 
-    uint8_t heap_size = *(uint8_t*) heapstart;
-    uint8_t min_size = *((uint8_t*) heapstart + 1);
+    if (heap_engine(heapstart) == ENGINE_SUBTREE)
+        return subtree_malloc(heapstart, size);
 
-    if (size > 1 << heap_size)
-        return NULL;
+    if (worker_active(heapstart))
+        return worker_malloc(heapstart, size);
 
-    // block sizes have to be a power of 2 so take a log, however it also needs
-    // to be at least min_size
-    uint8_t needed_size = MAX(min_size, log_2(size));
+    if (tcache_active(heapstart))
+        return tcache_malloc(heapstart, size);
 
-    // keep track of pointer in heap for the block to allocate
-    uint8_t* ptr = (uint8_t*) heapstart + 2;
-    // find the leftmost block of the smallest size in the heap
-    block_t* block = smallest_block(heapstart, needed_size, &ptr);
-    if (block == NULL)
-        // no valid unallocated block was found
-        return NULL;
+    if (deferred_active(heapstart))
+        return deferred_malloc(heapstart, size);
+
+    lock_heap(heapstart);
+    void* block = scope_record(heapstart, buddy_malloc(heapstart, size));
+    unlock_heap(heapstart);
+
+    if (block == NULL && reclaim_space(heapstart)) {
+        lock_heap(heapstart);
+        block = scope_record(heapstart, buddy_malloc(heapstart, size));
+        unlock_heap(heapstart);
+    }
+
+    return block;
+}
+
+/**
+ * Allocates a block like virtual_malloc, with a hint of how long it will live.
+ * On a heap managed by the buddy engine, short-lived blocks are taken from the
+ * first free block big enough, at its start, and long-lived ones from the last,
+ * at its end, whatever the sizes of the free blocks. The long-lived blocks then
+ * gather at the high end of the heap instead of pinning buddies among the
+ * short-lived ones, which leaves the churn at the low end free to merge back
+ * into large blocks. Like virtual_aligned_alloc, this always takes the heap's
+ * lock. A heap managed by a tree engine places blocks as virtual_malloc does.
+ * Returns NULL if allocation is not possible.
+ */
+void* virtual_malloc_lifetime(void* heapstart, uint32_t size,
+                              lifetime_t lifetime) {
+#ifdef DEBUG
+    printf("ALLOC_LIFETIME %u %d\n", size, lifetime);
+#endif
+
+    if (heap_engine(heapstart) != ENGINE_BUDDY)
+        return virtual_malloc(heapstart, size);
+
+    bool high = lifetime == LIFETIME_LONG;
+
+    lock_heap(heapstart);
+    void* block = scope_record(heapstart,
+                               buddy_malloc_end(heapstart, size, high));
+    unlock_heap(heapstart);
+
+    if (block == NULL && reclaim_space(heapstart)) {
+        lock_heap(heapstart);
+        block = scope_record(heapstart,
+                             buddy_malloc_end(heapstart, size, high));
+        unlock_heap(heapstart);
+    }
+
+    return block;
+}
+
+/**
+ * Allocates up to count blocks of size bytes each from the heap in one search,
+ * recording them in the current scope. Returns how many blocks were allocated.
+ */
+static uint32_t malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                             void** out) {
+    if (deferred_active(heapstart))
+        return deferred_malloc_batch(heapstart, size, count, out);
+
+    lock_heap(heapstart);
+    uint32_t delivered = buddy_malloc_batch(heapstart, size, count, out);
+    for (uint32_t i = 0; i < delivered; i++) {
+        if (scope_record(heapstart, out[i]) == NULL) {
+            // the rest of the batch can't be recorded either
+            for (uint32_t j = i + 1; j < delivered; j++)
+                buddy_free(heapstart, out[j]);
+            delivered = i;
+        }
+    }
+    unlock_heap(heapstart);
+
+    return delivered;
+}
+
+/**
+ * Allocates up to count blocks of size bytes each, writing pointers to them to
+ * out. On a heap managed by the buddy engine without the thread caches or the
+ * background worker in front of it, the heap is searched once and a single free
+ * block is split into all of the blocks at once, so that they are next to each
+ * other in the heap where possible. Otherwise each block is allocated as by
+ * virtual_malloc. Returns how many blocks were allocated, which is less than
+ * count if the heap ran out.
+ */
+uint32_t virtual_malloc_batch(void* heapstart, uint32_t size, uint32_t count,
+                              void** out) {
+#ifdef DEBUG
+    printf("ALLOC_BATCH %u %u\n", size, count);
+#endif
+
+    if (heap_engine(heapstart) != ENGINE_BUDDY || worker_active(heapstart)
+            || tcache_active(heapstart)) {
+        // blocks may come from caches or reserves, so allocate them one by one
+        uint32_t delivered = 0;
+        for (; delivered < count; delivered++) {
+            out[delivered] = virtual_malloc(heapstart, size);
+            if (out[delivered] == NULL)
+                break;
+        }
+
+        return delivered;
+    }
 
-    // if the smallest valid block size is larger than what we need, we will
-    // need to split blocks in half until we reach that size. this requires us
-    // to expand the virtual heap to fit the information for the extra blocks
-    uint8_t diff = block->size - needed_size;
-    if (virtual_sbrk(diff) == (void*) -1)
+    uint32_t delivered = malloc_batch(heapstart, size, count, out);
+    if (delivered < count && reclaim_space(heapstart))
+        delivered += malloc_batch(heapstart, size, count - delivered,
+                                  out + delivered);
+
+    return delivered;
+}
+
+/**
+ * Emulates calloc on the virtual heap, allocating a block for count elements of
+ * size bytes each that holds nothing but zeroes. On a heap managed by the buddy
+ * engine, the heap keeps track of free blocks known to be clear, either because
+ * virtual_sbrk has only just handed them out or because they were cleared ahead
+ * of time by the background worker, and such blocks aren't cleared again. Large
+ * blocks are cleared with non-temporal stores. Returns NULL if count * size
+ * overflows or if allocation is not possible.
+ */
+void* virtual_calloc(void* heapstart, uint32_t count, uint32_t size) {
+#ifdef DEBUG
+    printf("CALLOC %u %u\n", count, size);
+#endif
+
+    uint64_t total = (uint64_t) count * size;
+    if (total > UINT32_MAX)
         return NULL;
 
-    uint8_t* prog_break = (uint8_t*) virtual_sbrk(0);
-    if (prog_break == (uint8_t*) -1)
+    if (worker_active(heapstart))
+        return worker_calloc(heapstart, total);
+
+    if (heap_engine(heapstart) != ENGINE_BUDDY || tcache_active(heapstart)) {
+        // cached blocks and the tree engines don't know what their blocks hold
+        void* block = virtual_malloc(heapstart, total);
+        if (block != NULL)
+            zero_block(block, total);
+
+        return block;
+    }
+
+    bool zeroed;
+    lock_heap(heapstart);
+    void* block = scope_record(heapstart,
+                               buddy_malloc_zeroed(heapstart, total, &zeroed));
+    unlock_heap(heapstart);
+
+    if (block == NULL && reclaim_space(heapstart)) {
+        lock_heap(heapstart);
+        block = scope_record(heapstart,
+                             buddy_malloc_zeroed(heapstart, total, &zeroed));
+        unlock_heap(heapstart);
+    }
+
+    if (block != NULL && !zeroed)
+        zero_block(block, total);
+
+    return block;
+}
+
+/**
+ * Allocates a block of at least size bytes whose address is a multiple of
+ * alignment, which must be a power of two. Blocks are already aligned to their
+ * own size from the start of the heap's blocks, so on a heap managed by the
+ * buddy engine the block is taken from an aligned position inside the smallest
+ * free block that has one, and is only as big as for virtual_malloc. This costs
+ * the same single search of the heap as virtual_malloc, but always takes the
+ * heap's lock, bypassing the thread caches and the background worker's
+ * reserves. The tree engines instead allocate a block of at least the
+ * alignment, which is aligned if the start of the heap's blocks is. Returns NULL
+ * if no aligned block could be allocated.
+ */
+void* virtual_aligned_alloc(void* heapstart, uint32_t alignment,
+                            uint32_t size) {
+#ifdef DEBUG
+    printf("ALIGNED_ALLOC %u %u\n", alignment, size);
+#endif
+
+    if (alignment == 0 || alignment & (alignment - 1))
         return NULL;
 
-    // if we need to split, move everything over to fit the extra blocks
-    shift(block + 1, prog_break, diff);
+    if (heap_engine(heapstart) != ENGINE_BUDDY) {
+        // a block at least as big as the alignment is aligned relative to the
+        // start of the heap's blocks, which is all the tree can offer
+        void* block = virtual_malloc(heapstart, MAX(size, alignment));
+        if (block != NULL && (uintptr_t) block & (alignment - 1)) {
+            virtual_free(heapstart, block);
+            return NULL;
+        }
+
+        return block;
+    }
+
+    lock_heap(heapstart);
+    void* block = scope_record(heapstart,
+                               buddy_aligned_alloc(heapstart, alignment, size));
+    unlock_heap(heapstart);
+
+    if (block == NULL && reclaim_space(heapstart)) {
+        lock_heap(heapstart);
+        block = scope_record(heapstart,
+                             buddy_aligned_alloc(heapstart, alignment, size));
+        unlock_heap(heapstart);
+    }
+
+    return block;
+}
+
+/**
+ * Allocates a block of at least size bytes as close as possible to hint, such as
+ * a block that will point to the new one, so that traversals touch fewer cache
+ * lines and pages. On a heap managed by the buddy engine, the block goes in the
+ * smallest subtree of the heap containing the hint that has a free block big
+ * enough, as near the hint as that free block allows, and only as big as for
+ * virtual_malloc. Like virtual_aligned_alloc, this always takes the heap's
+ * lock. A hint outside the heap, or a heap managed by a tree engine, gets the
+ * placement of virtual_malloc. Returns NULL if allocation is not possible.
+ */
+void* virtual_malloc_near(void* heapstart, uint32_t size, void* hint) {
+#ifdef DEBUG
+    printf("ALLOC_NEAR %u %p\n", size, hint);
+#endif
+
+    if (heap_engine(heapstart) != ENGINE_BUDDY)
+        return virtual_malloc(heapstart, size);
 
-    // split blocks and create extra unallocated blocks if needed
-    for (uint8_t i = diff; i > 0; i--) {
-        block->size--;
-        *(block + i) = (block_t) {false, block->size};
+    lock_heap(heapstart);
+    void* block = scope_record(heapstart,
+                               buddy_malloc_near(heapstart, size, hint));
+    unlock_heap(heapstart);
+
+    if (block == NULL && reclaim_space(heapstart)) {
+        lock_heap(heapstart);
+        block = scope_record(heapstart,
+                             buddy_malloc_near(heapstart, size, hint));
+        unlock_heap(heapstart);
     }
 
-    block->allocated = true;
+    return block;
+}
 
-    return ptr;
+/**
+ * Like virtual_aligned_alloc, but in the style of posix_memalign: the block is
+ * written to memptr, and the return value is 0 if successful, EINVAL if the
+ * alignment isn't a power of two multiple of sizeof(void*), or ENOMEM if there
+ * is no aligned block available. A size of 0 gives a NULL block.
+ */
+int virtual_posix_memalign(void* heapstart, void** memptr,
+                           uint32_t alignment, uint32_t size) {
+    if (alignment < sizeof(void*) || alignment & (alignment - 1))
+        return EINVAL;
+
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+
+    void* block = virtual_aligned_alloc(heapstart, alignment, size);
+    if (block == NULL)
+        return ENOMEM;
+
+    *memptr = block;
+    return 0;
 }
 
 /**
  * Emulates free on the virtual heap according to the buddy algorithm.
  * Unallocates a block pointed to by ptr and merges it with its buddy if the
  * buddy is also unallocated. Repeats the process until no longer possible.
- * Returns 0 if successful, 1 if not.
+ * Returns 0 if successful, 1 if not. While frees are deferred by
+ * virtual_defer_frees, only a pointer outside the heap, not aligned to the
+ * smallest block size or already queued is reported as an error.
  */
 int virtual_free(void* heapstart, void* ptr) {
 #ifdef DEBUG
-    printf("FREE %lu\n", (size_t)((uint8_t*) ptr - (uint8_t*) heapstart) - 2);
+    printf("FREE %lu\n", (size_t)((uint8_t*) ptr - get_blocks(heapstart)));
+#endif
+
+    if (heap_engine(heapstart) == ENGINE_LOCKFREE)
+        return lockfree_free(heapstart, ptr);
+
+    if (heap_engine(heapstart) == ENGINE_SUBTREE)
+        return subtree_free(heapstart, ptr);
+
+    if (worker_active(heapstart))
+        return worker_free(heapstart, ptr);
+
+    if (tcache_active(heapstart))
+        return tcache_free(heapstart, ptr);
+
+    if (deferred_active(heapstart))
+        return deferred_free(heapstart, ptr);
+
+    lock_heap(heapstart);
+    int ret = buddy_free(heapstart, ptr);
+    if (ret == 0)
+        tag_forget(heapstart, ptr);
+    unlock_heap(heapstart);
+
+    return ret;
+}
+
+/**
+ * Frees a block like virtual_free, given the size that was asked for when it was
+ * allocated, or any other size that would give a block of the same size. The
+ * size gives the block's order, so a tree heap goes straight to the block's
+ * node, and a pointer that isn't aligned to the order is refused without
+ * searching. The size must match the block unless the block is only cached or
+ * queued by the thread caches, the background worker or virtual_defer_frees, in
+ * which case it isn't checked. Returns 0 if successful, 1 if not.
+ */
+int virtual_free_sized(void* heapstart, void* ptr, uint32_t size) {
+#ifdef DEBUG
+    printf("FREE_SIZED %lu %u\n",
+           (size_t)((uint8_t*) ptr - get_blocks(heapstart)), size);
+#endif
+
+    if (heap_engine(heapstart) == ENGINE_LOCKFREE)
+        return lockfree_free_sized(heapstart, ptr, size);
+
+    if (heap_engine(heapstart) == ENGINE_SUBTREE)
+        return subtree_free_sized(heapstart, ptr, size);
+
+    if (worker_active(heapstart) || tcache_active(heapstart)
+            || deferred_active(heapstart))
+        return virtual_free(heapstart, ptr);
+
+    lock_heap(heapstart);
+    int ret = buddy_free_sized(heapstart, ptr, size);
+    if (ret == 0)
+        tag_forget(heapstart, ptr);
+    unlock_heap(heapstart);
+
+    return ret;
+}
+
+/**
+ * Frees count blocks at once. On a heap managed by the buddy engine without the
+ * thread caches or the background worker in front of it, the pointers are
+ * sorted by address (in place) and the blocks are freed and merged in a single
+ * pass over the heap information, so that the heap is only searched and shrunk
+ * once. In that case nothing is freed if any pointer isn't an allocated block or
+ * appears twice. Otherwise each block is freed as by virtual_free. Returns 0 if
+ * successful, 1 if not.
+ */
+int virtual_free_batch(void* heapstart, void** ptrs, uint32_t count) {
+#ifdef DEBUG
+    printf("FREE_BATCH %u\n", count);
 #endif
 
-    // find the information about the block reference by ptr
-    block_t* block = get_block_info(heapstart, ptr);
-    if (block == NULL || !block->allocated)
-        // can't free this block, not found or already free
-        return 1;
+    if (heap_engine(heapstart) != ENGINE_BUDDY || worker_active(heapstart)
+            || tcache_active(heapstart)) {
+        // blocks may be cached or queued elsewhere, so free them one by one
+        int ret = 0;
+        for (uint32_t i = 0; i < count; i++)
+            ret |= virtual_free(heapstart, ptrs[i]);
 
-    // free the block and merge if needed according to the buddy algorithm
-    block->allocated = false;
-    int ret = merge_blocks(heapstart, block, ptr);
-    if (ret)
-        // reset if non-zero (error)
-        block->allocated = true;
+        return ret;
+    }
+
+    lock_heap(heapstart);
+    int ret = buddy_free_batch(heapstart, ptrs, count);
+    if (ret == 0 && tags_active(heapstart)) {
+        for (uint32_t i = 0; i < count; i++)
+            tag_forget(heapstart, ptrs[i]);
+    }
+    unlock_heap(heapstart);
 
     return ret;
 }
@@ -124,9 +488,15 @@ int virtual_free(void* heapstart, void* ptr) {
  */
 void* virtual_realloc(void* heapstart, void* ptr, uint32_t size) {
 #ifdef DEBUG
-    printf("REALLOC %lu %u\n", (uint8_t*) ptr - (uint8_t*) heapstart - 2, size);
+    printf("REALLOC %lu %u\n", (uint8_t*) ptr - get_blocks(heapstart), size);
 #endif
 
+    if (heap_engine(heapstart) == ENGINE_LOCKFREE)
+        return lockfree_realloc(heapstart, ptr, size);
+
+    if (heap_engine(heapstart) == ENGINE_SUBTREE)
+        return subtree_realloc(heapstart, ptr, size);
+
     if (size == 0) {
         // if size is 0, behave as free
         virtual_free(heapstart, ptr);
@@ -137,62 +507,34 @@ void* virtual_realloc(void* heapstart, void* ptr, uint32_t size) {
         // if block pointer is NULL, behave as malloc
         return virtual_malloc(heapstart, size);
 
-    size_t heap_size = 1 << *(uint8_t*) heapstart;
-
-    if (size > heap_size)
-        return NULL;
-
-    // get information about this block
-    block_t* block = get_block_info(heapstart, ptr);
-    if (block == NULL || !block->allocated)
-        return NULL;
-
-    uint8_t og_size = block->size;
-
-    uint8_t* prog_break = (uint8_t*) virtual_sbrk(0);
-    if (prog_break == (uint8_t*) -1)
-        return NULL;
-
-    uint8_t* info_start = (uint8_t*) heapstart + 2 + heap_size;
-    size_t info_size = prog_break - info_start;
+    if (worker_active(heapstart))
+        return worker_realloc(heapstart, ptr, size);
 
-    // expand the virtual heap so that we can copy heap info for backup
-    if (virtual_sbrk(info_size) == (void*) -1)
-        return NULL;
-
-    // backup the existing heap info
-    memmove(prog_break, info_start, info_size);
-
-    // free the block to be reallocated
-    if (virtual_free(heapstart, ptr))
-        return NULL;
-
-    // reallocate the block
-    void* new_block = virtual_malloc(heapstart, size);
+    if (tcache_active(heapstart))
+        return tcache_realloc(heapstart, ptr, size);
 
-    uint8_t* new_prog_break = (uint8_t*) virtual_sbrk(0);
-    if (new_prog_break == (uint8_t*) -1)
-        return NULL;
-
-    // since free/malloc can change the size of the heap, we should recompute
-    // where the backup is stored
-    uint8_t* backup_heap = new_prog_break - info_size;
+    lock_heap(heapstart);
+    void* new_block = buddy_realloc(heapstart, ptr, size);
+    scope_moved(heapstart, ptr, new_block);
+    tag_moved(heapstart, ptr, new_block, size);
+    unlock_heap(heapstart);
 
-    // if reallocating failed, then restore the backup
-    if (new_block == NULL) {
-        memmove(info_start, backup_heap, info_size);
-        virtual_sbrk(prog_break - new_prog_break);
-        return NULL;
-    }
+    return new_block;
+}
 
-    // otherwise if reallocation succeeded, copy the data into the new block
-    memmove(new_block, ptr, MIN(1 << og_size, size));
+/**
+ * Returns how many bytes can be used in the allocated block starting at ptr,
+ * i.e. the power of two it was rounded up to, or 0 if there is no such block.
+ */
+uint32_t virtual_usable_size(void* heapstart, void* ptr) {
+    if (heap_engine(heapstart) != ENGINE_BUDDY)
+        return tree_usable_size(heapstart, ptr);
 
-    // finally, reshrink the heap, getting rid of the backup
-    if (virtual_sbrk(-info_size) == (void*) -1)
-        return NULL;
+    lock_heap(heapstart);
+    uint32_t size = buddy_usable_size(heapstart, ptr);
+    unlock_heap(heapstart);
 
-    return new_block;
+    return size;
 }
 
 /**
@@ -205,11 +547,17 @@ void virtual_info(void* heapstart) {
     printf("INFO\n");
 #endif
 
-    size_t heap_size = 1 << *(uint8_t*) heapstart;
-    block_t* block = (block_t*) heapstart + 2 + heap_size;
+    if (heap_engine(heapstart) == ENGINE_LOCKFREE) {
+        lockfree_info(heapstart);
+        return;
+    }
 
-    for (size_t pos = 0; pos < heap_size; pos += 1 << block->size, block++) {
-        printf(block->allocated ? "allocated" : "free");
-        printf(" %d\n", 1 << block->size);
+    if (heap_engine(heapstart) == ENGINE_SUBTREE) {
+        subtree_info(heapstart);
+        return;
     }
+
+    lock_heap(heapstart);
+    buddy_info(heapstart);
+    unlock_heap(heapstart);
 }
\ No newline at end of file
@@ -0,0 +1,695 @@
+#include "worker.h"
+#include "buddy.h"
+#include "deferred.h"
+#include "scope.h"
+#include "tags.h"
+#include "tcache.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// blocks are linked into the reserves and the deferred frees through their
+// first bytes, so blocks smaller than a pointer can't be handled
+#define WORKER_MIN_SIZE 3
+#define WORKER_ORDERS 32
+
+// how long the worker sleeps between rounds when nobody wakes it
+#define WORKER_PERIOD_NS 1000000
+
+// the most blocks the worker frees or splits off in one go, so that it never
+// holds the heap's lock for long
+#define WORKER_BATCH 16
+
+// blocks split off ahead of time for one order. padded so that threads
+// allocating different orders don't contend on a cache line
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    void* head;
+    uint32_t count;
+    _Atomic uint32_t watermark;
+} reserve_t;
+
+static void* worker_heap;
+static pthread_t worker;
+static _Atomic bool running;
+
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static _Atomic bool wake_pending;
+static pthread_once_t reserves_once = PTHREAD_ONCE_INIT;
+
+static reserve_t reserves[WORKER_ORDERS];
+
+// blocks split off and cleared ahead of time for calloc, kept apart from the
+// reserves so that malloc doesn't use up cleared blocks
+static reserve_t zeroed[WORKER_ORDERS];
+
+// blocks freed by the foreground threads, waiting for the worker to free them
+static _Atomic(void*) deferred;
+
+// how many drains are still freeing blocks they have taken off the list, so
+// that a malloc which fails knows whether waiting could help
+static _Atomic uint32_t draining;
+
+// an entry in the block map is one more than the order of a block handed out by
+// the worker, or 0 if the worker doesn't know it, plus a flag for blocks that
+// are queued to be freed or sitting in a reserve
+#define BLOCK_PARKED 0x80
+#define ENTRY(order) ((order) + 1)
+#define ENTRY_ORDER(entry) (((entry) & ~BLOCK_PARKED) - 1)
+
+// records the order and state of every block that isn't free, indexed by the
+// block's offset in units of the minimum block size. free blocks always have
+// an entry of 0. this lets a queued block go back into a reserve without
+// searching the heap information for its size, and catches a block being freed
+// twice, which would otherwise link it into the list twice and make it loop
+static _Atomic uint8_t* block_map;
+static size_t block_map_size;
+
+/**
+ * Returns the block map entry for the block starting at ptr, or NULL if ptr
+ * can't be the start of a block.
+ */
+static _Atomic uint8_t* map_entry(void* heapstart, void* ptr) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t* heap = get_blocks(heapstart);
+
+    if ((uint8_t*) ptr < heap || (uint8_t*) ptr >= heap + (1 << heap_size))
+        return NULL;
+
+    uint32_t offset = (uint8_t*) ptr - heap;
+    if (offset & ((1 << min_size) - 1))
+        return NULL;
+
+    return &block_map[offset >> min_size];
+}
+
+/**
+ * Sets the block map entry for a block the worker owns or hands out.
+ */
+static void set_entry(void* heapstart, void* block, uint8_t entry) {
+    atomic_store_explicit(map_entry(heapstart, block), entry,
+                          memory_order_relaxed);
+}
+
+/**
+ * Frees a parked block back into the heap, which has to be locked. Its entry is
+ * only cleared once it is back in the heap, so that nobody can allocate it in
+ * between.
+ */
+static void free_parked(void* heapstart, void* block) {
+    buddy_free(heapstart, block);
+    set_entry(heapstart, block, 0);
+}
+
+/**
+ * Adds a list of blocks, linked through the blocks, to a reserve.
+ */
+static void add_to_reserve(reserve_t* reserve, void* head, void* tail,
+                           uint32_t count) {
+    pthread_mutex_lock(&reserve->lock);
+    *(void**) tail = reserve->head;
+    reserve->head = head;
+    reserve->count += count;
+    pthread_mutex_unlock(&reserve->lock);
+}
+
+/**
+ * Returns whether a reserve is below its watermark.
+ */
+static bool reserve_low(reserve_t* reserve) {
+    pthread_mutex_lock(&reserve->lock);
+    bool low = reserve->count < atomic_load(&reserve->watermark);
+    pthread_mutex_unlock(&reserve->lock);
+
+    return low;
+}
+
+/**
+ * Frees every block in a list linked through the blocks, a batch at a time.
+ * Blocks of an order whose reserve is below its watermark go straight into the
+ * reserve instead of being merged, only to be split again, which doesn't need
+ * the heap's lock at all.
+ */
+static void free_list(void* heapstart, void* block) {
+    bool low[WORKER_ORDERS];
+
+    for (uint8_t order = 0; order < WORKER_ORDERS; order++)
+        low[order] = atomic_load(&reserves[order].watermark) != 0
+                     && reserve_low(&reserves[order]);
+
+    while (block != NULL) {
+        void* batch[WORKER_BATCH];
+        int count = 0;
+
+        while (block != NULL && count < WORKER_BATCH) {
+            void* next = *(void**) block;
+            uint8_t order = ENTRY_ORDER(atomic_load_explicit(
+                    map_entry(heapstart, block), memory_order_relaxed));
+
+            if (order < WORKER_ORDERS && low[order]) {
+                add_to_reserve(&reserves[order], block, block, 1);
+                low[order] = reserve_low(&reserves[order]);
+            } else {
+                batch[count++] = block;
+            }
+
+            block = next;
+        }
+
+        if (count == 0)
+            continue;
+
+        lock_heap(heapstart);
+        for (int i = 0; i < count; i++)
+            free_parked(heapstart, batch[i]);
+        unlock_heap(heapstart);
+    }
+}
+
+/**
+ * Frees every block queued by the foreground threads so far.
+ */
+static void drain_deferred(void* heapstart) {
+    atomic_fetch_add(&draining, 1);
+    free_list(heapstart, atomic_exchange(&deferred, NULL));
+    atomic_fetch_sub(&draining, 1);
+}
+
+/**
+ * Splits off enough blocks to bring a reserve of blocks of an order back up to
+ * its watermark, a batch at a time. Each batch is allocated from the heap first
+ * and only then added to the reserve, so the reserve's lock is never held for
+ * long. Blocks for the cleared reserve are cleared after the heap's lock has
+ * been let go, unless the heap knows they hold nothing but zeroes already.
+ */
+static void top_up(void* heapstart, reserve_t* pool, uint8_t order) {
+    reserve_t* reserve = &pool[order];
+    bool clear = pool == zeroed;
+    uint32_t watermark = atomic_load(&reserve->watermark);
+
+    pthread_mutex_lock(&reserve->lock);
+    uint32_t missing = watermark > reserve->count
+                       ? watermark - reserve->count : 0;
+    pthread_mutex_unlock(&reserve->lock);
+
+    while (missing > 0) {
+        void* blocks[WORKER_BATCH];
+        bool clean[WORKER_BATCH];
+        uint32_t count = 0;
+
+        lock_heap(heapstart);
+
+        for (; count < MIN(missing, WORKER_BATCH); count++) {
+            blocks[count] = buddy_malloc_zeroed(heapstart, 1 << order,
+                                                &clean[count]);
+            if (blocks[count] == NULL)
+                break;
+        }
+
+        unlock_heap(heapstart);
+
+        if (count == 0)
+            return;
+
+        void* head = NULL;
+        for (uint32_t i = 0; i < count; i++) {
+            if (clear && !clean[i])
+                zero_block(blocks[i], 1 << order);
+
+            set_entry(heapstart, blocks[i], BLOCK_PARKED | ENTRY(order));
+            *(void**) blocks[i] = head;
+            head = blocks[i];
+        }
+
+        add_to_reserve(reserve, head, blocks[0], count);
+        missing -= count;
+    }
+}
+
+/**
+ * Empties a reserve of blocks of an order back into the heap. Blocks from the
+ * cleared reserve are returned as known to hold nothing but zeroes, once the
+ * link through them has been cleared.
+ */
+static void release_reserve(void* heapstart, reserve_t* pool, uint8_t order) {
+    reserve_t* reserve = &pool[order];
+
+    pthread_mutex_lock(&reserve->lock);
+    void* block = reserve->head;
+    reserve->head = NULL;
+    reserve->count = 0;
+    pthread_mutex_unlock(&reserve->lock);
+
+    if (block == NULL)
+        return;
+
+    lock_heap(heapstart);
+
+    while (block != NULL) {
+        void* next = *(void**) block;
+        if (pool == zeroed) {
+            *(void**) block = NULL;
+            buddy_free_zeroed(heapstart, block);
+            set_entry(heapstart, block, 0);
+        } else {
+            free_parked(heapstart, block);
+        }
+        block = next;
+    }
+
+    unlock_heap(heapstart);
+}
+
+/**
+ * Wakes the worker early, e.g. because a reserve is running low. Only the first
+ * thread to ask before the worker's next round actually signals it.
+ */
+static void wake_worker(void) {
+    if (atomic_exchange(&wake_pending, true))
+        return;
+
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+/**
+ * The background worker. Each round it frees and merges the blocks queued by
+ * the foreground threads, then tops up every reserve, before sleeping until it
+ * is woken or a period has passed.
+ */
+static void* work(void* arg) {
+    void* heapstart = arg;
+
+    while (atomic_load(&running)) {
+        atomic_store(&wake_pending, false);
+        drain_deferred(heapstart);
+
+        for (uint8_t order = 0; order < WORKER_ORDERS; order++) {
+            if (atomic_load_explicit(&reserves[order].watermark,
+                                     memory_order_relaxed) != 0)
+                top_up(heapstart, reserves, order);
+            if (atomic_load_explicit(&zeroed[order].watermark,
+                                     memory_order_relaxed) != 0)
+                top_up(heapstart, zeroed, order);
+        }
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WORKER_PERIOD_NS;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&wake_lock);
+        if (atomic_load(&running) && !atomic_load(&wake_pending))
+            pthread_cond_timedwait(&wake, &wake_lock, &until);
+        pthread_mutex_unlock(&wake_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Stops and waits for the worker thread, if there is one.
+ */
+static void stop_worker(void) {
+    if (!atomic_exchange(&running, false))
+        return;
+
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(worker, NULL);
+}
+
+static void init_reserves(void) {
+    for (uint8_t order = 0; order < WORKER_ORDERS; order++) {
+        pthread_mutex_init(&reserves[order].lock, NULL);
+        pthread_mutex_init(&zeroed[order].lock, NULL);
+    }
+}
+
+/**
+ * Returns whether a background worker has been started for a heap, in which
+ * case every malloc, free and realloc on it has to go through it.
+ */
+bool worker_active(void* heapstart) {
+    return worker_heap != NULL && worker_heap == heapstart;
+}
+
+/**
+ * Stops the background worker without returning anything to the heap, after the
+ * heap it was working on has been reinitialised.
+ */
+void worker_reset(void) {
+    stop_worker();
+
+    pthread_once(&reserves_once, init_reserves);
+    for (uint8_t order = 0; order < WORKER_ORDERS; order++) {
+        reserves[order].head = NULL;
+        reserves[order].count = 0;
+        reserves[order].watermark = 0;
+        zeroed[order].head = NULL;
+        zeroed[order].count = 0;
+        zeroed[order].watermark = 0;
+    }
+
+    if (block_map != NULL)
+        munmap(block_map, block_map_size);
+
+    block_map = NULL;
+    deferred = NULL;
+    draining = 0;
+    wake_pending = false;
+    worker_heap = NULL;
+}
+
+/**
+ * Starts a background thread which takes merging and splitting off the threads
+ * using the heap. Frees are queued for the worker to do, and the worker keeps a
+ * reserve of blocks split off ahead of time for each size given to
+ * virtual_worker_reserve, so that most mallocs and frees only touch a list.
+ * Blocks waiting to be freed and blocks in a reserve show as allocated in
+ * virtual_info. Can't be used together with the thread caches, or on a heap with
+ * blocks smaller than a pointer. Should be called before other threads use the
+ * heap. Returns 0 if successful, 1 if not.
+ */
+int virtual_worker_start(void* heapstart) {
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    if (heap_engine(heapstart) != ENGINE_BUDDY || min_size < WORKER_MIN_SIZE
+            || tcache_active(heapstart) || deferred_active(heapstart)
+            || scope_active(heapstart) || tags_active(heapstart)
+            || worker_heap != NULL)
+        return 1;
+
+    pthread_once(&reserves_once, init_reserves);
+
+    // fresh anonymous pages are zeroed, i.e. no block is known
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    size_t size = (size_t) 1 << (heap_size - MIN(heap_size, min_size));
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    block_map = map;
+    block_map_size = size;
+    worker_heap = heapstart;
+    running = true;
+    if (pthread_create(&worker, NULL, work, heapstart) != 0) {
+        running = false;
+        worker_heap = NULL;
+        munmap(block_map, block_map_size);
+        block_map = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets how many blocks big enough for `size` bytes the background worker keeps
+ * split off ahead of time, and fills the reserve straight away. Passing 0 for
+ * count stops keeping any. Returns 0 if successful, 1 if not.
+ */
+int virtual_worker_reserve(void* heapstart, uint32_t size, uint32_t count) {
+    if (!worker_active(heapstart) || size == 0)
+        return 1;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t order = MAX(min_size, log_2(size));
+
+    if (size > 1 << heap_size || order >= WORKER_ORDERS)
+        return 1;
+
+    reserves[order].watermark = count;
+    if (count == 0)
+        release_reserve(heapstart, reserves, order);
+    else
+        top_up(heapstart, reserves, order);
+
+    return 0;
+}
+
+/**
+ * Sets how many blocks big enough for `size` bytes the background worker keeps
+ * split off and cleared ahead of time for virtual_calloc, and fills the reserve
+ * straight away. The blocks are cleared without holding the heap's lock, so
+ * calloc only has to clear the pointer linking the block into the reserve.
+ * Passing 0 for count stops keeping any. Returns 0 if successful, 1 if not.
+ */
+int virtual_worker_prezero(void* heapstart, uint32_t size, uint32_t count) {
+    if (!worker_active(heapstart) || size == 0)
+        return 1;
+
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t order = MAX(min_size, log_2(size));
+
+    if (size > 1 << heap_size || order >= WORKER_ORDERS)
+        return 1;
+
+    zeroed[order].watermark = count;
+    if (count == 0)
+        release_reserve(heapstart, zeroed, order);
+    else
+        top_up(heapstart, zeroed, order);
+
+    return 0;
+}
+
+/**
+ * Stops the background worker, first freeing every queued block and returning
+ * the reserves to the heap. Should be called once other threads have stopped
+ * using the heap.
+ */
+void virtual_worker_stop(void* heapstart) {
+    if (!worker_active(heapstart))
+        return;
+
+    stop_worker();
+
+    drain_deferred(heapstart);
+    for (uint8_t order = 0; order < WORKER_ORDERS; order++) {
+        reserves[order].watermark = 0;
+        release_reserve(heapstart, reserves, order);
+        zeroed[order].watermark = 0;
+        release_reserve(heapstart, zeroed, order);
+    }
+
+    munmap(block_map, block_map_size);
+    block_map = NULL;
+    worker_heap = NULL;
+}
+
+/**
+ * Takes a block big enough for size bytes from a reserve, which only takes that
+ * reserve's lock, and wakes the worker if the reserve is running low. Returns
+ * NULL if the reserve is empty.
+ */
+static void* take_from_reserve(void* heapstart, reserve_t* pool,
+                               uint32_t size) {
+    uint8_t heap_size = *(uint8_t*) heapstart;
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+    uint8_t order = MAX(min_size, log_2(size));
+
+    if (size > 1 << heap_size || order >= WORKER_ORDERS)
+        return NULL;
+
+    reserve_t* reserve = &pool[order];
+    uint32_t watermark = atomic_load_explicit(&reserve->watermark,
+                                              memory_order_relaxed);
+    if (watermark == 0)
+        return NULL;
+
+    pthread_mutex_lock(&reserve->lock);
+    void* block = reserve->head;
+    if (block != NULL) {
+        reserve->head = *(void**) block;
+        reserve->count--;
+    }
+    uint32_t count = reserve->count;
+    pthread_mutex_unlock(&reserve->lock);
+
+    if (block != NULL)
+        set_entry(heapstart, block, ENTRY(order));
+
+    if (count <= watermark / 2)
+        wake_worker();
+
+    return block;
+}
+
+/**
+ * Puts a list of blocks, linked through the blocks, back on the list of blocks
+ * waiting to be freed.
+ */
+static void requeue(void* block) {
+    if (block == NULL)
+        return;
+
+    void* tail = block;
+    while (*(void**) tail != NULL)
+        tail = *(void**) tail;
+
+    void* head = atomic_load_explicit(&deferred, memory_order_relaxed);
+    do {
+        *(void**) tail = head;
+    } while (!atomic_compare_exchange_weak(&deferred, &head, block));
+}
+
+/**
+ * Allocates a block straight from the heap, reporting whether it is known to
+ * hold nothing but zeroes. If the heap is full, the queued frees are done a
+ * batch at a time until the block fits, with the rest left for the worker.
+ * Failing that, the allocation is tried again after each batch freed by a drain
+ * already going, rather than only once that whole drain is done.
+ */
+static void* malloc_from_heap(void* heapstart, uint32_t size, bool* clean) {
+    uint8_t min_size = *((uint8_t*) heapstart + 1) & MIN_SIZE_MASK;
+
+    lock_heap(heapstart);
+    void* block = buddy_malloc_zeroed(heapstart, size, clean);
+    unlock_heap(heapstart);
+
+    if (block == NULL) {
+        // the space may be tied up in frees the worker hasn't got to yet
+        atomic_fetch_add(&draining, 1);
+        void* list = atomic_exchange(&deferred, NULL);
+
+        while (block == NULL && list != NULL) {
+            lock_heap(heapstart);
+
+            for (int i = 0; list != NULL && i < WORKER_BATCH; i++) {
+                void* next = *(void**) list;
+                free_parked(heapstart, list);
+                list = next;
+            }
+
+            block = buddy_malloc_zeroed(heapstart, size, clean);
+            unlock_heap(heapstart);
+        }
+
+        requeue(list);
+        atomic_fetch_sub(&draining, 1);
+    }
+
+    // the blocks taken by other drains are only known to be freed once there
+    // are none left going
+    while (block == NULL) {
+        bool last = atomic_load(&draining) == 0;
+
+        lock_heap(heapstart);
+        block = buddy_malloc_zeroed(heapstart, size, clean);
+        unlock_heap(heapstart);
+
+        if (last)
+            break;
+        sched_yield();
+    }
+
+    if (block != NULL)
+        set_entry(heapstart, block, ENTRY(MAX(min_size, log_2(size))));
+
+    return block;
+}
+
+/**
+ * Allocates a block from the reserve of pre-split blocks of its order, which
+ * only takes that reserve's lock. Falls back to allocating from the heap if the
+ * reserve is empty, and wakes the worker if the reserve is running low.
+ */
+void* worker_malloc(void* heapstart, uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    void* block = take_from_reserve(heapstart, reserves, size);
+    if (block != NULL)
+        return block;
+
+    bool clean;
+    return malloc_from_heap(heapstart, size, &clean);
+}
+
+/**
+ * Allocates a cleared block from the reserve of blocks cleared ahead of time
+ * for its order, which only needs the link through the block to be cleared.
+ * Falls back to allocating from the heap and clearing the block if it isn't
+ * known to be clear already.
+ */
+void* worker_calloc(void* heapstart, uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    void* block = take_from_reserve(heapstart, zeroed, size);
+    if (block != NULL) {
+        *(void**) block = NULL;
+        return block;
+    }
+
+    bool clean;
+    block = malloc_from_heap(heapstart, size, &clean);
+    if (block != NULL && !clean)
+        zero_block(block, size);
+
+    return block;
+}
+
+/**
+ * Queues a block handed out by the background worker to be freed and merged by
+ * the worker, without taking a lock. Freeing a block which is already queued or
+ * in a reserve is an error. Anything else, such as a block allocated before the
+ * worker started or a pointer into the middle of a block, is freed on the heap
+ * directly, which checks it without writing to it. Returns 0 if successful, 1
+ * if not.
+ */
+int worker_free(void* heapstart, void* ptr) {
+    _Atomic uint8_t* entry = map_entry(heapstart, ptr);
+    if (entry == NULL || atomic_load(entry) == 0) {
+        // only blocks the worker handed out are known to be safe to link
+        // through, so anything else has to be checked by the heap first
+        lock_heap(heapstart);
+        int ret = buddy_free(heapstart, ptr);
+        unlock_heap(heapstart);
+
+        return ret;
+    }
+
+    if (atomic_fetch_or(entry, BLOCK_PARKED) & BLOCK_PARKED)
+        return 1;
+
+    void* head = atomic_load_explicit(&deferred, memory_order_relaxed);
+    do {
+        *(void**) ptr = head;
+    } while (!atomic_compare_exchange_weak(&deferred, &head, ptr));
+
+    return 0;
+}
+
+/**
+ * Reallocates a block on the heap directly, unless the block is queued to be
+ * freed or in a reserve.
+ */
+void* worker_realloc(void* heapstart, void* ptr, uint32_t size) {
+    _Atomic uint8_t* entry = map_entry(heapstart, ptr);
+    if (entry != NULL && atomic_load(entry) & BLOCK_PARKED)
+        return NULL;
+
+    // the block may change size or move, so the worker no longer knows it
+    lock_heap(heapstart);
+    void* new_block = buddy_realloc(heapstart, ptr, size);
+    if (new_block != NULL && entry != NULL)
+        atomic_store(entry, 0);
+    unlock_heap(heapstart);
+
+    return new_block;
+}
\ No newline at end of file
@@ -1,15 +1,25 @@
+#define _GNU_SOURCE
 #include "virtual_alloc.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "cmocka.h"
 
 #define LINE_LENGTH 128
 #define ARR_SIZE(ARR) (sizeof(ARR) / sizeof((ARR)[0]))
 
+#define STRESS_THREADS 64
+#define STRESS_ITERATIONS 2000
+#define STRESS_LIVE 8
+
 void* virtual_heap = NULL;
 
 // pipe for testing stdout
@@ -19,6 +29,14 @@ FILE* stdout_fp;
 
 bool sbrk_should_fail = false;
 
+// blocks passed between threads in the remote free stress test
+void* handoff[STRESS_THREADS][STRESS_LIVE];
+uint32_t handoff_sizes[STRESS_THREADS][STRESS_LIVE];
+pthread_barrier_t handoff_barrier;
+
+// set once the threads changing the heap in the statistics test have finished
+atomic_bool stats_done;
+
 void* virtual_sbrk(int32_t increment) {
     if (sbrk_should_fail)
         return (void*) -1;
@@ -34,6 +52,8 @@ static void close_fp() {
 }
 
 static int setup(void** state) {
+    sbrk_should_fail = false;
+
     // create pipe for testing stdout
     pipe(pipefd);
     dup2(pipefd[1], fileno(stdout));
@@ -380,7 +400,7 @@ static void test_free_unallocated() {
     };
 
     // free on empty heap
-    int res = virtual_free(virtual_heap, (void*) ((uint8_t*) virtual_heap + 2));
+    int res = virtual_free(virtual_heap, (void*) get_blocks(virtual_heap));
     assert_int_not_equal(res, 0);
     virtual_info(virtual_heap);
     assert_stdout_equal(expected, ARR_SIZE(expected));
@@ -616,6 +636,55 @@ static void test_realloc_move_smaller() {
     assert_stdout_equal(expected, ARR_SIZE(expected));
 }
 
+static void test_realloc_grow_in_place() {
+    const char* expected[] = {
+        "allocated 256",
+    };
+
+    init_allocator(virtual_heap, 8, 2);
+    void* block = virtual_malloc(virtual_heap, 1 << 5);
+
+    for (int i = 0; i < 1 << 5; i++) {
+        ((uint8_t*) block)[i] = i;
+    }
+
+    uint8_t old_block[1 << 5];
+    memcpy(old_block, block, 1 << 5);
+
+    // the block's buddies of 32, 64 and 128 bytes are all taken in at once
+    void* new_block = virtual_realloc(virtual_heap, block, 1 << 8);
+    assert_ptr_equal(new_block, block);
+    assert_memory_equal(new_block, old_block, 1 << 5);
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_realloc_reserve() {
+    const char* expected[] = {
+        "allocated 128",
+        "allocated 128",
+    };
+
+    init_allocator(virtual_heap, 8, 2);
+    void* block = virtual_malloc(virtual_heap, 1 << 5);
+    block = virtual_realloc(virtual_heap, block, 1 << 6);
+
+    // the smallest free block is the grown block's buddy, which is passed over
+    void* other = virtual_malloc(virtual_heap, 1 << 4);
+    assert_ptr_equal(other, (uint8_t*) block + (1 << 7));
+
+    void* new_block = virtual_realloc(virtual_heap, block, 1 << 7);
+    assert_ptr_equal(new_block, block);
+
+    // a reserved buddy is still handed out when nothing else fits
+    virtual_free(virtual_heap, other);
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 7));
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
 static void test_realloc_none() {
     const char* expected[] = {
         "allocated 128",
@@ -707,6 +776,2507 @@ static void test_sbrk_fail() {
     assert_stdout_equal(expected2, ARR_SIZE(expected2));
 }
 
+static void test_lockfree_malloc_split() {
+    const char* expected[] = {
+        "allocated 4096",
+        "free 4096",
+        "free 8192",
+        "free 16384",
+    };
+
+    init_allocator_engine(virtual_heap, 15, 12, ENGINE_LOCKFREE);
+    void* block = virtual_malloc(virtual_heap, 1 << 12);
+    assert_ptr_equal(block, get_blocks(virtual_heap));
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    const char* expected2[] = {
+        "free 32768",
+    };
+
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_lockfree_free_invalid() {
+    const char* expected[] = {
+        "allocated 128",
+        "free 128",
+    };
+
+    init_allocator_engine(virtual_heap, 8, 2, ENGINE_LOCKFREE);
+    void* block = virtual_malloc(virtual_heap, 1 << 7);
+    assert_non_null(block);
+
+    // the free buddy, the middle of the block and the header can't be freed
+    assert_int_not_equal(virtual_free(virtual_heap, (uint8_t*) block + (1 << 7)), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, (uint8_t*) block + 4), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, virtual_heap), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    const char* expected2[] = {
+        "free 256",
+    };
+
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, block), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_lockfree_full() {
+    const char* expected[] = {
+        "allocated 128",
+        "allocated 64",
+        "allocated 64",
+    };
+
+    init_allocator_engine(virtual_heap, 8, 2, ENGINE_LOCKFREE);
+    void* block1 = virtual_malloc(virtual_heap, 1 << 7);
+    void* block2 = virtual_malloc(virtual_heap, 1 << 6);
+    void* block3 = virtual_malloc(virtual_heap, 1 << 6);
+    assert_non_null(block1);
+    assert_non_null(block2);
+    assert_non_null(block3);
+    assert_null(virtual_malloc(virtual_heap, 1));
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // growing into a block of the same order stays in place
+    assert_ptr_equal(virtual_realloc(virtual_heap, block2, 1 << 5 | 1), block2);
+    assert_null(virtual_realloc(virtual_heap, block2, 1 << 7));
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_lockfree_placement() {
+    init_allocator_engine(virtual_heap, 8, 4, ENGINE_LOCKFREE);
+    uint8_t* heap = get_blocks(virtual_heap);
+
+    // blocks go leftmost, whichever thread allocated last
+    void* first = virtual_malloc(virtual_heap, 1 << 4);
+    void* second = virtual_malloc(virtual_heap, 1 << 4);
+    assert_ptr_equal(first, heap);
+    assert_ptr_equal(second, heap + (1 << 4));
+    virtual_free(virtual_heap, first);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), first);
+
+    // a whole free half is kept for larger blocks while the other half is
+    // split, as the buddy engine would
+    init_allocator_engine(virtual_heap, 8, 4, ENGINE_LOCKFREE);
+    void* large = virtual_malloc(virtual_heap, 1 << 7);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), heap + (1 << 7));
+    virtual_free(virtual_heap, large);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4),
+                     heap + (1 << 7) + (1 << 4));
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 7), heap);
+    assert_null(virtual_malloc(virtual_heap, 1 << 6 | 1));
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 6));
+}
+
+static void* stress_thread(void* arg) {
+    unsigned int seed = (uintptr_t) arg;
+    uint8_t tag = (uintptr_t) arg;
+    uint8_t* live[STRESS_LIVE] = {NULL};
+    uint32_t sizes[STRESS_LIVE];
+
+    for (int i = 0; i < STRESS_ITERATIONS; i++) {
+        int slot = rand_r(&seed) % STRESS_LIVE;
+
+        if (live[slot] != NULL) {
+            // nobody else may have written to our block
+            for (uint32_t j = 0; j < sizes[slot]; j++) {
+                if (live[slot][j] != tag)
+                    return (void*) 1;
+            }
+
+            if (virtual_free(virtual_heap, live[slot]))
+                return (void*) 1;
+            live[slot] = NULL;
+        } else {
+            sizes[slot] = 1 + rand_r(&seed) % 256;
+            live[slot] = virtual_malloc(virtual_heap, sizes[slot]);
+            if (live[slot] != NULL)
+                memset(live[slot], tag, sizes[slot]);
+        }
+    }
+
+    for (int i = 0; i < STRESS_LIVE; i++) {
+        if (live[i] != NULL && virtual_free(virtual_heap, live[i]))
+            return (void*) 1;
+    }
+
+    return NULL;
+}
+
+static void test_lockfree_stress() {
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    init_allocator_engine(virtual_heap, 16, 4, ENGINE_LOCKFREE);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    // everything was freed, so the heap must have merged back together
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_subtree_steal() {
+    const char* expected[] = {
+        "allocated 128",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+    };
+
+    init_allocator_engine(virtual_heap, 8, 2, ENGINE_SUBTREE);
+
+    // a block larger than a subtree is taken from the top of the tree
+    void* large = virtual_malloc(virtual_heap, 1 << 7);
+    assert_ptr_equal(large, get_blocks(virtual_heap));
+
+    // whichever subtree is home, the rest are stolen from once it is full
+    void* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 4);
+        assert_non_null(blocks[i]);
+    }
+    assert_null(virtual_malloc(virtual_heap, 1));
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    assert_int_equal(virtual_free(virtual_heap, blocks[3]), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, blocks[3]), 0);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), blocks[3]);
+
+    const char* expected2[] = {
+        "allocated 128",
+        "free 128",
+    };
+
+    for (int i = 0; i < 8; i++)
+        assert_int_equal(virtual_free(virtual_heap, blocks[i]), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+
+    const char* expected3[] = {
+        "free 256",
+    };
+
+    assert_int_equal(virtual_free(virtual_heap, large), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected3, ARR_SIZE(expected3));
+}
+
+static void test_subtree_large() {
+    init_allocator_engine(virtual_heap, 8, 2, ENGINE_SUBTREE);
+
+    // a subtree in use can't be covered by a larger block
+    void* small = virtual_malloc(virtual_heap, 1);
+    assert_non_null(small);
+    assert_null(virtual_malloc(virtual_heap, 1 << 8));
+
+    void* large = virtual_malloc(virtual_heap, 1 << 7);
+    assert_non_null(large);
+    assert_null(virtual_malloc(virtual_heap, 1 << 7));
+
+    // nor can a subtree under a larger block be used
+    assert_int_equal(virtual_free(virtual_heap, small), 0);
+    for (int i = 0; i < 8; i++)
+        assert_non_null(virtual_malloc(virtual_heap, 1 << 4));
+    assert_null(virtual_malloc(virtual_heap, 1 << 4));
+
+    // growing a block moves it to whichever subtree has room
+    assert_int_equal(virtual_free(virtual_heap, large), 0);
+    void* block = virtual_malloc(virtual_heap, 1 << 4);
+    assert_non_null(block);
+    memset(block, 0x5a, 1 << 4);
+
+    uint8_t* moved = virtual_realloc(virtual_heap, block, 1 << 6);
+    assert_non_null(moved);
+    for (int i = 0; i < 1 << 4; i++)
+        assert_int_equal(moved[i], 0x5a);
+}
+
+static void test_subtree_stress() {
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    init_allocator_engine(virtual_heap, 16, 4, ENGINE_SUBTREE);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    // everything was freed, so the heap must have merged back together
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_tcache_reuse() {
+    const char* expected[] = {
+        "allocated 64",
+        "allocated 64",
+        "free 128",
+        "free 256",
+        "free 512",
+        "free 1024",
+        "free 2048",
+        "free 4096",
+        "free 8192",
+        "free 16384",
+    };
+
+    init_allocator(virtual_heap, 15, 5);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 14), 0);
+
+    // the cache is refilled with 2 blocks at once
+    void* block = virtual_malloc(virtual_heap, 1 << 6);
+    assert_non_null(block);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // freed blocks stay allocated in the heap while they sit in the cache
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, block), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 6), block);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    const char* expected2[] = {
+        "free 32768",
+    };
+
+    virtual_tcache_flush(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_tcache_limits() {
+    init_allocator(virtual_heap, 15, 5);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 2, 1 << 8), 0);
+
+    void* blocks[6];
+    for (int i = 0; i < ARR_SIZE(blocks); i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 7);
+
+    // only 2 of the blocks fit in the cache, the rest go straight back
+    for (int i = 0; i < ARR_SIZE(blocks); i++)
+        assert_int_equal(virtual_free(virtual_heap, blocks[i]), 0);
+
+    const char* expected[] = {
+        "allocated 128",
+        "free 128",
+        "free 256",
+        "free 128",
+        "allocated 128",
+        "free 256",
+        "free 1024",
+        "free 2048",
+        "free 4096",
+        "free 8192",
+        "free 16384",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // turning the caches off flushes them
+    const char* expected2[] = {
+        "free 32768",
+    };
+
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 0, 0), 0);
+    void* block = virtual_malloc(virtual_heap, 1 << 7);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void* tcache_exit_thread(void* arg) {
+    void* block = virtual_malloc(virtual_heap, 1 << 6);
+    virtual_free(virtual_heap, block);
+
+    return block;
+}
+
+static void test_tcache_thread_exit() {
+    const char* expected[] = {
+        "free 32768",
+    };
+
+    init_allocator(virtual_heap, 15, 5);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 8, 1 << 14), 0);
+
+    pthread_t thread;
+    void* block;
+    pthread_create(&thread, NULL, tcache_exit_thread, NULL);
+    pthread_join(thread, &block);
+    assert_non_null(block);
+
+    // the thread's cache was drained back into the heap when it exited
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_tcache_stress() {
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    init_allocator(virtual_heap, 16, 4);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void* remote_free_thread(void* arg) {
+    void** blocks = arg;
+    for (int i = 0; i < 4; i++) {
+        if (virtual_free(virtual_heap, blocks[i]))
+            return (void*) 1;
+    }
+
+    return NULL;
+}
+
+static void test_tcache_remote_free() {
+    init_allocator(virtual_heap, 15, 5);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 8, 1 << 14), 0);
+
+    void* blocks[4];
+    for (int i = 0; i < ARR_SIZE(blocks); i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 6);
+
+    // another thread frees them back to this thread without taking the lock
+    pthread_t thread;
+    void* ret;
+    pthread_create(&thread, NULL, remote_free_thread, blocks);
+    pthread_join(thread, &ret);
+    assert_null(ret);
+
+    remote_stats_t stats;
+    virtual_remote_stats(virtual_heap, &stats);
+    assert_int_equal(stats.remote_frees, 0);
+
+    // they are all collected at once by our next malloc
+    void* block = virtual_malloc(virtual_heap, 1 << 6);
+    assert_ptr_equal(block, blocks[0]);
+    virtual_remote_stats(virtual_heap, &stats);
+    assert_int_equal(stats.remote_frees, 4);
+    assert_int_equal(stats.drains, 1);
+    assert_int_equal(stats.max_batch, 4);
+
+    const char* expected[] = {
+        "free 32768",
+    };
+
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    virtual_tcache_flush(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void* tcache_orphan_thread(void* arg) {
+    void** blocks = arg;
+    for (int i = 0; i < 4; i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 6);
+
+    return NULL;
+}
+
+static void test_tcache_remote_orphan() {
+    const char* expected[] = {
+        "free 32768",
+    };
+
+    init_allocator(virtual_heap, 15, 5);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 8, 1 << 14), 0);
+
+    // this thread's cache takes an owner id first, so the other thread's id
+    // isn't simply handed on to it
+    assert_int_equal(virtual_free(virtual_heap,
+                                  virtual_malloc(virtual_heap, 1 << 6)), 0);
+
+    // the thread that allocated the blocks exits before they are freed
+    void* blocks[4];
+    pthread_t thread;
+    pthread_create(&thread, NULL, tcache_orphan_thread, blocks);
+    pthread_join(thread, NULL);
+
+    // so they go straight back to the heap instead of waiting for it
+    for (int i = 0; i < ARR_SIZE(blocks); i++) {
+        assert_non_null(blocks[i]);
+        assert_int_equal(virtual_free(virtual_heap, blocks[i]), 0);
+    }
+
+    virtual_tcache_flush(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void* remote_stress_thread(void* arg) {
+    uintptr_t id = (uintptr_t) arg;
+    unsigned int seed = id;
+
+    for (int round = 0; round < 32; round++) {
+        for (int i = 0; i < STRESS_LIVE; i++) {
+            handoff_sizes[id][i] = 8 + rand_r(&seed) % 256;
+            handoff[id][i] = virtual_malloc(virtual_heap, handoff_sizes[id][i]);
+            if (handoff[id][i] != NULL)
+                memset(handoff[id][i], id, handoff_sizes[id][i]);
+        }
+
+        pthread_barrier_wait(&handoff_barrier);
+
+        // free the blocks our neighbour allocated
+        uintptr_t other = (id + 1) % STRESS_THREADS;
+        for (int i = 0; i < STRESS_LIVE; i++) {
+            uint8_t* block = handoff[other][i];
+            if (block == NULL)
+                continue;
+
+            for (uint32_t j = 0; j < handoff_sizes[other][i]; j++) {
+                if (block[j] != (uint8_t) other)
+                    return (void*) 1;
+            }
+
+            if (virtual_free(virtual_heap, block))
+                return (void*) 1;
+        }
+
+        pthread_barrier_wait(&handoff_barrier);
+    }
+
+    return NULL;
+}
+
+static void test_tcache_remote_stress() {
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    init_allocator(virtual_heap, 16, 4);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+    pthread_barrier_init(&handoff_barrier, NULL, STRESS_THREADS);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, remote_stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    pthread_barrier_destroy(&handoff_barrier);
+
+    remote_stats_t stats;
+    virtual_remote_stats(virtual_heap, &stats);
+    assert_int_not_equal(stats.remote_frees, 0);
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void* steal_victim_thread(void* arg) {
+    // fill the cache with the whole heap, then sit on it
+    void* block = virtual_malloc(virtual_heap, 1 << 8);
+    if (block == NULL || virtual_free(virtual_heap, block))
+        return (void*) 1;
+
+    pthread_barrier_wait(&handoff_barrier);
+    pthread_barrier_wait(&handoff_barrier);
+
+    return NULL;
+}
+
+static void test_tcache_steal() {
+    init_allocator(virtual_heap, 10, 5);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 8, 1 << 14), 0);
+
+    pthread_t thread;
+    pthread_barrier_init(&handoff_barrier, NULL, 2);
+    pthread_create(&thread, NULL, steal_victim_thread, NULL);
+    pthread_barrier_wait(&handoff_barrier);
+
+    // the heap is empty, so blocks have to come out of the other thread's cache
+    void* block1 = virtual_malloc(virtual_heap, 1 << 8);
+    assert_non_null(block1);
+
+    // a larger block is split up if there's nothing of the right size
+    void* block2 = virtual_malloc(virtual_heap, 1 << 5);
+    assert_non_null(block2);
+
+    remote_stats_t stats;
+    virtual_remote_stats(virtual_heap, &stats);
+    assert_int_equal(stats.steals, 2);
+
+    // the stolen blocks now belong to this thread
+    assert_int_equal(virtual_free(virtual_heap, block1), 0);
+    assert_int_equal(virtual_free(virtual_heap, block2), 0);
+    virtual_tcache_flush(virtual_heap);
+
+    void* ret;
+    pthread_barrier_wait(&handoff_barrier);
+    pthread_join(thread, &ret);
+    assert_null(ret);
+    pthread_barrier_destroy(&handoff_barrier);
+
+    const char* expected[] = {
+        "free 1024",
+    };
+
+    virtual_remote_stats(virtual_heap, &stats);
+    assert_int_equal(stats.remote_frees, 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_pcpu_reuse() {
+    const char* expected[] = {
+        "allocated 64",
+        "allocated 64",
+        "free 128",
+        "free 256",
+        "free 512",
+        "free 1024",
+        "free 2048",
+        "free 4096",
+        "free 8192",
+        "free 16384",
+    };
+
+    // stay on one CPU so that every call sees the same cache
+    cpu_set_t old_cpus, cpus;
+    sched_getaffinity(0, sizeof(old_cpus), &old_cpus);
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    init_allocator(virtual_heap, 15, 5);
+    assert_int_equal(virtual_pcpu_enable(virtual_heap, 4, 1 << 14), 0);
+
+    // the cache is refilled with 2 blocks at once, whether it belongs to the
+    // CPU or to the thread
+    void* block = virtual_malloc(virtual_heap, 1 << 6);
+    assert_non_null(block);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, block), 0);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 6), block);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+
+    const char* expected2[] = {
+        "free 32768",
+    };
+
+    // turning the caches off empties every CPU's cache
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 0, 0), 0);
+    virtual_free(virtual_heap, virtual_malloc(virtual_heap, 1 << 6));
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_pcpu_stress() {
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    init_allocator(virtual_heap, 16, 4);
+    assert_int_equal(virtual_pcpu_enable(virtual_heap, 4, 1 << 10), 0);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 0, 0), 0);
+    virtual_free(virtual_heap, virtual_malloc(virtual_heap, 1));
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_worker_reserve() {
+    const char* expected[] = {
+        "allocated 64",
+        "allocated 64",
+        "allocated 64",
+        "allocated 64",
+        "free 256",
+        "free 512",
+    };
+
+    init_allocator(virtual_heap, 10, 4);
+    assert_int_equal(virtual_worker_start(virtual_heap), 0);
+    assert_int_not_equal(virtual_worker_start(virtual_heap), 0);
+    assert_int_not_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+
+    assert_int_equal(virtual_worker_reserve(virtual_heap, 1 << 6, 4), 0);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // blocks come out of the reserve, and frees are only queued
+    void* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 6);
+        assert_non_null(blocks[i]);
+        memset(blocks[i], i, 1 << 6);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 1 << 6; j++)
+            assert_int_equal(((uint8_t*) blocks[i])[j], i);
+        assert_int_equal(virtual_free(virtual_heap, blocks[i]), 0);
+    }
+
+    const char* expected2[] = {
+        "free 1024",
+    };
+
+    virtual_worker_stop(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_worker_deferred() {
+    init_allocator(virtual_heap, 8, 2);
+    assert_int_not_equal(virtual_worker_start(virtual_heap), 0);
+
+    init_allocator(virtual_heap, 8, 4);
+    assert_int_equal(virtual_worker_start(virtual_heap), 0);
+
+    // the space is still needed after a queued free, so it is freed right away
+    for (int i = 0; i < 100; i++) {
+        void* block = virtual_malloc(virtual_heap, 1 << 8);
+        assert_non_null(block);
+        assert_int_equal(virtual_free(virtual_heap, block), 0);
+    }
+
+    assert_int_not_equal(virtual_free(virtual_heap, virtual_heap), 0);
+
+    const char* expected[] = {
+        "free 256",
+    };
+
+    virtual_worker_stop(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_worker_double_free() {
+    init_allocator(virtual_heap, 10, 4);
+    assert_int_equal(virtual_worker_start(virtual_heap), 0);
+    assert_int_equal(virtual_worker_reserve(virtual_heap, 1 << 6, 2), 0);
+
+    void* p = virtual_malloc(virtual_heap, 1 << 8);
+    void* q = virtual_malloc(virtual_heap, 1 << 8);
+    void* r = virtual_malloc(virtual_heap, 1 << 6);
+    assert_int_equal(virtual_free(virtual_heap, p), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, p), 0);
+    assert_int_equal(virtual_free(virtual_heap, q), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, p), 0);
+    assert_null(virtual_realloc(virtual_heap, q, 1 << 7));
+
+    // a block going back into its reserve still can't be freed again
+    assert_int_equal(virtual_free(virtual_heap, r), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, r), 0);
+
+    // the queued frees are needed to fit this, so the queue is drained
+    void* big = virtual_malloc(virtual_heap, 1 << 9);
+    assert_non_null(big);
+    assert_int_equal(virtual_free(virtual_heap, big), 0);
+
+    const char* expected[] = {
+        "free 1024",
+    };
+
+    virtual_worker_stop(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_worker_bad_free() {
+    init_allocator(virtual_heap, 10, 4);
+    uint8_t* before = virtual_malloc(virtual_heap, 1 << 8);
+    assert_int_equal(virtual_worker_start(virtual_heap), 0);
+
+    uint8_t* block = virtual_malloc(virtual_heap, 1 << 8);
+    memset(block, 0xab, 1 << 8);
+    memset(before, 0xcd, 1 << 8);
+
+    // neither pointer is the start of a block, so nothing is written to them
+    assert_int_not_equal(virtual_free(virtual_heap, block + 64), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, before + 64), 0);
+    for (int i = 0; i < 1 << 8; i++) {
+        assert_int_equal(block[i], 0xab);
+        assert_int_equal(before[i], 0xcd);
+    }
+
+    // a block from before the worker started is freed on the heap directly,
+    // so freeing it again is caught there
+    assert_int_equal(virtual_free(virtual_heap, before), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, before), 0);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, block), 0);
+
+    const char* expected[] = {
+        "free 1024",
+    };
+
+    virtual_worker_stop(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_worker_stress() {
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    init_allocator(virtual_heap, 16, 4);
+    assert_int_equal(virtual_worker_start(virtual_heap), 0);
+    assert_int_equal(virtual_worker_reserve(virtual_heap, 1 << 6, 16), 0);
+    assert_int_equal(virtual_worker_reserve(virtual_heap, 1 << 8, 16), 0);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    virtual_worker_stop(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_free_batch() {
+    init_allocator(virtual_heap, 8, 5);
+
+    void* blocks[8];
+    for (int i = 0; i < 8; i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 5);
+
+    // out of order, with merges on both sides of the allocated blocks
+    void* batch[] = {blocks[7], blocks[0], blocks[3], blocks[1], blocks[6],
+                     blocks[2]};
+    assert_int_equal(virtual_free_batch(virtual_heap, batch, ARR_SIZE(batch)),
+                     0);
+
+    const char* expected[] = {
+        "free 128",
+        "allocated 32",
+        "allocated 32",
+        "free 64",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    void* rest[] = {blocks[5], blocks[4]};
+    assert_int_equal(virtual_free_batch(virtual_heap, rest, ARR_SIZE(rest)), 0);
+    assert_int_equal(virtual_free_batch(virtual_heap, rest, 0), 0);
+
+    const char* expected2[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_free_batch_invalid() {
+    init_allocator(virtual_heap, 8, 5);
+
+    void* blocks[4];
+    for (int i = 0; i < 4; i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 6);
+
+    // a pointer twice, inside a block, free, or outside the heap frees nothing
+    void* twice[] = {blocks[0], blocks[1], blocks[0]};
+    void* inside[] = {blocks[0], (uint8_t*) blocks[1] + 1};
+    void* outside[] = {blocks[0], virtual_heap};
+    void* past[] = {blocks[0], (uint8_t*) blocks[3] + (1 << 6)};
+    assert_int_not_equal(virtual_free_batch(virtual_heap, twice, 3), 0);
+    assert_int_not_equal(virtual_free_batch(virtual_heap, inside, 2), 0);
+    assert_int_not_equal(virtual_free_batch(virtual_heap, outside, 2), 0);
+    assert_int_not_equal(virtual_free_batch(virtual_heap, past, 2), 0);
+
+    assert_int_equal(virtual_free(virtual_heap, blocks[1]), 0);
+    void* unallocated[] = {blocks[0], blocks[1]};
+    assert_int_not_equal(virtual_free_batch(virtual_heap, unallocated, 2), 0);
+
+    const char* expected[] = {
+        "allocated 64",
+        "free 64",
+        "allocated 64",
+        "allocated 64",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_free_batch_random() {
+    init_allocator(virtual_heap, 16, 4);
+    srand(33);
+
+    // fill the heap with blocks of mixed sizes, then free them in two batches
+    void* blocks[1 << 12];
+    uint32_t count = 0;
+    while (count < ARR_SIZE(blocks)) {
+        void* block = virtual_malloc(virtual_heap, 1 << (4 + rand() % 5));
+        if (block == NULL)
+            block = virtual_malloc(virtual_heap, 1 << 4);
+        if (block == NULL)
+            break;
+        blocks[count++] = block;
+    }
+
+    for (uint32_t i = count - 1; i > 0; i--) {
+        uint32_t j = rand() % (i + 1);
+        void* tmp = blocks[i];
+        blocks[i] = blocks[j];
+        blocks[j] = tmp;
+    }
+
+    assert_int_equal(virtual_free_batch(virtual_heap, blocks, count / 2), 0);
+
+    // the merged heap can still be allocated from and freed normally
+    void* block = virtual_malloc(virtual_heap, 1 << 4);
+    assert_non_null(block);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    assert_int_equal(virtual_free_batch(virtual_heap, blocks + count / 2,
+                                        count - count / 2), 0);
+
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_defer_frees() {
+    init_allocator(virtual_heap, 8, 6);
+    assert_int_equal(virtual_defer_frees(virtual_heap, 3), 0);
+    assert_int_not_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+    assert_int_not_equal(virtual_worker_start(virtual_heap), 0);
+
+    void* blocks[4];
+    for (int i = 0; i < 4; i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 6);
+
+    // frees are only queued until the queue fills up
+    assert_int_equal(virtual_free(virtual_heap, blocks[2]), 0);
+    assert_int_equal(virtual_free(virtual_heap, blocks[0]), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, virtual_heap), 0);
+
+    const char* expected[] = {
+        "allocated 64",
+        "allocated 64",
+        "allocated 64",
+        "allocated 64",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    assert_int_equal(virtual_free(virtual_heap, blocks[1]), 0);
+
+    const char* expected2[] = {
+        "free 128",
+        "free 64",
+        "allocated 64",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+
+    // a malloc that would fail does the queued frees first
+    assert_int_equal(virtual_free(virtual_heap, blocks[3]), 0);
+    void* block = virtual_malloc(virtual_heap, 1 << 8);
+    assert_non_null(block);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    // turning the queue off flushes it
+    assert_int_equal(virtual_defer_frees(virtual_heap, 0), 0);
+
+    const char* expected3[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected3, ARR_SIZE(expected3));
+}
+
+static void test_defer_frees_invalid() {
+    init_allocator(virtual_heap, 8, 6);
+    assert_int_equal(virtual_defer_frees(virtual_heap, 3), 0);
+
+    void* blocks[2];
+    for (int i = 0; i < 2; i++)
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 6);
+
+    // pointers that can't be a block, or are queued already, are refused
+    // before they are queued
+    assert_int_not_equal(virtual_free(virtual_heap,
+                                      (uint8_t*) blocks[0] + 16), 0);
+    assert_int_equal(virtual_free(virtual_heap, blocks[0]), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, blocks[0]), 0);
+
+    const char* expected[] = {
+        "allocated 64",
+        "allocated 64",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // so the queue still frees the good block in one batch
+    virtual_flush_frees(virtual_heap);
+
+    const char* expected2[] = {
+        "free 64",
+        "allocated 64",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+
+    assert_int_equal(virtual_free(virtual_heap, blocks[1]), 0);
+    assert_int_equal(virtual_defer_frees(virtual_heap, 0), 0);
+
+    const char* expected3[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected3, ARR_SIZE(expected3));
+}
+
+static void test_malloc_batch() {
+    init_allocator(virtual_heap, 8, 4);
+
+    // the blocks come out of a single block, next to each other
+    void* blocks[5];
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 10, 5, blocks), 5);
+    for (int i = 0; i < 5; i++)
+        assert_ptr_equal(blocks[i], get_blocks(virtual_heap) + (i << 4));
+
+    const char* expected[] = {
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // the smallest block that fits the whole batch is used
+    void* more[2];
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 16, 2, more), 2);
+    assert_ptr_equal(more[0], get_blocks(virtual_heap) + (6 << 4));
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 0, 2, more), 0);
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 1 << 9, 2, more), 0);
+
+    assert_int_equal(virtual_free_batch(virtual_heap, blocks, 5), 0);
+    assert_int_equal(virtual_free_batch(virtual_heap, more, 2), 0);
+
+    const char* expected2[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_malloc_batch_partial() {
+    init_allocator(virtual_heap, 8, 4);
+
+    void* first = virtual_malloc(virtual_heap, 1 << 4);
+    void* middle = virtual_malloc(virtual_heap, 1 << 7);
+    assert_non_null(first);
+    assert_non_null(middle);
+
+    // no single free block holds the batch, so it spans all of them, biggest
+    // first, and stops once the heap runs out
+    void* blocks[16];
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 1 << 4, 16, blocks), 7);
+    assert_ptr_equal(blocks[0], get_blocks(virtual_heap) + (4 << 4));
+    assert_ptr_equal(blocks[4], get_blocks(virtual_heap) + (2 << 4));
+    assert_ptr_equal(blocks[6], get_blocks(virtual_heap) + (1 << 4));
+
+    const char* expected[] = {
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 16",
+        "allocated 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void assert_stats_match_info() {
+    char line[LINE_LENGTH];
+    uint32_t free_blocks[STATS_ORDERS] = {0};
+    uint32_t allocated_blocks[STATS_ORDERS] = {0};
+
+    heap_stats_t stats;
+    assert_int_equal(virtual_stats(virtual_heap, &stats), 0);
+
+    // count the blocks virtual_info prints, the same way as assert_stdout_equal
+    virtual_info(virtual_heap);
+    fflush(stdout);
+    close(pipefd[1]);
+    dup2(oldstdout, fileno(stdout));
+
+    stdout_fp = fdopen(pipefd[0], "r");
+    int8_t largest = -1;
+    while (fgets(line, LINE_LENGTH, stdout_fp) != NULL) {
+        uint32_t size;
+        char state[16];
+        assert_int_equal(sscanf(line, "%15s %u", state, &size), 2);
+
+        uint8_t order = __builtin_ctz(size);
+        if (strcmp(state, "free") == 0) {
+            free_blocks[order]++;
+            largest = MAX(largest, order);
+        } else {
+            allocated_blocks[order]++;
+        }
+    }
+
+    close_fp();
+    pipe(pipefd);
+    dup2(pipefd[1], fileno(stdout));
+
+    for (int order = 0; order < STATS_ORDERS; order++) {
+        assert_int_equal(stats.free_blocks[order], free_blocks[order]);
+        assert_int_equal(stats.allocated_blocks[order],
+                         allocated_blocks[order]);
+        assert_int_equal(stats.free_bytes[order],
+                         (uint64_t) free_blocks[order] << order);
+    }
+    assert_int_equal(stats.largest_free_order, largest);
+}
+
+static void test_stats() {
+    heap_stats_t stats;
+
+    init_allocator(virtual_heap, 8, 4);
+    assert_int_equal(virtual_stats(virtual_heap, &stats), 0);
+    assert_int_equal(stats.free_blocks[8], 1);
+    assert_int_equal(stats.free_bytes[8], 256);
+    assert_int_equal(stats.largest_free_order, 8);
+
+    void* block = virtual_malloc(virtual_heap, 1 << 4);
+    assert_int_equal(virtual_stats(virtual_heap, &stats), 0);
+    assert_int_equal(stats.allocated_blocks[4], 1);
+    assert_int_equal(stats.free_blocks[4], 1);
+    assert_int_equal(stats.free_blocks[7], 1);
+    assert_int_equal(stats.largest_free_order, 7);
+    assert_stats_match_info();
+
+    // every way of changing the heap, including ones that fail part way
+    void* batch[6];
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 1 << 4, 6, batch), 6);
+    assert_stats_match_info();
+    assert_null(virtual_realloc(virtual_heap, batch[1], 1 << 8));
+    assert_stats_match_info();
+    batch[1] = virtual_realloc(virtual_heap, batch[1], 1 << 6);
+    assert_non_null(batch[1]);
+    assert_stats_match_info();
+    assert_int_equal(virtual_free_batch(virtual_heap, batch, 3), 0);
+    assert_stats_match_info();
+    assert_ptr_equal(virtual_realloc(virtual_heap, block, 1 << 6), block);
+    assert_stats_match_info();
+
+    sbrk_should_fail = true;
+    assert_int_not_equal(virtual_free(virtual_heap, block), 0);
+    sbrk_should_fail = false;
+    assert_stats_match_info();
+
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    assert_int_equal(virtual_free_batch(virtual_heap, batch + 3, 3), 0);
+    assert_stats_match_info();
+
+    init_allocator_engine(virtual_heap, 8, 4, ENGINE_LOCKFREE);
+    assert_int_not_equal(virtual_stats(virtual_heap, &stats), 0);
+}
+
+static void* stats_reader_thread(void* arg) {
+    heap_stats_t stats;
+
+    // every snapshot taken in the middle of other threads' changes must still
+    // account for the whole heap
+    do {
+        if (virtual_stats(virtual_heap, &stats))
+            return (void*) 1;
+
+        uint64_t bytes = 0;
+        for (int order = 0; order < STATS_ORDERS; order++) {
+            bytes += stats.free_bytes[order];
+            bytes += (uint64_t) stats.allocated_blocks[order] << order;
+        }
+
+        if (bytes != 1 << 16)
+            return (void*) 1;
+    } while (!atomic_load(&stats_done));
+
+    return NULL;
+}
+
+static void test_stats_concurrent() {
+    init_allocator(virtual_heap, 16, 4);
+    atomic_store(&stats_done, false);
+
+    pthread_t reader;
+    pthread_create(&reader, NULL, stats_reader_thread, NULL);
+
+    pthread_t threads[STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_thread, (void*) i);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    atomic_store(&stats_done, true);
+
+    void* ret;
+    pthread_join(reader, &ret);
+    assert_null(ret);
+
+    assert_stats_match_info();
+}
+
+static void test_free_sized() {
+    init_allocator(virtual_heap, 8, 4);
+
+    void* small = virtual_malloc(virtual_heap, 10);
+    void* large = virtual_malloc(virtual_heap, 40);
+    assert_int_equal(virtual_usable_size(virtual_heap, small), 1 << 4);
+    assert_int_equal(virtual_usable_size(virtual_heap, large), 1 << 6);
+    assert_int_equal(virtual_usable_size(virtual_heap, virtual_heap), 0);
+    assert_int_equal(virtual_usable_size(virtual_heap,
+                                         (uint8_t*) large + (1 << 6)), 0);
+
+    // the size has to give the block's order
+    assert_int_not_equal(virtual_free_sized(virtual_heap, large, 1 << 7), 0);
+    assert_int_not_equal(virtual_free_sized(virtual_heap, large, 1 << 4), 0);
+    assert_int_not_equal(virtual_free_sized(virtual_heap, large, 0), 0);
+    assert_int_not_equal(virtual_free_sized(virtual_heap, virtual_heap, 10), 0);
+    assert_int_not_equal(virtual_free_sized(virtual_heap,
+                                            (uint8_t*) large + 16, 16), 0);
+    assert_int_equal(virtual_free_sized(virtual_heap, large, 64), 0);
+    assert_int_equal(virtual_usable_size(virtual_heap, large), 0);
+    assert_int_not_equal(virtual_free_sized(virtual_heap, large, 64), 0);
+
+    // any size rounding up to the same block will do
+    assert_int_equal(virtual_free_sized(virtual_heap, small, 3), 0);
+
+    const char* expected[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_free_sized_tree() {
+    const char* expected[] = {
+        "free 256",
+    };
+    engine_t engines[] = {ENGINE_LOCKFREE, ENGINE_SUBTREE};
+
+    for (int i = 0; i < ARR_SIZE(engines); i++) {
+        init_allocator_engine(virtual_heap, 8, 4, engines[i]);
+
+        void* small = virtual_malloc(virtual_heap, 10);
+        void* large = virtual_malloc(virtual_heap, 100);
+        assert_int_equal(virtual_usable_size(virtual_heap, small), 1 << 4);
+        assert_int_equal(virtual_usable_size(virtual_heap, large), 1 << 7);
+        assert_int_equal(virtual_usable_size(virtual_heap, virtual_heap), 0);
+
+        assert_int_not_equal(virtual_free_sized(virtual_heap, large, 64), 0);
+        assert_int_not_equal(virtual_free_sized(virtual_heap, small, 1 << 8),
+                             0);
+        assert_int_equal(virtual_free_sized(virtual_heap, large, 100), 0);
+        assert_int_not_equal(virtual_free_sized(virtual_heap, large, 100), 0);
+        assert_int_equal(virtual_free_sized(virtual_heap, small, 16), 0);
+        assert_int_equal(virtual_usable_size(virtual_heap, small), 0);
+
+        virtual_info(virtual_heap);
+        assert_stdout_equal(expected, ARR_SIZE(expected));
+    }
+}
+
+static void test_aligned_alloc() {
+    init_allocator(virtual_heap, 8, 2);
+
+    // every block is aligned to its own size
+    void* first = virtual_malloc(virtual_heap, 16);
+    assert_int_equal((uintptr_t) first & 255, 0);
+
+    void* second = virtual_aligned_alloc(virtual_heap, 64, 16);
+    assert_ptr_equal(second, get_blocks(virtual_heap) + 64);
+    assert_null(virtual_aligned_alloc(virtual_heap, 48, 16));
+    assert_null(virtual_aligned_alloc(virtual_heap, 0, 16));
+    assert_null(virtual_aligned_alloc(virtual_heap, 64, 0));
+
+    // the blocks are no bigger than they would otherwise be
+    const char* expected[] = {
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    void* block;
+    assert_int_equal(virtual_posix_memalign(virtual_heap, &block, 3, 16),
+                     EINVAL);
+    assert_int_equal(virtual_posix_memalign(virtual_heap, &block, 4, 16),
+                     EINVAL);
+    assert_int_equal(virtual_posix_memalign(virtual_heap, &block, 128, 1 << 7),
+                     0);
+    assert_ptr_equal(block, get_blocks(virtual_heap) + 128);
+    assert_int_equal(virtual_posix_memalign(virtual_heap, &block, 64, 16),
+                     ENOMEM);
+    assert_int_equal(virtual_posix_memalign(virtual_heap, &block, 8, 0), 0);
+    assert_null(block);
+}
+
+static void test_aligned_alloc_offset() {
+    // blocks bigger than a page are only aligned to a page, so an alignment
+    // beyond that may have to be split off from the middle of a free block
+    init_allocator(virtual_heap, 14, 4);
+    assert_int_equal((uintptr_t) get_blocks(virtual_heap) % HEAP_ALIGN, 0);
+
+    void* block = virtual_aligned_alloc(virtual_heap, 1 << 13, 16);
+    assert_non_null(block);
+    assert_int_equal((uintptr_t) block & ((1 << 13) - 1), 0);
+    assert_int_equal(virtual_usable_size(virtual_heap, block), 16);
+
+    // the halves merge back together around it when it is freed
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    const char* expected[] = {
+        "free 16384",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    init_allocator_engine(virtual_heap, 8, 2, ENGINE_LOCKFREE);
+    block = virtual_aligned_alloc(virtual_heap, 64, 16);
+    assert_non_null(block);
+    assert_int_equal((uintptr_t) block & 63, 0);
+    assert_int_equal(virtual_usable_size(virtual_heap, block), 64);
+}
+
+static void test_aligned_layout() {
+    engine_t engines[] = {ENGINE_BUDDY, ENGINE_LOCKFREE, ENGINE_SUBTREE};
+
+    // wherever the heap starts, every block is aligned to its size, up to a
+    // page
+    for (int i = 0; i < ARR_SIZE(engines); i++) {
+        for (int start = 0; start < 3; start++) {
+            void* heap = (uint8_t*) virtual_heap + start * 21;
+            init_allocator_engine(heap, 14, 2, engines[i]);
+            assert_true(get_blocks(heap) >= (uint8_t*) heap + 2);
+
+            for (uint32_t size = 1 << 2; size <= 1 << 13; size <<= 1) {
+                uint8_t* block = virtual_malloc(heap, size);
+                assert_non_null(block);
+                assert_int_equal((uintptr_t) block % MIN(size, HEAP_ALIGN), 0);
+                memset(block, 0xff, size);
+            }
+
+            assert_int_equal(*(uint8_t*) heap, 14);
+        }
+    }
+}
+
+static void test_calloc_fresh() {
+    // memory past anywhere the break has been is known to be clear, so calloc
+    // doesn't clear it again, which shows in bytes written behind its back
+    void* heap = (uint8_t*) virtual_heap + (1 << 24);
+    init_allocator(heap, 12, 4);
+    uint8_t* blocks = get_blocks(heap);
+    memset(blocks, 0xaa, 1 << 6);
+
+    uint8_t* block = virtual_calloc(heap, 4, 1 << 4);
+    assert_ptr_equal(block, blocks);
+    assert_int_equal(block[0], 0xaa);
+    assert_int_equal(block[(1 << 6) - 1], 0xaa);
+
+    // once freed, the block has been used, and is cleared the next time
+    assert_int_equal(virtual_free(heap, block), 0);
+    block = virtual_calloc(heap, 4, 1 << 4);
+    assert_ptr_equal(block, blocks);
+    for (int i = 0; i < 1 << 6; i++)
+        assert_int_equal(block[i], 0);
+
+    // the same memory is no longer fresh for a new heap
+    init_allocator(heap, 12, 4);
+    memset(blocks, 0xaa, 1 << 12);
+    block = virtual_calloc(heap, 1, 1 << 12);
+    assert_ptr_equal(block, blocks);
+    for (int i = 0; i < 1 << 12; i++)
+        assert_int_equal(block[i], 0);
+
+    // sizes that overflow are refused
+    assert_null(virtual_calloc(heap, 1 << 16, 1 << 16));
+}
+
+static void test_calloc_merge() {
+    void* heap = (uint8_t*) virtual_heap + (1 << 25);
+    init_allocator(heap, 20, 4);
+    uint8_t* blocks = get_blocks(heap);
+
+    // the halves split off a clear block are clear too
+    uint8_t* first = virtual_calloc(heap, 1, 1 << 4);
+    assert_ptr_equal(first, blocks);
+    memset(blocks + (1 << 4), 0xaa, 1 << 4);
+    uint8_t* second = virtual_calloc(heap, 1, 1 << 4);
+    assert_ptr_equal(second, blocks + (1 << 4));
+    assert_int_equal(second[0], 0xaa);
+
+    // merging with a block that has been used leaves the whole block unclear
+    memset(second, 0xbb, 1 << 4);
+    assert_int_equal(virtual_free(heap, second), 0);
+    assert_int_equal(virtual_free(heap, first), 0);
+    memset(blocks, 0xcc, 1 << 6);
+    uint8_t* block = virtual_calloc(heap, 1, 1 << 6);
+    assert_ptr_equal(block, blocks);
+    for (int i = 0; i < 1 << 6; i++)
+        assert_int_equal(block[i], 0);
+    assert_int_equal(virtual_free(heap, block), 0);
+
+    // large blocks are cleared with non-temporal stores
+    memset(blocks, 0xdd, 1 << 20);
+    block = virtual_calloc(heap, 1 << 10, 1 << 9);
+    assert_ptr_equal(block, blocks);
+    for (int i = 0; i < 1 << 19; i++)
+        assert_int_equal(block[i], 0);
+    assert_int_equal(blocks[1 << 19], 0xdd);
+
+    // the tree engines clear every block
+    init_allocator_engine(heap, 12, 4, ENGINE_LOCKFREE);
+    memset(get_blocks(heap), 0xee, 1 << 12);
+    block = virtual_calloc(heap, 2, 1 << 8);
+    assert_non_null(block);
+    for (int i = 0; i < 1 << 9; i++)
+        assert_int_equal(block[i], 0);
+}
+
+static void test_worker_prezero() {
+    init_allocator(virtual_heap, 14, 4);
+    memset(get_blocks(virtual_heap), 0xaa, 1 << 14);
+    assert_int_not_equal(virtual_worker_prezero(virtual_heap, 1 << 6, 4), 0);
+
+    assert_int_equal(virtual_worker_start(virtual_heap), 0);
+    assert_int_equal(virtual_worker_prezero(virtual_heap, 1 << 6, 4), 0);
+    assert_int_equal(virtual_worker_reserve(virtual_heap, 1 << 6, 4), 0);
+
+    // blocks come cleared out of the reserve, or are cleared once it runs out,
+    // while those from the other reserve are left as they are
+    uint8_t* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = virtual_calloc(virtual_heap, 1, 1 << 6);
+        assert_non_null(blocks[i]);
+        for (int j = 0; j < 1 << 6; j++)
+            assert_int_equal(blocks[i][j], 0);
+        memset(blocks[i], 0xbb, 1 << 6);
+    }
+
+    for (int i = 0; i < 8; i++)
+        assert_int_equal(virtual_free(virtual_heap, blocks[i]), 0);
+
+    const char* expected[] = {
+        "free 16384",
+    };
+
+    virtual_worker_stop(virtual_heap);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_scope() {
+    init_allocator_engine(virtual_heap, 8, 4, ENGINE_LOCKFREE);
+    assert_int_equal(virtual_mark(virtual_heap), VIRTUAL_NO_MARK);
+
+    init_allocator(virtual_heap, 8, 4);
+    void* outer = virtual_malloc(virtual_heap, 1 << 4);
+    uint32_t mark = virtual_mark(virtual_heap);
+    assert_int_not_equal(mark, VIRTUAL_NO_MARK);
+    assert_int_not_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+    assert_int_not_equal(virtual_worker_start(virtual_heap), 0);
+    assert_int_not_equal(virtual_defer_frees(virtual_heap, 4), 0);
+
+    // every way of allocating belongs to the scope, even if freed early
+    void* blocks[3];
+    assert_int_equal(virtual_malloc_batch(virtual_heap, 1 << 4, 3, blocks), 3);
+    assert_non_null(virtual_calloc(virtual_heap, 2, 1 << 4));
+    assert_non_null(virtual_aligned_alloc(virtual_heap, 1 << 6, 1 << 5));
+    assert_int_equal(virtual_free(virtual_heap, blocks[1]), 0);
+
+    assert_int_equal(virtual_release(virtual_heap, mark), 0);
+    assert_int_not_equal(virtual_release(virtual_heap, mark), 0);
+    assert_stats_match_info();
+
+    const char* expected[] = {
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 64",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // without an open scope nothing is recorded
+    void* block = virtual_malloc(virtual_heap, 1 << 4);
+    assert_int_not_equal(virtual_release(virtual_heap, 0), 0);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+    assert_int_equal(virtual_free(virtual_heap, outer), 0);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+    assert_int_equal(virtual_mark(virtual_heap), VIRTUAL_NO_MARK);
+}
+
+static void test_scope_nested() {
+    init_allocator(virtual_heap, 8, 4);
+
+    uint32_t outer = virtual_mark(virtual_heap);
+    void* block = virtual_malloc(virtual_heap, 1 << 4);
+    uint32_t inner = virtual_mark(virtual_heap);
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 4));
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 5));
+    assert_int_equal(virtual_release(virtual_heap, inner), 0);
+
+    const char* expected[] = {
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 64",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+    assert_ptr_equal(block, get_blocks(virtual_heap));
+
+    // releasing the outer scope closes any scope still open inside it
+    inner = virtual_mark(virtual_heap);
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 6));
+    assert_int_equal(virtual_release(virtual_heap, outer), 0);
+    assert_int_not_equal(virtual_release(virtual_heap, inner), 0);
+
+    const char* expected2[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+}
+
+static void test_scope_realloc() {
+    init_allocator(virtual_heap, 8, 4);
+    uint8_t* kept = virtual_malloc(virtual_heap, 1 << 4);
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 4));
+    memset(kept, 0xaa, 1 << 4);
+
+    uint32_t mark = virtual_mark(virtual_heap);
+
+    // a block allocated before the mark outlives the scope, even when realloc
+    // moves it to where a block freed in the scope was
+    void* freed = virtual_malloc(virtual_heap, 1 << 5);
+    assert_int_equal(virtual_free(virtual_heap, freed), 0);
+    uint8_t* moved = virtual_realloc(virtual_heap, kept, 1 << 5);
+    assert_ptr_equal(moved, freed);
+
+    // whereas a block allocated in the scope stays in it when moved
+    void* block = virtual_malloc(virtual_heap, 1 << 4);
+    assert_ptr_not_equal(virtual_realloc(virtual_heap, block, 1 << 6), block);
+
+    assert_int_equal(virtual_release(virtual_heap, mark), 0);
+
+    const char* expected[] = {
+        "free 16",
+        "allocated 16",
+        "allocated 32",
+        "free 64",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+    for (int i = 0; i < 1 << 4; i++)
+        assert_int_equal(moved[i], 0xaa);
+}
+
+static void test_tags() {
+    init_allocator(virtual_heap, 8, 4);
+    void* untagged = virtual_malloc(virtual_heap, 1 << 4);
+
+    // blocks with different tags can be mixed up in the heap
+    void* first[3];
+    void* second[2];
+    for (int i = 0; i < 3; i++) {
+        first[i] = virtual_malloc_tagged(virtual_heap, 1 << 4, 1);
+        assert_non_null(first[i]);
+        if (i < 2) {
+            second[i] = virtual_malloc_tagged(virtual_heap, 20, 2);
+            assert_non_null(second[i]);
+        }
+    }
+
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 1), 3 << 4);
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 2), 2 << 5);
+    assert_int_not_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+
+    // freeing a block on its own takes it out of its tag
+    assert_int_equal(virtual_free(virtual_heap, first[1]), 0);
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 1), 2 << 4);
+    second[1] = virtual_realloc(virtual_heap, second[1], 1 << 6);
+    assert_non_null(second[1]);
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 2), (1 << 5) + (1 << 6));
+
+    assert_int_equal(virtual_free_tag(virtual_heap, 1), 0);
+    assert_int_not_equal(virtual_free_tag(virtual_heap, 1), 0);
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 1), 0);
+    assert_int_equal(virtual_free_tag(virtual_heap, 2), 0);
+
+    const char* expected[] = {
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 64",
+        "free 128",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+    assert_stats_match_info();
+
+    // once every tag has been freed, the caches can be used again
+    assert_int_equal(virtual_free(virtual_heap, untagged), 0);
+    assert_int_equal(virtual_tcache_enable(virtual_heap, 4, 1 << 10), 0);
+    assert_null(virtual_malloc_tagged(virtual_heap, 1 << 4, 1));
+}
+
+static void test_tags_churn() {
+    init_allocator(virtual_heap, 16, 4);
+
+    // blocks freed on their own are weeded out of their tag's list, even when
+    // the same block is tagged again
+    void* kept[4];
+    for (int i = 0; i < 4; i++) {
+        kept[i] = virtual_malloc_tagged(virtual_heap, 1 << 4, 7);
+        assert_non_null(kept[i]);
+    }
+
+    for (int i = 0; i < 5000; i++) {
+        void* block = virtual_malloc_tagged(virtual_heap, 1 << 4, 7);
+        assert_non_null(block);
+        assert_int_equal(virtual_free(virtual_heap, block), 0);
+    }
+
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 7), 4 << 4);
+
+    // as many tags as fit can have blocks at once
+    for (uint32_t tag = 0; tag < 255; tag++) {
+        if (tag != 7)
+            assert_non_null(virtual_malloc_tagged(virtual_heap, 1 << 4, tag));
+    }
+    assert_null(virtual_malloc_tagged(virtual_heap, 1 << 4, 255));
+    assert_non_null(virtual_malloc_tagged(virtual_heap, 1 << 4, 254));
+
+    for (uint32_t tag = 0; tag < 255; tag++)
+        assert_int_equal(virtual_free_tag(virtual_heap, tag), 0);
+
+    const char* expected[] = {
+        "free 65536",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_tags_scope() {
+    init_allocator(virtual_heap, 8, 4);
+    void* outer = virtual_malloc_tagged(virtual_heap, 1 << 4, 3);
+
+    // a tagged block allocated in a scope is freed with the scope
+    uint32_t mark = virtual_mark(virtual_heap);
+    assert_non_null(virtual_malloc_tagged(virtual_heap, 1 << 5, 3));
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 3), 3 << 4);
+    assert_int_equal(virtual_release(virtual_heap, mark), 0);
+    assert_int_equal(virtual_tag_bytes(virtual_heap, 3), 1 << 4);
+
+    // and its tag doesn't free the block now at its address
+    void* block = virtual_malloc(virtual_heap, 1 << 5);
+    assert_int_equal(virtual_free_tag(virtual_heap, 3), 0);
+    assert_int_not_equal(virtual_free(virtual_heap, outer), 0);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    const char* expected[] = {
+        "free 256",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_bump() {
+    init_allocator(virtual_heap, 12, 4);
+    bump_t bump;
+    assert_int_not_equal(virtual_bump_init(virtual_heap, &bump, 1 << 13), 0);
+    assert_int_equal(virtual_bump_init(virtual_heap, &bump, 200), 0);
+    assert_null(virtual_bump_alloc(&bump, 0));
+
+    // slices follow each other in a block, after the link to the next block
+    uint8_t* first = virtual_bump_alloc(&bump, 1);
+    assert_ptr_equal(first, get_blocks(virtual_heap) + BUMP_ALIGN);
+    uint8_t* slice = virtual_bump_alloc(&bump, 20);
+    assert_ptr_equal(slice, first + BUMP_ALIGN);
+    memset(slice, 0xaa, 20);
+    assert_ptr_equal(virtual_bump_alloc(&bump, 200),
+                     get_blocks(virtual_heap) + 256 + BUMP_ALIGN);
+
+    // a slice too big for a block gets one of its own, and the current block
+    // carries on
+    assert_non_null(virtual_bump_alloc(&bump, 1000));
+    assert_ptr_equal(virtual_bump_alloc(&bump, 16),
+                     get_blocks(virtual_heap) + 256 + BUMP_ALIGN + 208);
+
+    const char* expected[] = {
+        "allocated 256",
+        "allocated 256",
+        "free 512",
+        "allocated 1024",
+        "free 2048",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    virtual_bump_reset(&bump);
+
+    const char* expected2[] = {
+        "free 4096",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected2, ARR_SIZE(expected2));
+    assert_stats_match_info();
+}
+
+static void test_bump_many() {
+    init_allocator_engine(virtual_heap, 16, 4, ENGINE_SUBTREE);
+    bump_t bump;
+    assert_int_equal(virtual_bump_init(virtual_heap, &bump, 1 << 8), 0);
+
+    // more blocks than are freed in one batch, until the heap runs out
+    uint32_t slices = 0;
+    uint8_t* slice;
+    while ((slice = virtual_bump_alloc(&bump, 24)) != NULL) {
+        assert_int_equal((uintptr_t) slice % BUMP_ALIGN, 0);
+        memset(slice, slices, 24);
+        slices++;
+    }
+    assert_int_equal(slices, (1 << 16) / 256 * 7);
+
+    virtual_bump_reset(&bump);
+    assert_non_null(virtual_malloc(virtual_heap, 1 << 16));
+}
+
+// counts the objects constructed and destroyed in the object cache tests
+int constructed_objects;
+int destroyed_objects;
+
+typedef struct {
+    int magic;
+    int uses;
+} test_object_t;
+
+static void construct_object(void* object) {
+    *(test_object_t*) object = (test_object_t) {42, 0};
+    constructed_objects++;
+}
+
+static void destroy_object(void* object) {
+    assert_int_equal(((test_object_t*) object)->magic, 42);
+    destroyed_objects++;
+}
+
+static void test_objcache() {
+    init_allocator(virtual_heap, 14, 4);
+    constructed_objects = 0;
+    destroyed_objects = 0;
+
+    object_cache_t cache;
+    assert_int_not_equal(virtual_cache_init(virtual_heap, &cache, 24, 3, NULL,
+                                            NULL), 0);
+    assert_int_equal(virtual_cache_init(virtual_heap, &cache, 24, 64,
+                                        construct_object, destroy_object), 0);
+
+    // objects come constructed and aligned, a slab at a time
+    test_object_t* objects[20];
+    for (int i = 0; i < 20; i++) {
+        objects[i] = virtual_cache_alloc(&cache);
+        assert_non_null(objects[i]);
+        assert_int_equal((uintptr_t) objects[i] % 64, 0);
+        assert_int_equal(objects[i]->magic, 42);
+        objects[i]->uses++;
+    }
+
+    cache_stats_t stats;
+    virtual_cache_stats(&cache, &stats);
+    assert_int_equal(stats.objects_in_use, 20);
+    assert_int_equal(stats.slabs, (20 + stats.objects_per_slab - 1)
+                                  / stats.objects_per_slab);
+    assert_int_equal(constructed_objects, stats.slabs
+                                          * stats.objects_per_slab);
+
+    // a freed object comes back as it was left, without being constructed again
+    assert_int_equal(virtual_cache_free(&cache, objects[7]), 0);
+    assert_ptr_equal(virtual_cache_alloc(&cache), objects[7]);
+    assert_int_equal(objects[7]->uses, 1);
+    assert_int_equal(constructed_objects, stats.slabs
+                                          * stats.objects_per_slab);
+
+    // pointers that aren't objects from the cache are refused
+    void* block = virtual_malloc(virtual_heap, 1 << 8);
+    assert_int_not_equal(virtual_cache_free(&cache, block), 0);
+    assert_int_not_equal(virtual_cache_free(&cache,
+                                            (uint8_t*) objects[0] + 8), 0);
+    assert_int_equal(virtual_free(virtual_heap, block), 0);
+
+    assert_int_not_equal(virtual_cache_destroy(&cache), 0);
+    for (int i = 0; i < 20; i++)
+        assert_int_equal(virtual_cache_free(&cache, objects[i]), 0);
+
+    // empty slabs are kept until reaped
+    virtual_cache_stats(&cache, &stats);
+    assert_int_equal(stats.empty_slabs, stats.slabs);
+    assert_int_equal(stats.allocs, 21);
+    assert_int_equal(stats.frees, 21);
+    assert_int_equal(destroyed_objects, 0);
+    assert_int_equal(virtual_cache_reap(&cache), stats.slabs);
+    assert_int_equal(destroyed_objects, constructed_objects);
+    assert_int_equal(virtual_cache_destroy(&cache), 0);
+
+    const char* expected[] = {
+        "free 16384",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_objcache_pressure() {
+    init_allocator(virtual_heap, 12, 4);
+
+    object_cache_t cache;
+    assert_int_equal(virtual_cache_init(virtual_heap, &cache, 100, 8, NULL,
+                                        NULL), 0);
+
+    // fill the heap with slabs, then free every object
+    void* objects[64];
+    int count = 0;
+    while ((objects[count] = virtual_cache_alloc(&cache)) != NULL)
+        count++;
+    assert_true(count > 8);
+    for (int i = 0; i < count; i++)
+        assert_int_equal(virtual_cache_free(&cache, objects[i]), 0);
+
+    // running out of heap hands the empty slabs back
+    void* block = virtual_malloc(virtual_heap, 1 << 11);
+    assert_non_null(block);
+
+    cache_stats_t stats;
+    virtual_cache_stats(&cache, &stats);
+    assert_int_equal(stats.slabs, 0);
+    assert_int_equal(stats.destroyed, stats.constructed);
+
+    assert_non_null(virtual_cache_alloc(&cache));
+}
+
+static void test_objcache_reclaim() {
+    for (int kind = 0; kind < 5; kind++) {
+        init_allocator(virtual_heap, 12, 4);
+
+        object_cache_t cache;
+        assert_int_equal(virtual_cache_init(virtual_heap, &cache, 100, 8,
+                                            NULL, NULL), 0);
+
+        void* objects[64];
+        int count = 0;
+        while ((objects[count] = virtual_cache_alloc(&cache)) != NULL)
+            count++;
+        for (int i = 0; i < count; i++)
+            assert_int_equal(virtual_cache_free(&cache, objects[i]), 0);
+
+        // every way of allocating hands the empty slabs back when it runs out
+        void* blocks[2] = {NULL};
+        switch (kind) {
+        case 0:
+            blocks[0] = virtual_calloc(virtual_heap, 1, 1 << 11);
+            break;
+        case 1:
+            blocks[0] = virtual_aligned_alloc(virtual_heap, 1 << 11, 1 << 10);
+            break;
+        case 2:
+            blocks[0] = virtual_malloc_lifetime(virtual_heap, 1 << 11,
+                                                LIFETIME_LONG);
+            break;
+        case 3:
+            blocks[0] = virtual_malloc_near(virtual_heap, 1 << 11,
+                                            get_blocks(virtual_heap));
+            break;
+        case 4:
+            assert_int_equal(virtual_malloc_batch(virtual_heap, 1 << 10, 2,
+                                                  blocks), 2);
+            break;
+        }
+        assert_non_null(blocks[0]);
+
+        cache_stats_t stats;
+        virtual_cache_stats(&cache, &stats);
+        assert_int_equal(stats.slabs, 0);
+    }
+}
+
+static void test_ring() {
+    init_allocator(virtual_heap, 12, 4);
+    ring_t ring;
+    assert_int_equal(virtual_ring_init(virtual_heap, &ring, 1 << 8), 0);
+    uint8_t* base = get_blocks(virtual_heap);
+    assert_null(virtual_ring_alloc(&ring, 0));
+
+    // records follow each other, each after a header
+    uint8_t* records[4];
+    for (int i = 0; i < 3; i++) {
+        records[i] = virtual_ring_alloc(&ring, 60);
+        assert_ptr_equal(records[i], base + RING_ALIGN + i * 80);
+        memset(records[i], i, 60);
+    }
+    assert_null(virtual_ring_alloc(&ring, 1));
+
+    // space only frees up from the oldest record
+    assert_int_equal(virtual_ring_release(&ring, records[1]), 0);
+    assert_int_not_equal(virtual_ring_release(&ring, records[1]), 0);
+    assert_null(virtual_ring_alloc(&ring, 16));
+    assert_int_equal(virtual_ring_release(&ring, records[0]), 0);
+    assert_int_equal(ring.tail, 160);
+
+    // a record that doesn't fit at the end wraps around to the start
+    records[3] = virtual_ring_alloc(&ring, 100);
+    assert_ptr_equal(records[3], base + RING_ALIGN);
+    assert_null(virtual_ring_alloc(&ring, 32));
+    assert_non_null(virtual_ring_alloc(&ring, 16));
+    for (int i = 0; i < 60; i++)
+        assert_int_equal(records[2][i], 2);
+
+    // the space left at the end goes with the record before it
+    assert_int_equal(virtual_ring_release(&ring, records[2]), 0);
+    assert_int_equal(ring.tail, 0);
+    assert_int_not_equal(virtual_ring_release(&ring, base + 8), 0);
+
+    virtual_ring_destroy(&ring);
+
+    const char* expected[] = {
+        "free 4096",
+    };
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_ring_fifo() {
+    init_allocator(virtual_heap, 16, 4);
+    ring_t ring;
+    assert_int_equal(virtual_ring_init(virtual_heap, &ring, 1 << 12), 0);
+
+    // a window of records of varying length moving around the ring, released
+    // a little out of order
+    uint8_t* window[8] = {0};
+    uint32_t sizes[8];
+    for (uint32_t i = 0; i < 10000; i++) {
+        uint32_t slot = i % 8;
+        if (window[slot] != NULL) {
+            uint32_t other = (slot + (i % 3 == 0)) % 8;
+            if (window[other] != NULL) {
+                uint8_t* tmp = window[slot];
+                window[slot] = window[other];
+                window[other] = tmp;
+                uint32_t tmp_size = sizes[slot];
+                sizes[slot] = sizes[other];
+                sizes[other] = tmp_size;
+            }
+
+            for (uint32_t j = 0; j < sizes[slot]; j++)
+                assert_int_equal(window[slot][j], sizes[slot] & 0xff);
+            assert_int_equal(virtual_ring_release(&ring, window[slot]), 0);
+        }
+
+        sizes[slot] = 1 + (i * 37) % 300;
+        window[slot] = virtual_ring_alloc(&ring, sizes[slot]);
+        assert_non_null(window[slot]);
+        memset(window[slot], sizes[slot] & 0xff, sizes[slot]);
+    }
+
+    for (int i = 0; i < 8; i++)
+        assert_int_equal(virtual_ring_release(&ring, window[i]), 0);
+    assert_int_equal(ring.used, 0);
+    virtual_ring_destroy(&ring);
+}
+
+static void test_malloc_near() {
+    init_allocator(virtual_heap, 10, 4);
+
+    uint8_t* blocks[1 << 6];
+    for (int i = 0; i < 1 << 6; i++) {
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 4);
+    }
+
+    virtual_free(virtual_heap, blocks[2]);
+    virtual_free(virtual_heap, blocks[60]);
+
+    // the hole beside the hint is taken over the leftmost one
+    assert_ptr_equal(virtual_malloc_near(virtual_heap, 1 << 4, blocks[58]),
+                     blocks[60]);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), blocks[2]);
+
+    near_stats_t stats;
+    virtual_near_stats(virtual_heap, &stats);
+    assert_int_equal(stats.placed, 1);
+    assert_int_equal(stats.fallbacks, 0);
+    assert_int_equal(stats.total_distance, 2 << 4);
+    assert_int_equal(stats.max_distance, 2 << 4);
+}
+
+static void test_malloc_near_split() {
+    const char* expected[] = {
+        "allocated 16",
+        "allocated 16",
+        "free 32",
+        "free 64",
+        "free 64",
+        "allocated 16",
+        "free 16",
+        "free 32",
+    };
+
+    init_allocator(virtual_heap, 8, 4);
+    uint8_t* heap = virtual_malloc(virtual_heap, 1 << 4);
+
+    // a hint inside a free block splits it down to the hint's position
+    uint8_t* block = virtual_malloc_near(virtual_heap, 1 << 4, heap + 200);
+    assert_ptr_equal(block, heap + 192);
+
+    // a hint outside the heap gets the usual placement
+    assert_ptr_equal(virtual_malloc_near(virtual_heap, 1 << 4, NULL),
+                     heap + 16);
+
+    near_stats_t stats;
+    virtual_near_stats(virtual_heap, &stats);
+    assert_int_equal(stats.placed, 1);
+    assert_int_equal(stats.fallbacks, 1);
+    assert_int_equal(stats.total_distance, 8);
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+}
+
+static void test_malloc_lifetime() {
+    const char* expected[] = {
+        "allocated 16",
+        "allocated 16",
+        "free 32",
+        "free 64",
+        "free 64",
+        "free 32",
+        "free 16",
+        "allocated 16",
+    };
+
+    init_allocator(virtual_heap, 8, 4);
+    uint8_t* heap = get_blocks(virtual_heap);
+
+    // the two ends of the heap fill from opposite sides, even though the
+    // smallest free block is beside the long-lived one
+    assert_ptr_equal(virtual_malloc_lifetime(virtual_heap, 1 << 4,
+                                             LIFETIME_LONG), heap + 240);
+    assert_ptr_equal(virtual_malloc_lifetime(virtual_heap, 1 << 4,
+                                             LIFETIME_SHORT), heap);
+    assert_ptr_equal(virtual_malloc_lifetime(virtual_heap, 1 << 4,
+                                             LIFETIME_SHORT), heap + 16);
+
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    init_allocator_engine(virtual_heap, 8, 4, ENGINE_LOCKFREE);
+    assert_non_null(virtual_malloc_lifetime(virtual_heap, 1 << 4,
+                                            LIFETIME_LONG));
+}
+
+static void test_lifetime_merge() {
+    init_allocator(virtual_heap, 10, 4);
+
+    void* transient[4];
+    for (int i = 0; i < 4; i++) {
+        transient[i] = virtual_malloc_lifetime(virtual_heap, 1 << 6,
+                                               LIFETIME_SHORT);
+        assert_non_null(virtual_malloc_lifetime(virtual_heap, 1 << 6,
+                                                LIFETIME_LONG));
+    }
+
+    // with the long-lived blocks out of the way, the transient ones merge back
+    // into the low half of the heap
+    assert_int_equal(virtual_free_batch(virtual_heap, transient, 4), 0);
+
+    heap_stats_t stats;
+    assert_int_equal(virtual_stats(virtual_heap, &stats), 0);
+    assert_int_equal(stats.largest_free_order, 9);
+    assert_int_equal(stats.free_blocks[8], 1);
+}
+
+static void test_placement_buddy() {
+    init_allocator_placement(virtual_heap, 6, 3, PLACEMENT_BUDDY);
+
+    void* first = virtual_malloc(virtual_heap, 1 << 4);
+    virtual_malloc(virtual_heap, 1 << 3);
+    void* split = virtual_malloc(virtual_heap, 1 << 3);
+    void* whole = virtual_malloc(virtual_heap, 1 << 4);
+    virtual_malloc(virtual_heap, 1 << 4);
+
+    virtual_free(virtual_heap, first);
+    virtual_free(virtual_heap, split);
+    virtual_free(virtual_heap, whole);
+
+    // the first block's buddy is only partly allocated, so the block whose
+    // buddy is allocated is filled in instead, leaving the first to merge
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), whole);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), first);
+}
+
+static void test_placement_lifo() {
+    void* blocks[4];
+
+    init_allocator_placement(virtual_heap, 8, 4, PLACEMENT_LIFO);
+    for (int i = 0; i < 4; i++) {
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 4);
+    }
+
+    // the two blocks merge, but the last one freed is still handed out first,
+    // from the middle of the merged block
+    virtual_free(virtual_heap, blocks[0]);
+    virtual_free(virtual_heap, blocks[1]);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), blocks[1]);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), blocks[0]);
+
+    // initialising the heap again goes back to the leftmost block
+    init_allocator(virtual_heap, 8, 4);
+    for (int i = 0; i < 4; i++) {
+        blocks[i] = virtual_malloc(virtual_heap, 1 << 4);
+    }
+
+    virtual_free(virtual_heap, blocks[0]);
+    virtual_free(virtual_heap, blocks[1]);
+    assert_ptr_equal(virtual_malloc(virtual_heap, 1 << 4), blocks[0]);
+}
+
+static void test_heap_handles() {
+    const char* expected[] = {
+        "allocated 128",
+        "free 128",
+        "allocated 512",
+        "free 512",
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 64",
+        "free 128",
+    };
+
+    init_allocator(virtual_heap, 8, 4);
+    assert_non_null(virtual_malloc(virtual_heap, 16));
+
+    heap_t* first = virtual_heap_create(8, 4);
+    heap_t* second = virtual_heap_create(10, 4);
+    assert_non_null(first);
+    assert_non_null(second);
+
+    // each heap has blocks of its own, apart from the heap at the program break
+    uint8_t* a = virtual_heap_malloc(first, 100);
+    uint8_t* b = virtual_heap_malloc(second, 300);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_int_equal(virtual_heap_usable_size(first, a), 128);
+    assert_int_equal(virtual_heap_usable_size(first, b), 0);
+    assert_int_equal(virtual_heap_free(first, b), 1);
+
+    virtual_heap_info(first);
+    virtual_heap_info(second);
+    virtual_info(virtual_heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+    assert_stats_match_info();
+
+    // the block's buddy is free, so it grows without moving
+    memset(a, 1, 100);
+    assert_ptr_equal(virtual_heap_realloc(first, a, 256), a);
+    assert_int_equal(a[99], 1);
+    assert_null(virtual_heap_malloc(first, 1));
+
+    // the mapping is fresh, so calloc hands out zeroes
+    uint8_t* c = virtual_heap_calloc(second, 64, 8);
+    assert_non_null(c);
+    for (int i = 0; i < 512; i++) {
+        assert_int_equal(c[i], 0);
+    }
+
+    assert_int_equal(virtual_heap_free(first, a), 0);
+    assert_int_equal(virtual_heap_free(second, b), 0);
+
+    virtual_heap_destroy(first);
+    virtual_heap_destroy(second);
+    assert_stats_match_info();
+}
+
+static void test_heap_handle_memory() {
+    const char* expected[] = {
+        "free 256",
+    };
+
+    size_t size = virtual_heap_footprint(8, 4);
+    uint8_t* memory = malloc(size);
+    memset(memory, 0xff, size);
+
+    // the blocks alone would fill this much, leaving no room for the rest
+    assert_null(virtual_heap_create_in(memory, 64, 8, 4));
+    assert_null(virtual_heap_create_in(memory, 256, 8, 4));
+
+    heap_t* heap = virtual_heap_create_in(memory, size, 8, 4);
+    assert_non_null(heap);
+
+    // the memory isn't known to be clear, so calloc clears it
+    uint8_t* blocks[16];
+    blocks[0] = virtual_heap_calloc(heap, 1, 16);
+    for (int i = 0; i < 16; i++) {
+        assert_int_equal(blocks[0][i], 0);
+    }
+
+    // the information grows to a byte for every block without running out of
+    // memory, and realloc still has room to back it up
+    for (int i = 1; i < 16; i++) {
+        blocks[i] = virtual_heap_malloc(heap, 16);
+        assert_non_null(blocks[i]);
+    }
+    assert_null(virtual_heap_malloc(heap, 16));
+    assert_null(virtual_heap_realloc(heap, blocks[0], 32));
+
+    for (int i = 0; i < 16; i++) {
+        assert_int_equal(virtual_heap_free(heap, blocks[i]), 0);
+    }
+    virtual_heap_info(heap);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // the memory can be used again once the heap is gone
+    virtual_heap_destroy(heap);
+    heap = virtual_heap_create_in(memory, size, 8, 4);
+    assert_non_null(heap);
+    virtual_heap_destroy(heap);
+
+    free(memory);
+}
+
+static void test_heap_handle_unaligned() {
+    const char* expected[] = {
+        "free 256",
+    };
+
+    size_t size = virtual_heap_footprint(8, 4);
+    void* memory;
+    assert_int_equal(posix_memalign(&memory, 1 << 8, (1 << 8) + size), 0);
+
+    // wherever the memory starts relative to the blocks' alignment, moving the
+    // handle along to align it still leaves room for everything else
+    for (size_t offset = 1; offset < 1 << 8; offset++) {
+        heap_t* heap = virtual_heap_create_in((uint8_t*) memory + offset, size,
+                                              8, 4);
+        assert_non_null(heap);
+
+        uint8_t* blocks[16];
+        for (int i = 0; i < 16; i++) {
+            blocks[i] = virtual_heap_malloc(heap, 16);
+            assert_non_null(blocks[i]);
+        }
+        assert_null(virtual_heap_realloc(heap, blocks[0], 32));
+
+        for (int i = 0; i < 16; i++) {
+            assert_int_equal(virtual_heap_free(heap, blocks[i]), 0);
+        }
+        virtual_heap_info(heap);
+        assert_stdout_equal(expected, ARR_SIZE(expected));
+
+        virtual_heap_destroy(heap);
+    }
+
+    free(memory);
+}
+
+static void* heap_handle_thread(void* arg) {
+    unsigned int seed = (uintptr_t) arg;
+    uint8_t tag = (uintptr_t) arg;
+    uint8_t* live[STRESS_LIVE] = {NULL};
+    uint32_t sizes[STRESS_LIVE];
+
+    heap_t* heap = virtual_heap_create(12, 4);
+    if (heap == NULL)
+        return (void*) 1;
+
+    for (int i = 0; i < STRESS_ITERATIONS; i++) {
+        int slot = rand_r(&seed) % STRESS_LIVE;
+
+        if (live[slot] != NULL) {
+            for (uint32_t j = 0; j < sizes[slot]; j++) {
+                if (live[slot][j] != tag)
+                    return (void*) 1;
+            }
+
+            if (virtual_heap_free(heap, live[slot]))
+                return (void*) 1;
+            live[slot] = NULL;
+        } else {
+            sizes[slot] = 1 + rand_r(&seed) % 256;
+            live[slot] = virtual_heap_malloc(heap, sizes[slot]);
+            if (live[slot] != NULL)
+                memset(live[slot], tag, sizes[slot]);
+        }
+    }
+
+    // the blocks still live go with the heap
+    virtual_heap_destroy(heap);
+
+    return NULL;
+}
+
+static void test_heap_handles_threads() {
+    init_allocator(virtual_heap, 16, 4);
+
+    // threads with heaps of their own run alongside threads sharing the heap at
+    // the program break, without touching its blocks or statistics
+    pthread_t threads[2 * STRESS_THREADS];
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[2 * i], NULL, heap_handle_thread, (void*) i);
+        pthread_create(&threads[2 * i + 1], NULL, stress_thread, (void*) i);
+    }
+
+    for (int i = 0; i < 2 * STRESS_THREADS; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        assert_null(ret);
+    }
+
+    assert_stats_match_info();
+}
+
+static void test_subheap() {
+    const char* expected[] = {
+        "allocated 4096",
+        "allocated 1024",
+        "free 1024",
+        "free 2048",
+        "free 8192",
+        "free 4096",
+        "free 16384",
+    };
+
+    heap_t* parent = virtual_heap_create(14, 4);
+    assert_null(virtual_subheap_create(parent, 15, 4));
+
+    // the child's blocks are the whole of its block, with its handle and
+    // information in a smaller block beside it
+    heap_t* child = virtual_subheap_create(parent, 12, 4);
+    assert_non_null(child);
+    virtual_heap_info(parent);
+    virtual_heap_info(child);
+
+    // the parent's block was fresh, and so is the child
+    uint8_t* blocks[256];
+    for (int i = 0; i < 256; i++) {
+        blocks[i] = virtual_heap_calloc(child, 1, 16);
+        assert_non_null(blocks[i]);
+        for (int j = 0; j < 16; j++) {
+            assert_int_equal(blocks[i][j], 0);
+        }
+        memset(blocks[i], 0xff, 16);
+    }
+    assert_null(virtual_heap_malloc(child, 16));
+
+    // the child's heap lives in its own block, apart from the parent's
+    void* rest = virtual_heap_malloc(parent, 1 << 13);
+    assert_non_null(rest);
+    assert_int_equal(virtual_heap_free(parent, blocks[1]), 1);
+    assert_int_equal(virtual_heap_free(parent, rest), 0);
+
+    // the whole budget can go to a single block
+    for (int i = 0; i < 256; i++) {
+        assert_int_equal(virtual_heap_free(child, blocks[i]), 0);
+    }
+    void* whole = virtual_heap_malloc(child, 1 << 12);
+    assert_ptr_equal(whole, blocks[0]);
+
+    // destroying the child hands its blocks back, blocks and all
+    virtual_heap_destroy(child);
+    virtual_heap_info(parent);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+
+    // the child's information can also end up before its blocks
+    void* hole = virtual_heap_malloc(parent, 1 << 10);
+    assert_non_null(virtual_heap_malloc(parent, 1 << 10));
+    assert_int_equal(virtual_heap_free(parent, hole), 0);
+    child = virtual_subheap_create(parent, 12, 4);
+    assert_non_null(child);
+    assert_ptr_equal(child, hole);
+
+    for (int i = 0; i < 256; i++) {
+        assert_non_null(virtual_heap_malloc(child, 16));
+    }
+    assert_null(virtual_heap_malloc(child, 16));
+    virtual_heap_destroy(child);
+
+    virtual_heap_destroy(parent);
+}
+
+static void test_subheap_nested() {
+    const char* expected[] = {
+        "allocated 32768",
+        "allocated 8192",
+        "free 8192",
+        "free 16384",
+        "allocated 8192",
+        "allocated 2048",
+        "free 2048",
+        "free 4096",
+        "free 16384",
+        "allocated 16",
+        "free 16",
+        "free 32",
+        "free 64",
+        "free 128",
+        "free 256",
+        "free 512",
+        "free 1024",
+        "free 2048",
+        "free 4096",
+    };
+
+    init_allocator(virtual_heap, 16, 4);
+
+    // each child's heap is as big as its block
+    heap_t* tenant = virtual_subheap_create_at(virtual_heap, 15, 4);
+    assert_non_null(tenant);
+    heap_t* request = virtual_subheap_create(tenant, 13, 4);
+    assert_non_null(request);
+
+    assert_non_null(virtual_heap_malloc(request, 16));
+    virtual_info(virtual_heap);
+    virtual_heap_info(tenant);
+    virtual_heap_info(request);
+    assert_stdout_equal(expected, ARR_SIZE(expected));
+    assert_stats_match_info();
+
+    // the tenant's heap goes back to the heap at the program break with
+    // everything inside it, including the request's heap
+    virtual_heap_destroy(tenant);
+    assert_stats_match_info();
+
+    void* whole = virtual_malloc(virtual_heap, 1 << 16);
+    assert_non_null(whole);
+    virtual_free(virtual_heap, whole);
+}
+
 int main() {
     // Your own testing code here
     virtual_heap = sbrk(0);
@@ -737,9 +3307,89 @@ int main() {
         cmocka_unit_test_setup_teardown(test_realloc_same, setup, teardown),
         cmocka_unit_test_setup_teardown(test_realloc_move, setup, teardown),
         cmocka_unit_test_setup_teardown(test_realloc_move_smaller, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_realloc_grow_in_place, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_realloc_reserve, setup, teardown),
         cmocka_unit_test_setup_teardown(test_realloc_none, setup, teardown),
         cmocka_unit_test_setup_teardown(test_realloc_null, setup, teardown),
         cmocka_unit_test_setup_teardown(test_sbrk_fail, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_lockfree_malloc_split, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_lockfree_free_invalid, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_lockfree_full, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_lockfree_placement, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_lockfree_stress, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_subtree_steal, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_subtree_large, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_subtree_stress, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_reuse, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_limits, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_thread_exit, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_stress, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_remote_free, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_remote_orphan, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_remote_stress, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tcache_steal, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_pcpu_reuse, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_pcpu_stress, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_worker_reserve, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_worker_deferred, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_worker_double_free, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_worker_bad_free, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_worker_stress, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_free_batch, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_free_batch_invalid, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_free_batch_random, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_defer_frees, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_defer_frees_invalid, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_malloc_batch, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_malloc_batch_partial, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_stats, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_stats_concurrent, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_free_sized, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_free_sized_tree, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_aligned_alloc, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_aligned_alloc_offset, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_aligned_layout, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_calloc_fresh, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_calloc_merge, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_worker_prezero, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_scope, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_scope_nested, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_scope_realloc, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tags, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tags_churn, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tags_scope, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_bump, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_bump_many, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_objcache, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_objcache_pressure, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_objcache_reclaim, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_ring, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_ring_fifo, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_malloc_near, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_malloc_near_split, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_malloc_lifetime, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_lifetime_merge, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_placement_buddy, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_placement_lifo, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_heap_handles, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_heap_handle_memory, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_heap_handle_unaligned, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_heap_handles_threads, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_subheap, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_subheap_nested, setup, teardown),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);